@@ -0,0 +1,85 @@
+/* Trace consumers for the benchmark. Connects a number of consumers to the
+ * trace socket and discards what they read. A delay between reads makes a
+ * deliberately slow consumer. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BUFSIZE 65536
+
+static const char *path;
+static useconds_t delay = 0;
+
+static int
+dial(void)
+{
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(a.sun_path)) { errx(1, "path too long: %s", path); }
+	strcpy(a.sun_path, path);
+	for (int tries = 0; ; tries++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) { err(1, "socket"); }
+		if (connect(fd, (struct sockaddr *)&a, sizeof(a)) == 0) { return fd; }
+		close(fd);
+		if (tries == 100) { err(1, "connect: %s", path); }
+		usleep(10000);
+	}
+}
+
+static void *
+consume(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char *buf = malloc(BUFSIZE);
+	for (;;) {
+		ssize_t n = read(fd, buf, BUFSIZE);
+		if (n == 0) { break; }
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			break;
+		}
+		if (delay) { usleep(delay); }
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int count = 1, ch;
+	while ((ch = getopt(argc, argv, "n:d:")) != -1) {
+		switch (ch) {
+		case 'n': count = atoi(optarg); break;
+		case 'd': delay = (useconds_t)strtoul(optarg, NULL, 10); break;
+		default:
+			errx(1, "usage: consumer [-n count] [-d usec] sock");
+		}
+	}
+	if (optind != argc - 1 || count < 1) {
+		errx(1, "usage: consumer [-n count] [-d usec] sock");
+	}
+	path = argv[optind];
+
+	pthread_t *ts = calloc((size_t)count, sizeof(*ts));
+	for (int i = 0; i < count; i++) {
+		int fd = dial();
+		if (pthread_create(&ts[i], NULL, consume, (void *)(intptr_t)fd)) {
+			errx(1, "pthread_create failed");
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		pthread_join(ts[i], NULL);
+	}
+	return 0;
+}
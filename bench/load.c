@@ -0,0 +1,210 @@
+/* A closed-loop load generator for bench/server. Each connection sends one
+ * message, waits for its one byte answer, and sends the next, so the rate
+ * and round trip latency of the primary path are measured together. The
+ * result is printed as a single JSON object. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SAMPLES 65536
+
+static int port = 0;
+static int conns = 1;
+static int threads = 1;
+static size_t size = 64;
+static double seconds = 1.0;
+static char *msg;
+
+struct conn {
+	int fd;
+	uint64_t start;
+};
+
+struct worker {
+	pthread_t thread;
+	int count;
+	uint64_t msgs;
+	uint64_t seen;               /* Latencies offered to the reservoir. */
+	uint64_t rng;
+	uint64_t *lat;               /* Reservoir of latencies in ns. */
+	size_t nlat;
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int
+dial(void)
+{
+	struct sockaddr_in a = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	for (int tries = 0; ; tries++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+		if (fd < 0) { err(1, "socket"); }
+		if (connect(fd, (struct sockaddr *)&a, sizeof(a)) == 0) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			return fd;
+		}
+		close(fd);
+		if (tries == 100) { err(1, "connect"); }
+		usleep(10000);
+	}
+}
+
+static void
+post(struct conn *c)
+{
+	c->start = now();
+	for (size_t off = 0; off < size; ) {
+		ssize_t n = write(c->fd, msg + off, size - off);
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			err(1, "write");
+		}
+		off += (size_t)n;
+	}
+}
+
+static void
+record(struct worker *w, uint64_t ns)
+{
+	/* Reservoir sampling keeps the percentiles fair over long runs. */
+	w->msgs++;
+	if (w->nlat < SAMPLES) {
+		w->lat[w->nlat++] = ns;
+	}
+	else {
+		w->rng = w->rng * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint64_t i = (w->rng >> 16) % (w->seen + 1);
+		if (i < SAMPLES) { w->lat[i] = ns; }
+	}
+	w->seen++;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct conn *cs = calloc((size_t)w->count, sizeof(*cs));
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	for (int i = 0; i < w->count; i++) {
+		cs[i].fd = dial();
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &cs[i] };
+		epoll_ctl(ep, EPOLL_CTL_ADD, cs[i].fd, &ev);
+	}
+
+	for (int i = 0; i < w->count; i++) { post(&cs[i]); }
+
+	uint64_t end = now() + (uint64_t)(seconds * 1e9);
+	struct epoll_event evs[256];
+	while (now() < end) {
+		int n = epoll_wait(ep, evs, 256, 100);
+		for (int i = 0; i < n; i++) {
+			struct conn *c = evs[i].data.ptr;
+			char ack;
+			ssize_t rc = read(c->fd, &ack, 1);
+			if (rc <= 0) {
+				if (rc < 0 && errno == EINTR) { continue; }
+				errx(1, "server closed the connection");
+			}
+			record(w, now() - c->start);
+			post(c);
+		}
+	}
+
+	for (int i = 0; i < w->count; i++) { close(cs[i].fd); }
+	close(ep);
+	free(cs);
+	return NULL;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+	while ((ch = getopt(argc, argv, "c:t:s:d:")) != -1) {
+		switch (ch) {
+		case 'c': conns = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 's': size = strtoul(optarg, NULL, 10); break;
+		case 'd': seconds = strtod(optarg, NULL); break;
+		default:
+			errx(1, "usage: load [-c conns] [-t threads] [-s size] [-d seconds] port");
+		}
+	}
+	if (optind != argc - 1 || conns < 1 || threads < 1 || size == 0 || seconds <= 0) {
+		errx(1, "usage: load [-c conns] [-t threads] [-s size] [-d seconds] port");
+	}
+	port = atoi(argv[optind]);
+	int workers = threads < conns ? threads : conns;
+
+	msg = malloc(size);
+	memset(msg, 'x', size);
+
+	struct worker *ws = calloc((size_t)workers, sizeof(*ws));
+	uint64_t start = now();
+	for (int i = 0; i < workers; i++) {
+		ws[i].count = conns / workers + (i < conns % workers);
+		ws[i].rng = (uint64_t)i + 1;
+		ws[i].lat = malloc(SAMPLES * sizeof(uint64_t));
+		if (pthread_create(&ws[i].thread, NULL, worker_main, &ws[i])) {
+			errx(1, "pthread_create failed");
+		}
+	}
+
+	uint64_t msgs = 0;
+	size_t nlat = 0;
+	for (int i = 0; i < workers; i++) {
+		pthread_join(ws[i].thread, NULL);
+		msgs += ws[i].msgs;
+		nlat += ws[i].nlat;
+	}
+	double elapsed = (double)(now() - start) / 1e9;
+
+	uint64_t *lat = malloc((nlat + 1) * sizeof(uint64_t));
+	size_t n = 0;
+	for (int i = 0; i < workers; i++) {
+		memcpy(lat + n, ws[i].lat, ws[i].nlat * sizeof(uint64_t));
+		n += ws[i].nlat;
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp);
+	double p50 = n ? (double)lat[n / 2] / 1e3 : 0;
+	double p99 = n ? (double)lat[n * 99 / 100] / 1e3 : 0;
+
+	printf("{\"conns\":%d,\"threads\":%d,\"size\":%zu,\"seconds\":%.3f,"
+			"\"msgs\":%llu,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.3f,"
+			"\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+			conns, threads, size, elapsed,
+			(unsigned long long)msgs, (double)msgs / elapsed,
+			(double)msgs * (double)size / elapsed / 1e6,
+			p50, p99);
+	return 0;
+}
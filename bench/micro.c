@@ -0,0 +1,306 @@
+/* Microbenchmarks for the trace hot path. trace.c is included whole so its
+ * static pairing and framing functions can be timed on their own, and the
+ * rest of the library is linked as usual. Frames are written to a socketpair
+ * drained by another thread, and to a UDP socket nobody reads, which the
+ * kernel discards once it fills like /dev/null.
+ *
+ * Allocations are counted by wrapping the allocator at link time, so only
+ * the library's own calls are seen. Cycles are those of stats_clock(). */
+
+#include "trace.c"
+#include "advice.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <err.h>
+#include <sys/mman.h>
+
+#define CLIENT_FD (1 << 20)
+#define LOOKUP_SPAN 1024
+#define MAX_FD (CLIENT_FD + 2 * LOOKUP_SPAN)
+#define MMSG 8
+#define MMSG_IOV 4
+
+static _Atomic uint64_t allocs = 0;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+int __real_posix_memalign(void **, size_t, size_t);
+void *__real_mmap(void *, size_t, int, int, int, off_t);
+
+void *
+__wrap_malloc(size_t n)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_malloc(n);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t n)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_realloc(p, n);
+}
+
+int
+__wrap_posix_memalign(void **p, size_t align, size_t n)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_posix_memalign(p, align, n);
+}
+
+void *
+__wrap_mmap(void *addr, size_t n, int prot, int flags, int fd, off_t off)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_mmap(addr, n, prot, flags, fd, off);
+}
+
+static uint64_t iterations = 200000;
+static volatile int sunk;
+
+/* Parameters of the operation being timed. */
+static int op_fd, op_sink;
+static size_t op_size;
+static char *op_buf;
+static struct iovec op_iov[MMSG * MMSG_IOV];
+static struct mmsghdr op_mmsg[MMSG];
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+op_lookup(uint64_t i)
+{
+	sunk = fd_get_pair(table_get(&entries, op_fd + (int)(i & (LOOKUP_SPAN - 1))));
+}
+
+static void
+op_pair(uint64_t i)
+{
+	/* A reference is taken for the pairing as fd_spare would. */
+	int fd = op_fd + (int)(i & (LOOKUP_SPAN - 1));
+	struct chan *c = table_get(&chans, op_sink);
+	atomic_fetch_add(&c->refs, 1);
+	fd_pair(fd, op_sink);
+	fd_unpair(fd, table_get(&entries, fd), op_sink, false);
+}
+
+static void
+op_header(uint64_t i)
+{
+	_Alignas(8) char hdr[MULTIBUF];
+	sunk = (int)fd_header(hdr, i, i, MUX_DATA, 0, (ssize_t)op_size);
+}
+
+static void
+op_trace(uint64_t i)
+{
+	(void)i;
+	trace(op_fd, op_buf, (ssize_t)op_size);
+}
+
+static void
+op_tracev(uint64_t i)
+{
+	(void)i;
+	tracev(op_fd, op_iov, MMSG_IOV, op_size);
+}
+
+static void
+op_recvmmsg(uint64_t i)
+{
+	(void)i;
+	after_recvmmsg(MMSG, op_fd, op_mmsg, MMSG, 0, NULL);
+}
+
+static void
+measure(const char *name, const char *sink, void (*op)(uint64_t))
+{
+	char label[80];
+	snprintf(label, sizeof(label), "%s %s", name, sink);
+
+	for (uint64_t i = 0; i < iterations / 10; i++) { op(i); }
+
+	uint64_t a = atomic_load(&allocs), t = now(), c = stats_clock();
+	for (uint64_t i = 0; i < iterations; i++) { op(i); }
+	c = stats_clock() - c;
+	t = now() - t;
+	a = atomic_load(&allocs) - a;
+
+	/* A sink that fell behind unpairs the client, after which the numbers
+	 * only measure the lookup. */
+	if (op_sink >= 0 && (op == op_trace || op == op_tracev || op == op_recvmmsg) &&
+			fd_get_pair(table_get(&entries, op_fd)) != op_sink) {
+		printf("%-40s %10s\n", label, "dropped");
+		return;
+	}
+	printf("%-40s %10.1f %10.1f %10.3f\n", label,
+			(double)t / (double)iterations,
+			(double)c / (double)iterations,
+			(double)a / (double)iterations);
+}
+
+static void *
+drain(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char *buf = malloc(1 << 20);
+	while (read(fd, buf, 1 << 20) > 0) {}
+	free(buf);
+	return NULL;
+}
+
+static int
+sink_pair(void)
+{
+	int sv[2], size = 8 << 20;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { err(1, "socketpair"); }
+	/* The forced sizes are only allowed as root. */
+	if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0) {
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	if (setsockopt(sv[1], SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+		setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	pthread_t t;
+	if (pthread_create(&t, NULL, drain, (void *)(intptr_t)sv[1])) {
+		errx(1, "pthread_create failed");
+	}
+	pthread_detach(t);
+	return sv[0];
+}
+
+static int
+sink_null(void)
+{
+	struct sockaddr_in a = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t len = sizeof(a);
+	int rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx < 0 || tx < 0) { err(1, "socket"); }
+	if (bind(rx, (struct sockaddr *)&a, sizeof(a)) < 0 ||
+			getsockname(rx, (struct sockaddr *)&a, &len) < 0 ||
+			connect(tx, (struct sockaddr *)&a, sizeof(a)) < 0) {
+		err(1, "udp sink");
+	}
+	return tx;
+}
+
+/* A sink's channel holds a reference per pairing, plus one of its own that
+ * keeps the sink from ever being released. */
+static struct chan *
+sink_chan(int fd)
+{
+	struct chan *c = table_make(&chans, fd);
+	if (c == NULL) { errx(1, "sink fd out of range: %d", fd); }
+	atomic_store(&c->refs, 1);
+	atomic_store(&c->dead, false);
+	c->slot = -1;
+	return c;
+}
+
+/* Each size gets a fresh sink, so one that fell behind and was dropped
+ * only costs its own rows. */
+static void
+sweep(const char *sink, int (*open)(void))
+{
+	static const size_t sizes[] = { 64, 1024, 16384 };
+
+	op_fd = CLIENT_FD;
+	for (size_t s = 0; s < countof(sizes); s++) {
+		int fd = open();
+		op_sink = fd;
+		atomic_fetch_add(&sink_chan(fd)->refs, 1);
+		fd_pair(op_fd, fd);
+		op_size = sizes[s];
+		for (int i = 0; i < MMSG * MMSG_IOV; i++) {
+			op_iov[i].iov_base = op_buf + (i % MMSG_IOV) * (op_size / MMSG_IOV);
+			op_iov[i].iov_len = op_size / MMSG_IOV;
+		}
+		for (int i = 0; i < MMSG; i++) {
+			op_mmsg[i].msg_hdr.msg_iov = &op_iov[i * MMSG_IOV];
+			op_mmsg[i].msg_hdr.msg_iovlen = MMSG_IOV;
+			op_mmsg[i].msg_len = (unsigned)op_size;
+		}
+
+		char name[32];
+		snprintf(name, sizeof(name), "trace/%zu", op_size);
+		measure(name, sink, op_trace);
+		snprintf(name, sizeof(name), "tracev/%dx%zu", MMSG_IOV, op_size / MMSG_IOV);
+		measure(name, sink, op_tracev);
+		snprintf(name, sizeof(name), "after_recvmmsg/%dx%zu", MMSG, op_size);
+		measure(name, sink, op_recvmmsg);
+		fd_unpair(op_fd, table_get(&entries, op_fd), fd, false);
+		xclose(fd);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n': iterations = strtoull(optarg, NULL, 10); break;
+		default: errx(1, "usage: micro [-n iterations]");
+		}
+	}
+	if (iterations == 0) { errx(1, "usage: micro [-n iterations]"); }
+
+	op_buf = malloc(16384);
+	memset(op_buf, 'x', 16384);
+
+	/* No listener, so no helper thread; sinks are paired by hand. */
+	struct trace_opt opt = { .mode = 0, .sample = TRACE_SAMPLE_ALL };
+	trace_init(MAX_FD, -1, &opt);
+	stats_init(0, false);
+
+	int null = sink_null();
+	printf("%-40s %10s %10s %10s\n", "op", "ns/op", "cycles/op", "allocs/op");
+
+	/* Lookups of unpaired fds at the low and high end of the table. */
+	op_sink = -1;
+	op_fd = 0;
+	measure("fd_get_pair", "low", op_lookup);
+	op_fd = CLIENT_FD;
+	measure("fd_get_pair", "high", op_lookup);
+
+	sink_chan(null);
+	op_sink = null;
+	for (int fd = CLIENT_FD; fd < CLIENT_FD + LOOKUP_SPAN; fd++) {
+		table_make(&entries, fd);
+	}
+	measure("fd_pair+fd_unpair", "high", op_pair);
+
+	op_sink = -1;
+	op_size = 1024;
+	measure("fd_header", "binary", op_header);
+
+	static const struct { const char *name; int mode; } modes[] = {
+		{ "raw", 0 },
+		{ "mux", TRACE_MULTIPLEX },
+	};
+	for (size_t m = 0; m < countof(modes); m++) {
+		char name[32];
+		trace_mode = modes[m].mode;
+		snprintf(name, sizeof(name), "%s socketpair", modes[m].name);
+		sweep(name, sink_pair);
+		snprintf(name, sizeof(name), "%s null", modes[m].name);
+		sweep(name, sink_null);
+	}
+	return 0;
+}
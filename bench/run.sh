@@ -0,0 +1,87 @@
+#!/bin/sh
+# Runs bench/server under each scenario across the sweep, drives it with
+# bench/load, and prints a JSON array of the results. Each dimension of the
+# sweep may be overridden from the environment with a space separated list.
+#
+#   base  the server alone
+#   idle  under teexec with no consumer connected
+#   fast  under teexec with a consumer per connection
+#   slow  under teexec with consumers that pause between reads
+#   mux   under teexec -m with a single consumer
+
+set -e
+
+BIN=${BIN:-build/bin/teexec}
+DIR=${DIR:-build/bench}
+OUT=${OUT:-$DIR/results.json}
+PORT=${PORT:-19080}
+SOCK=${SOCK:-/tmp/teexec-bench.sock}
+TIME=${TIME:-1}
+SLOW=${SLOW:-2000}
+SCENARIOS=${SCENARIOS:-base idle fast slow mux}
+CONNS=${CONNS:-1 16 64}
+SIZES=${SIZES:-64 4096 65536}
+THREADS=${THREADS:-1 4}
+READS=${READS:-read readv recvmmsg}
+
+server=
+consumer=
+
+stop() {
+	for pid in $consumer $server; do
+		kill $pid 2>/dev/null || true
+		wait $pid 2>/dev/null || true
+	done
+	server=
+	consumer=
+}
+trap 'stop; exit 1' INT TERM
+
+run() {
+	scenario=$1 conns=$2 size=$3 threads=$4 read=$5
+	cmd="$DIR/server -t $threads -s $size -r $read $PORT"
+	case $scenario in
+	base) ;;
+	mux)  cmd="$BIN -t $SOCK -m -- $cmd" ;;
+	*)    cmd="$BIN -t $SOCK -- $cmd" ;;
+	esac
+
+	$cmd >/dev/null &
+	server=$!
+	case $scenario in
+	fast) $DIR/consumer -n $conns $SOCK >/dev/null & consumer=$! ;;
+	slow) $DIR/consumer -n $conns -d $SLOW $SOCK >/dev/null & consumer=$! ;;
+	mux)  $DIR/consumer -n 1 $SOCK >/dev/null & consumer=$! ;;
+	esac
+	sleep 0.3
+
+	result=$($DIR/load -c $conns -t $threads -s $size -d $TIME $PORT) || true
+	stop
+	if [ -n "$result" ]; then
+		echo "{\"scenario\":\"$scenario\",\"read\":\"$read\",${result#\{}"
+	fi
+}
+
+{
+	echo "["
+	sep=
+	for scenario in $SCENARIOS; do
+		for conns in $CONNS; do
+			for size in $SIZES; do
+				for threads in $THREADS; do
+					for read in $READS; do
+						line=$(run $scenario $conns $size $threads $read)
+						[ -n "$line" ] || continue
+						printf '%s' "$sep$line"
+						echo "$line" >&2
+						sep=",
+"
+					done
+				done
+			done
+		done
+	done
+	echo
+	echo "]"
+} > $OUT
+cat $OUT
@@ -0,0 +1,170 @@
+/* An epoll server for benchmarking the traced path. Each client sends
+ * messages of a fixed size, and the server answers every complete message
+ * with a single byte. Each thread has its own listener on the port. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <err.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BUFSIZE 65536
+#define NIOV 4
+
+enum { READ_READ, READ_READV, READ_RECVMMSG };
+
+static int port = 0;
+static size_t size = 64;
+static int style = READ_READ;
+
+struct conn {
+	int fd;
+	size_t have;  /* Bytes of the current message received. */
+};
+
+static int
+listener(void)
+{
+	int s = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0), on = 1;
+	if (s < 0) { err(1, "socket"); }
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	struct sockaddr_in a = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	if (bind(s, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(s, 1024) < 0) {
+		err(1, "bind");
+	}
+	return s;
+}
+
+static ssize_t
+input(int fd, char *buf)
+{
+	switch (style) {
+	case READ_READV: {
+		struct iovec iov[NIOV];
+		for (int i = 0; i < NIOV; i++) {
+			iov[i].iov_base = buf + i * (BUFSIZE / NIOV);
+			iov[i].iov_len = BUFSIZE / NIOV;
+		}
+		return readv(fd, iov, NIOV);
+	}
+	case READ_RECVMMSG: {
+		struct iovec iov[NIOV];
+		struct mmsghdr mm[NIOV];
+		memset(mm, 0, sizeof(mm));
+		for (int i = 0; i < NIOV; i++) {
+			iov[i].iov_base = buf + i * (BUFSIZE / NIOV);
+			iov[i].iov_len = BUFSIZE / NIOV;
+			mm[i].msg_hdr.msg_iov = &iov[i];
+			mm[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = recvmmsg(fd, mm, NIOV, MSG_DONTWAIT, NULL);
+		if (n <= 0) { return n; }
+		ssize_t len = 0;
+		for (int i = 0; i < n; i++) { len += mm[i].msg_len; }
+		return len;
+	}
+	default:
+		return read(fd, buf, BUFSIZE);
+	}
+}
+
+static void
+serve(struct conn *c, char *buf)
+{
+	ssize_t n = input(c->fd, buf);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return; }
+	if (n <= 0) {
+		close(c->fd);
+		free(c);
+		return;
+	}
+
+	/* One byte answers each message completed by this read. */
+	char ack[BUFSIZE];
+	size_t done = (c->have + n) / size;
+	c->have = (c->have + n) % size;
+	while (done > 0) {
+		size_t len = done < sizeof(ack) ? done : sizeof(ack);
+		memset(ack, '.', len);
+		if (write(c->fd, ack, len) < 0) { break; }
+		done -= len;
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	(void)arg;
+	int s = listener();
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+
+	char *buf = malloc(BUFSIZE);
+	struct epoll_event evs[256];
+	for (;;) {
+		int n = epoll_wait(ep, evs, 256, -1);
+		for (int i = 0; i < n; i++) {
+			struct conn *c = evs[i].data.ptr;
+			if (c) {
+				serve(c, buf);
+				continue;
+			}
+			int fd;
+			while ((fd = accept4(s, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+				int on = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				c = calloc(1, sizeof(*c));
+				c->fd = fd;
+				struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+				epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev);
+			}
+		}
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int threads = 1, ch;
+	while ((ch = getopt(argc, argv, "t:s:r:")) != -1) {
+		switch (ch) {
+		case 't': threads = atoi(optarg); break;
+		case 's': size = strtoul(optarg, NULL, 10); break;
+		case 'r':
+			if (strcmp(optarg, "read") == 0)          { style = READ_READ; }
+			else if (strcmp(optarg, "readv") == 0)    { style = READ_READV; }
+			else if (strcmp(optarg, "recvmmsg") == 0) { style = READ_RECVMMSG; }
+			else { errx(1, "invalid read style: %s", optarg); }
+			break;
+		default:
+			errx(1, "usage: server [-t threads] [-s size] [-r read|readv|recvmmsg] port");
+		}
+	}
+	if (optind != argc - 1 || threads < 1 || size == 0) {
+		errx(1, "usage: server [-t threads] [-s size] [-r read|readv|recvmmsg] port");
+	}
+	port = atoi(argv[optind]);
+
+	for (int i = 1; i < threads; i++) {
+		pthread_t t;
+		pthread_create(&t, NULL, worker, NULL);
+	}
+	worker(NULL);
+	return 0;
+}
@@ -5,7 +5,7 @@ from subprocess import Popen, PIPE, check_output
 from tempfile import NamedTemporaryFile
 
 CC = ['cc', '-D_GNU_SOURCE', '-O', '-Werror', '-Wno-unused-result',
-		'-ldl', '-x', 'c', '-', '-o', '/dev/stdout']
+		'-ldl', '-pthread', '-x', 'c', '-', '-o', '/dev/stdout']
 DEVNULL = open(os.devnull, 'w')
 
 def print_flag(name, val="1"):
@@ -62,6 +62,55 @@ def has_splice():
 def has_recvmmsg():
 	return has_function("recvmmsg", 5, "sys/socket.h")
 
+def has_sendmmsg():
+	return has_function("sendmmsg", 4, "sys/socket.h")
+
+def has_sendfile():
+	return has_function("sendfile", 4, "sys/sendfile.h")
+
+def has_sendfile64():
+	return has_function("sendfile64", 4, "sys/sendfile.h")
+
+def has_setaffinity():
+	return has_function("pthread_setaffinity_np", 3, "pthread.h")
+
+def has_io_uring():
+	return compiles("""
+		#include <linux/io_uring.h>
+		#include <sys/syscall.h>
+		int main(void) { return IORING_OP_SENDMSG + SYS_io_uring_setup + SYS_io_uring_enter; }
+	""")
+
+def has_io_uring_capture():
+	return compiles("""
+		#include <linux/io_uring.h>
+		#include <sys/syscall.h>
+		int main(void) {
+			return IORING_OP_PROVIDE_BUFFERS + IORING_CQE_F_MORE +
+				IORING_REGISTER_PBUF_RING + IORING_REGISTER_RING_FDS +
+				IORING_ENTER_REGISTERED_RING + SYS_io_uring_register;
+		}
+	""")
+
+def has_memfd_create():
+	return has_function("memfd_create", 2, "sys/mman.h")
+
+def has_eventfd():
+	return has_function("eventfd", 2, "sys/eventfd.h")
+
+def has_epoll():
+	return has_function("epoll_create1", 1, "sys/epoll.h")
+
+def has_posix_fallocate():
+	return has_function("posix_fallocate", 3, "fcntl.h")
+
+def has_siocoutq():
+	return compiles("""
+		#include <sys/ioctl.h>
+		#include <linux/sockios.h>
+		int main(void) { int n; return ioctl(0, SIOCOUTQ, &n); }
+	""")
+
 def has_read_chk():
 	return has_function("__read_chk", 4, "unistd.h")
 
@@ -76,8 +125,19 @@ if has_accept4():      print_flag("ACCEPT4")
 if has_tee():          print_flag("TEE")
 if has_splice():       print_flag("SPLICE")
 if has_recvmmsg():     print_flag("RECVMMSG")
+if has_sendmmsg():     print_flag("SENDMMSG")
+if has_sendfile():     print_flag("SENDFILE")
+if has_sendfile64():   print_flag("SENDFILE64")
 if has_read_chk():     print_flag("READ_CHK")
 if has_recv_chk():     print_flag("RECV_CHK")
 if has_recvfrom_chk(): print_flag("RECVFROM_CHK")
+if has_setaffinity():  print_flag("PTHREAD_SETAFFINITY")
+if has_io_uring():     print_flag("IO_URING")
+if has_io_uring_capture(): print_flag("IO_URING_CAPTURE")
+if has_memfd_create(): print_flag("MEMFD_CREATE")
+if has_eventfd():      print_flag("EVENTFD")
+if has_epoll():        print_flag("EPOLL")
+if has_siocoutq():     print_flag("SIOCOUTQ")
+if has_posix_fallocate(): print_flag("POSIX_FALLOCATE")
 check_define("SYS_ACCEPT4", "sys/syscall.h", "SYS_accept4")
 
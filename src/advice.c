@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/uio.h>
@@ -8,6 +9,7 @@
 #include "sock.h"
 #include "util.h"
 #include "trace.h"
+#include "appring.h"
 
 static const char *
 str(const char *in, ssize_t len)
@@ -69,10 +71,34 @@ rcmsg(ssize_t rc)
 	return buf;
 }
 
+static bool
+sock_stream(int fd)
+{
+	int type;
+	socklen_t len = sizeof(type);
+	return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
+
+/* Returns how many received bytes to trace. Peeked data is received again
+ * later, so it never is. MSG_TRUNC on a stream discards the data without
+ * copying it out, while on a datagram it only makes the call return the
+ * whole datagram's length, of which no more than the buffer was filled. */
+static inline size_t
+recv_traced(ssize_t rc, int fd, int flags, size_t len)
+{
+	if (rc <= 0 || (flags & MSG_PEEK)) { return 0; }
+	if (likely(!(flags & MSG_TRUNC))) { return (size_t)rc; }
+	if (!trace_active(fd) || sock_stream(fd)) { return 0; }
+	return (size_t)rc < len ? (size_t)rc : len;
+}
+
 void
 before_close(int fd)
 {
 	trace_stop(fd);
+#if HAS_IO_URING_CAPTURE
+	appring_forget(fd);
+#endif
 }
 
 void
@@ -83,15 +109,20 @@ after_close(int rc,
 			fd, rcmsg(rc));
 }
 
+void
+before_accept(int sockfd)
+{
+	trace_accepting(sockfd);
+}
+
 void
 after_accept(int rc,
 		int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
-	(void)addrlen;
 	DEBUG("accept(%d, \"%s\") = %s",
 			sockfd, addr_encode(addr), rcmsg(rc));
 	if (rc > -1) {
-		trace_start(rc, sockfd);
+		trace_start(rc, sockfd, addr, addrlen);
 	}
 }
 
@@ -100,11 +131,10 @@ void
 after_accept4(int rc,
 		int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
 {
-	(void)addrlen;
 	DEBUG("accept4(%d, \"%s\", %d) = %s",
 			sockfd, addr_encode(addr), flags, rcmsg(rc));
 	if (rc > -1) {
-		trace_start(rc, sockfd);
+		trace_start(rc, sockfd, addr, addrlen);
 	}
 }
 #endif
@@ -140,7 +170,7 @@ after_readv(ssize_t rc,
 	DEBUG_MORE("readv(%d, %p, %d) = %s",
 			fd, iov, iovcnt, rcmsg(rc));
 	if (rc > 0) {
-		tracev(fd, iov, iovcnt);
+		tracev(fd, iov, iovcnt, rc);
 	}
 }
 
@@ -151,8 +181,9 @@ after_recvfrom(ssize_t rc,
 {
 	DEBUG_MORE("recvfrom(%d, %s, %zu, %d, %p, %p) = %s",
 			sockfd, str(buf, rc), len, flags, src_addr, addrlen, rcmsg(rc));
-	if (rc > 0) {
-		trace(sockfd, buf, rc);
+	size_t n = recv_traced(rc, sockfd, flags, len);
+	if (n > 0) {
+		trace(sockfd, buf, (ssize_t)n);
 	}
 }
 
@@ -161,8 +192,9 @@ after_recv(ssize_t rc, int sockfd, void *buf, size_t len, int flags)
 {
 	DEBUG_MORE("recv(%d, %s, %zu, %d) = %s",
 			sockfd, str(buf, rc), len, flags, rcmsg(rc));
-	if (rc > 0) {
-		trace(sockfd, buf, rc);
+	size_t n = recv_traced(rc, sockfd, flags, len);
+	if (n > 0) {
+		trace(sockfd, buf, (ssize_t)n);
 	}
 }
 
@@ -172,8 +204,9 @@ after___recv_chk(ssize_t rc, int sockfd, void *buf, size_t len, size_t buflen, i
 {
 	DEBUG_MORE("__recv_chk(%d, %s, %zu, %zu, %d) = %s",
 			sockfd, str(buf, rc), len, buflen, flags, rcmsg(rc));
-	if (rc > 0) {
-		trace(sockfd, buf, rc);
+	size_t n = recv_traced(rc, sockfd, flags, len);
+	if (n > 0) {
+		trace(sockfd, buf, (ssize_t)n);
 	}
 }
 #endif
@@ -185,8 +218,9 @@ after___recvfrom_chk(ssize_t rc, int sockfd, void *buf, size_t len, size_t bufle
 {
 	DEBUG_MORE("__recvfrom_chk(%d, %s, %zu, %zu, %d, %p, %p) = %s",
 			sockfd, str(buf, rc), len, buflen, flags, src_addr, addrlen, rcmsg(rc));
-	if (rc > 0) {
-		trace(sockfd, buf, rc);
+	size_t n = recv_traced(rc, sockfd, flags, len);
+	if (n > 0) {
+		trace(sockfd, buf, (ssize_t)n);
 	}
 }
 #endif
@@ -197,8 +231,10 @@ after_recvmsg(ssize_t rc,
 {
 	DEBUG_MORE("recvmsg(%d, %p, %d) = %s",
 			sockfd, msg, flags, rcmsg(rc));
-	if (rc > 0) {
-		tracev(sockfd, msg->msg_iov, msg->msg_iovlen);
+	/* The vector is already the limit on what is traced. */
+	size_t n = recv_traced(rc, sockfd, flags, SIZE_MAX);
+	if (n > 0) {
+		tracev(sockfd, msg->msg_iov, msg->msg_iovlen, n);
 	}
 }
 
@@ -209,21 +245,147 @@ after_recvmmsg(int rc, int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 {
 	DEBUG_MORE("recvmmsg(%d, %p, %u, %d, %p) = %s",
 			sockfd, msgvec, vlen, flags, timeout, rcmsg(rc));
-	if (rc > 0) {
-		size_t iovcnt = 0;
-		for (unsigned int i = 0; i < vlen; i++) {
-			iovcnt += msgvec[i].msg_hdr.msg_iovlen;
+	/* Only the first rc messages were received, each with its own
+	 * length, which tracing trims to the message's vector. */
+	if (recv_traced(rc, sockfd, flags, SIZE_MAX) > 0) {
+		for (int i = 0; i < rc; i++) {
+			tracev(sockfd, msgvec[i].msg_hdr.msg_iov, msgvec[i].msg_hdr.msg_iovlen,
+					msgvec[i].msg_len);
 		}
+	}
+}
+#endif
 
-		struct iovec iov[iovcnt], *p = iov;
-		for (unsigned int i = 0; i < vlen; i++) {
-			for (size_t j = 0; j < msgvec[i].msg_hdr.msg_iovlen; j++, p++) {
-				*p = msgvec[i].msg_hdr.msg_iov[j];
-			}
-		}
 
-		tracev(sockfd, iov, iovcnt);
+void
+after_write(ssize_t rc,
+		int fd, const void *buf, size_t count)
+{
+	DEBUG_MORE("write(%d, %s, %zu) = %s",
+			fd, str(buf, rc), count, rcmsg(rc));
+	if (rc > 0) {
+		trace_tx(fd, buf, rc);
+	}
+}
+
+void
+after_writev(ssize_t rc,
+		int fd, const struct iovec *iov, int iovcnt)
+{
+	DEBUG_MORE("writev(%d, %p, %d) = %s",
+			fd, iov, iovcnt, rcmsg(rc));
+	if (rc > 0) {
+		tracev_tx(fd, iov, iovcnt, rc);
+	}
+}
+
+void
+after_sendto(ssize_t rc,
+		int sockfd, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	DEBUG_MORE("sendto(%d, %s, %zu, %d, %p, %u) = %s",
+			sockfd, str(buf, rc), len, flags, dest_addr, (unsigned)addrlen, rcmsg(rc));
+	if (rc > 0) {
+		trace_tx(sockfd, buf, rc);
+	}
+}
+
+void
+after_sendmsg(ssize_t rc,
+		int sockfd, const struct msghdr *msg, int flags)
+{
+	DEBUG_MORE("sendmsg(%d, %p, %d) = %s",
+			sockfd, msg, flags, rcmsg(rc));
+	if (rc > 0) {
+		tracev_tx(sockfd, msg->msg_iov, msg->msg_iovlen, rc);
+	}
+}
+
+#if HAS_SENDMMSG
+void
+after_sendmmsg(int rc,
+		int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	DEBUG_MORE("sendmmsg(%d, %p, %u, %d) = %s",
+			sockfd, msgvec, vlen, flags, rcmsg(rc));
+	/* Each sent message reports its own length, which may be short. */
+	for (int i = 0; i < rc; i++) {
+		tracev_tx(sockfd, msgvec[i].msg_hdr.msg_iov, msgvec[i].msg_hdr.msg_iovlen,
+				msgvec[i].msg_len);
+	}
+}
+#endif
+
+#if HAS_SENDFILE
+void
+after_sendfile(ssize_t rc,
+		int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	DEBUG_MORE("sendfile(%d, %d, %p, %zu) = %s",
+			out_fd, in_fd, offset, count, rcmsg(rc));
+	if (rc > 0) {
+		trace_file_tx(out_fd, in_fd, offset, rc);
 	}
 }
 #endif
 
+#if HAS_SENDFILE64
+void
+after_sendfile64(ssize_t rc,
+		int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+	DEBUG_MORE("sendfile64(%d, %d, %p, %zu) = %s",
+			out_fd, in_fd, offset, count, rcmsg(rc));
+	if (rc > 0) {
+		/* The range is only reported as a gap, so the offset isn't used. */
+		trace_file_tx(out_fd, in_fd, NULL, rc);
+	}
+}
+#endif
+
+#if HAS_IO_URING_CAPTURE
+void
+after_io_uring_setup(int rc,
+		unsigned entries, struct io_uring_params *p)
+{
+	DEBUG("io_uring_setup(%u, %p) = %s",
+			entries, p, rcmsg(rc));
+	if (rc > -1) {
+		appring_setup(rc, p);
+	}
+}
+
+void
+before_io_uring_enter(unsigned fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	(void)min_complete;
+	appring_submit((int)fd, to_submit, flags);
+}
+
+void
+after_io_uring_enter(int rc,
+		unsigned fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	DEBUG_MORE("io_uring_enter(%u, %u, %u, %#x) = %s",
+			fd, to_submit, min_complete, flags, rcmsg(rc));
+	/* Errors such as EINTR are retried by the caller, so keep them intact
+	 * while tracing whatever completed in the meantime. */
+	int err = errno;
+	appring_reap((int)fd, flags);
+	errno = err;
+}
+
+void
+after_io_uring_register(int rc,
+		unsigned fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	DEBUG("io_uring_register(%u, %u, %p, %u) = %s",
+			fd, opcode, arg, nr_args, rcmsg(rc));
+	if (rc > -1) {
+		appring_register((int)fd, opcode, arg, nr_args);
+	}
+}
+#endif
@@ -4,6 +4,8 @@
 void before_close(int fd);
 void after_close(int rc, int fd);
 
+void before_accept(int sockfd);
+
 void
 after_accept(int rc,
 		int sockfd, struct sockaddr *addr, socklen_t *addrlen);
@@ -57,5 +59,61 @@ after_recvmmsg(int rc, int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 		int flags, struct timespec *timeout);
 #endif
 
+void
+after_write(ssize_t rc,
+		int fd, const void *buf, size_t count);
+
+void
+after_writev(ssize_t rc,
+		int fd, const struct iovec *iov, int iovcnt);
+
+void
+after_sendto(ssize_t rc,
+		int sockfd, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest_addr, socklen_t addrlen);
+
+void
+after_sendmsg(ssize_t rc,
+		int sockfd, const struct msghdr *msg, int flags);
+
+#if HAS_SENDMMSG
+void
+after_sendmmsg(int rc,
+		int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+#endif
+
+#if HAS_SENDFILE
+void
+after_sendfile(ssize_t rc,
+		int out_fd, int in_fd, off_t *offset, size_t count);
+#endif
+
+#if HAS_SENDFILE64
+void
+after_sendfile64(ssize_t rc,
+		int out_fd, int in_fd, off64_t *offset, size_t count);
+#endif
+
+#if HAS_IO_URING_CAPTURE
+struct io_uring_params;
+
+void
+after_io_uring_setup(int rc,
+		unsigned entries, struct io_uring_params *p);
+
+void
+before_io_uring_enter(unsigned fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags);
+
+void
+after_io_uring_enter(int rc,
+		unsigned fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags);
+
+void
+after_io_uring_register(int rc,
+		unsigned fd, unsigned opcode, void *arg, unsigned nr_args);
+#endif
+
 #endif
 
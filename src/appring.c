@@ -0,0 +1,543 @@
+#include "appring.h"
+
+#if HAS_IO_URING_CAPTURE
+
+#include "debug.h"
+#include "table.h"
+#include "trace.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define OPS_MIN 64
+#define BID_MAX 65536
+#define REGFD_MAX 16
+
+/* A submitted operation waiting on its completion, keyed by user_data. */
+struct op {
+	uint64_t user_data;
+	uint64_t addr;       /* Buffer, unless it is selected from a group. */
+	int fd;
+	uint8_t opcode;      /* Zero marks an empty slot. */
+	bool tx;
+	bool select;
+	uint16_t bgid;
+};
+
+/* Buffers the kernel picks from for IOSQE_BUFFER_SELECT. They are either
+ * handed over with IORING_OP_PROVIDE_BUFFERS or through a registered ring.
+ * Addresses are cached by buffer id; for a registered ring the cache is
+ * filled from the ring entries on a miss. */
+struct bgroup {
+	uint16_t bgid;
+	unsigned entries;
+	struct io_uring_buf_ring *br;
+	uint64_t *addr;
+};
+
+struct appring {
+	atomic_flag lock;
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned *cq_tail;
+	unsigned sq_mask, sq_entries, cq_mask, cq_entries;
+	unsigned cq_seen;    /* Next completion to look at. */
+	char *sqes, *cqes;
+	size_t sqe_size, cqe_size;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	struct op *ops;
+	unsigned ops_size, ops_used;
+	struct bgroup *groups;
+	unsigned ngroups;
+};
+
+/* Each ring fd maps to a slot. A thread using the ring counts itself in
+ * the slot's users before loading the ring, so a ring that has been taken
+ * out of its slot is only freed once every thread that may have loaded it
+ * has let go. Slots live in the table and are never freed themselves. */
+struct slot {
+	_Atomic(struct appring *) ring;
+	atomic_uint users;
+};
+
+static struct table rings;
+
+/* Registered ring descriptors are indexes private to the thread that
+ * registered them. Each holds the ring fd plus one. */
+static _Thread_local int regfd[REGFD_MAX];
+
+static inline unsigned
+load_acquire(const unsigned *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned
+op_hash(uint64_t key)
+{
+	return (unsigned)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static struct op *
+op_find(struct appring *r, uint64_t key)
+{
+	if (r->ops_used == 0) { return NULL; }
+	unsigned mask = r->ops_size - 1;
+	for (unsigned i = op_hash(key) & mask; r->ops[i].opcode; i = (i + 1) & mask) {
+		if (r->ops[i].user_data == key) {
+			return &r->ops[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+op_put(struct appring *r, const struct op *op)
+{
+	struct op *o = op_find(r, op->user_data);
+	if (o) {
+		*o = *op;
+		return;
+	}
+
+	if ((r->ops_used + 1) * 4 > r->ops_size * 3) {
+		unsigned size = r->ops_size ? r->ops_size * 2 : OPS_MIN;
+		struct op *old = r->ops;
+		unsigned n = r->ops_size;
+		r->ops = calloc(size, sizeof(*r->ops));
+		if (r->ops == NULL) { xoom(); }
+		r->ops_size = size;
+		r->ops_used = 0;
+		for (unsigned i = 0; i < n; i++) {
+			if (old[i].opcode) { op_put(r, &old[i]); }
+		}
+		free(old);
+	}
+
+	unsigned mask = r->ops_size - 1, i = op_hash(op->user_data) & mask;
+	while (r->ops[i].opcode) { i = (i + 1) & mask; }
+	r->ops[i] = *op;
+	r->ops_used++;
+}
+
+static void
+op_del(struct appring *r, struct op *o)
+{
+	/* Shift later entries of the probe sequence back over the hole so
+	 * lookups never need tombstones. */
+	unsigned mask = r->ops_size - 1, i = o - r->ops, j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!r->ops[j].opcode) { break; }
+		unsigned k = op_hash(r->ops[j].user_data) & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) { continue; }
+		r->ops[i] = r->ops[j];
+		i = j;
+	}
+	r->ops[i].opcode = 0;
+	r->ops_used--;
+}
+
+static struct bgroup *
+group_get(struct appring *r, uint16_t bgid, bool make)
+{
+	for (unsigned i = 0; i < r->ngroups; i++) {
+		if (r->groups[i].bgid == bgid) {
+			return &r->groups[i];
+		}
+	}
+	if (!make) { return NULL; }
+
+	r->groups = xrealloc(r->groups, (r->ngroups + 1) * sizeof(*r->groups));
+	struct bgroup *g = &r->groups[r->ngroups++];
+	g->bgid = bgid;
+	g->entries = 0;
+	g->br = NULL;
+	g->addr = calloc(BID_MAX, sizeof(*g->addr));
+	if (g->addr == NULL) { xoom(); }
+	return g;
+}
+
+static void
+group_drop(struct appring *r, uint16_t bgid)
+{
+	struct bgroup *g = group_get(r, bgid, false);
+	if (g) {
+		free(g->addr);
+		*g = r->groups[--r->ngroups];
+	}
+}
+
+static uint64_t
+group_addr(struct appring *r, uint16_t bgid, uint16_t bid)
+{
+	struct bgroup *g = group_get(r, bgid, false);
+	if (g == NULL) { return 0; }
+	if (g->addr[bid] == 0 && g->br) {
+		for (unsigned i = 0; i < g->entries; i++) {
+			g->addr[g->br->bufs[i].bid] = g->br->bufs[i].addr;
+		}
+	}
+	return g->addr[bid];
+}
+
+static struct appring *
+ring_get(int fd, unsigned flags, struct slot **sp)
+{
+	if (flags & IORING_ENTER_REGISTERED_RING) {
+		if (fd < 0 || fd >= REGFD_MAX) { return NULL; }
+		fd = regfd[fd] - 1;
+	}
+	struct slot *s = table_get(&rings, fd);
+	if (s == NULL) { return NULL; }
+
+	/* Both sides are sequentially consistent, so either this load sees the
+	 * ring taken out, or ring_retire sees this user. */
+	atomic_fetch_add(&s->users, 1);
+	struct appring *r = atomic_load(&s->ring);
+	if (r == NULL) {
+		atomic_fetch_sub_explicit(&s->users, 1, memory_order_release);
+		return NULL;
+	}
+	*sp = s;
+	return r;
+}
+
+static inline void
+ring_put(struct slot *s)
+{
+	atomic_fetch_sub_explicit(&s->users, 1, memory_order_release);
+}
+
+static void
+ring_free(struct appring *r)
+{
+	if (r->sq_map && r->sq_map != MAP_FAILED) { munmap(r->sq_map, r->sq_len); }
+	if (r->cq_map && r->cq_map != MAP_FAILED) { munmap(r->cq_map, r->cq_len); }
+	if (r->sqes && r->sqes != MAP_FAILED) { munmap(r->sqes, r->sqes_len); }
+	for (unsigned i = 0; i < r->ngroups; i++) {
+		free(r->groups[i].addr);
+	}
+	free(r->groups);
+	free(r->ops);
+	free(r);
+}
+
+static void
+ring_retire(struct slot *s, struct appring *old)
+{
+	if (old == NULL) { return; }
+	for (unsigned n = 0; atomic_load(&s->users) > 0; n++) {
+		if (n > 64) { sched_yield(); }
+		else        { cpu_relax(); }
+	}
+	ring_free(old);
+}
+
+static void
+ring_complete(struct appring *r, const struct op *o, int res, unsigned flags)
+{
+	/* Completions are handled in the order the kernel posted them, so a
+	 * close is seen before an accept that reuses its descriptor. */
+	switch (o->opcode) {
+	case IORING_OP_ACCEPT:
+		DEBUG("io_uring accept(%d) = %d", o->fd, res);
+		if (res >= 0) {
+			trace_start(res, o->fd, NULL, NULL);
+		}
+		return;
+	case IORING_OP_CLOSE:
+		DEBUG("io_uring close(%d) = %d", o->fd, res);
+		if (res >= 0) {
+			trace_stop(o->fd);
+		}
+		return;
+	}
+	if (res <= 0) { return; }
+
+	uint64_t addr = o->addr;
+	if (o->select) {
+		addr = flags & IORING_CQE_F_BUFFER ?
+			group_addr(r, o->bgid, flags >> IORING_CQE_BUFFER_SHIFT) : 0;
+	}
+	DEBUG_MORE("io_uring %s(%d, %#" PRIx64 ") = %d",
+			o->tx ? "send" : "recv", o->fd, addr, res);
+	if (addr == 0) { return; }
+	if (o->tx) {
+		trace_tx(o->fd, (const char *)(uintptr_t)addr, res);
+	}
+	else {
+		trace(o->fd, (const char *)(uintptr_t)addr, res);
+	}
+}
+
+static void
+ring_reap(struct appring *r)
+{
+	/* Completion slots are only reused once the kernel has posted a full
+	 * ring past them, so entries the application has already consumed are
+	 * still readable. Anything older than that was missed. */
+	unsigned tail = load_acquire(r->cq_tail), seen = r->cq_seen;
+	if (tail - seen > r->cq_entries) {
+		DEBUG("io_uring missed: %d, %u completions", r->fd, tail - seen - r->cq_entries);
+		seen = tail - r->cq_entries;
+	}
+	for (; seen != tail && r->ops_used > 0; seen++) {
+		const struct io_uring_cqe *cqe = (const struct io_uring_cqe *)
+			(r->cqes + (seen & r->cq_mask) * r->cqe_size);
+		struct op *o = op_find(r, cqe->user_data);
+		if (o) {
+			ring_complete(r, o, cqe->res, cqe->flags);
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				op_del(r, o);
+			}
+		}
+	}
+	r->cq_seen = tail;
+}
+
+static void
+ring_sqe(struct appring *r, const struct io_uring_sqe *sqe)
+{
+	struct op op = {
+		.user_data = sqe->user_data,
+		.addr = sqe->addr,
+		.fd = sqe->fd,
+		.opcode = sqe->opcode,
+		.select = sqe->flags & IOSQE_BUFFER_SELECT,
+		.bgid = sqe->buf_group,
+	};
+
+	/* Registered files are indexes rather than descriptors, so they can't
+	 * be matched to a traced connection. */
+	if ((sqe->flags & IOSQE_FIXED_FILE) && sqe->opcode != IORING_OP_PROVIDE_BUFFERS) {
+		return;
+	}
+
+	switch (sqe->opcode) {
+	case IORING_OP_ACCEPT:
+		/* A direct accept completes with a slot in the registered file
+		 * table, or nothing, rather than a descriptor. */
+		if (sqe->file_index == 0) {
+			op_put(r, &op);
+		}
+		break;
+	case IORING_OP_RECV:
+		/* A peek leaves the data to be received again, and a truncating
+		 * receive on a stream discards it unread. */
+		if (sqe->msg_flags & (MSG_PEEK|MSG_TRUNC)) { break; }
+		/* fallthrough */
+	case IORING_OP_READ:
+	case IORING_OP_READ_FIXED:
+		if (trace_active(sqe->fd)) {
+			op_put(r, &op);
+		}
+		break;
+	case IORING_OP_SEND:
+	case IORING_OP_WRITE:
+	case IORING_OP_WRITE_FIXED:
+		if (trace_active(sqe->fd)) {
+			op.tx = true;
+			op_put(r, &op);
+		}
+		break;
+	case IORING_OP_CLOSE:
+		if (sqe->file_index == 0 && trace_active(sqe->fd)) {
+			op_put(r, &op);
+		}
+		break;
+	case IORING_OP_PROVIDE_BUFFERS: {
+		struct bgroup *g = group_get(r, sqe->buf_group, true);
+		for (unsigned i = 0; i < (unsigned)sqe->fd && sqe->off + i < BID_MAX; i++) {
+			g->addr[sqe->off + i] = sqe->addr + (uint64_t)i * sqe->len;
+		}
+		break;
+	}
+	}
+}
+
+void
+appring_init(int max_fd)
+{
+	table_init(&rings, sizeof(struct slot), max_fd);
+}
+
+void
+appring_setup(int fd, const struct io_uring_params *p)
+{
+	/* Submissions are only visible as the application enters the ring. */
+	unsigned skip = IORING_SETUP_SQPOLL;
+#ifdef IORING_SETUP_NO_MMAP
+	skip |= IORING_SETUP_NO_MMAP;
+#endif
+#ifdef IORING_SETUP_REGISTERED_FD_ONLY
+	skip |= IORING_SETUP_REGISTERED_FD_ONLY;
+#endif
+	if (p->flags & skip) {
+		DEBUG("io_uring skipped: %d, flags %#x", fd, p->flags);
+		return;
+	}
+
+	struct slot *slot = table_make(&rings, fd);
+	if (slot == NULL) { return; }
+
+	struct appring *r = calloc(1, sizeof(*r));
+	if (r == NULL) { xoom(); }
+	atomic_flag_clear(&r->lock);
+	r->fd = fd;
+	r->sqe_size = sizeof(struct io_uring_sqe);
+	r->cqe_size = sizeof(struct io_uring_cqe);
+#ifdef IORING_SETUP_SQE128
+	if (p->flags & IORING_SETUP_SQE128) { r->sqe_size *= 2; }
+#endif
+#ifdef IORING_SETUP_CQE32
+	if (p->flags & IORING_SETUP_CQE32) { r->cqe_size *= 2; }
+#endif
+
+	/* Without an SQ array the kernel leaves its offset at zero. */
+	r->sq_len = p->sq_off.array ?
+		p->sq_off.array + p->sq_entries * sizeof(unsigned) :
+		p->sq_off.flags + sizeof(unsigned);
+	r->cq_len = p->cq_off.cqes + p->cq_entries * r->cqe_size;
+	r->sqes_len = p->sq_entries * r->sqe_size;
+
+	/* The rings are only read, never advanced, so the application's view
+	 * of them is left alone. */
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) { goto error; }
+	r->cq_map = mmap(NULL, r->cq_len, PROT_READ, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+	if (r->cq_map == MAP_FAILED) { goto error; }
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ, MAP_SHARED, fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) { goto error; }
+
+	char *sq = r->sq_map, *cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + p->sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	r->sq_array = p->sq_off.array ? (unsigned *)(sq + p->sq_off.array) : NULL;
+	r->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	r->sq_entries = p->sq_entries;
+	r->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	r->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	r->cq_entries = p->cq_entries;
+	r->cqes = cq + p->cq_off.cqes;
+	r->cq_seen = load_acquire(r->cq_tail);
+
+	ring_retire(slot, atomic_exchange(&slot->ring, r));
+	DEBUG("io_uring: %d, sq=%u cq=%u", fd, p->sq_entries, p->cq_entries);
+	return;
+
+error:
+	DEBUG("io_uring failed: %d, %s", fd, strerror(errno));
+	ring_free(r);
+}
+
+void
+appring_submit(int fd, unsigned to_submit, unsigned flags)
+{
+	struct slot *slot;
+	struct appring *r = ring_get(fd, flags, &slot);
+	if (r == NULL) { return; }
+
+	spin_lock(&r->lock);
+
+	/* Completions go first, as their user_data may be reused by the new
+	 * submissions. */
+	ring_reap(r);
+
+	unsigned head = load_acquire(r->sq_head);
+	unsigned tail = load_acquire(r->sq_tail);
+	if (tail - head > to_submit) {
+		tail = head + to_submit;
+	}
+	for (; head != tail; head++) {
+		unsigned idx = head & r->sq_mask;
+		if (r->sq_array) { idx = r->sq_array[idx]; }
+		if (idx < r->sq_entries) {
+			ring_sqe(r, (const struct io_uring_sqe *)(r->sqes + idx * r->sqe_size));
+		}
+	}
+
+	spin_unlock(&r->lock);
+	ring_put(slot);
+}
+
+void
+appring_reap(int fd, unsigned flags)
+{
+	struct slot *slot;
+	struct appring *r = ring_get(fd, flags, &slot);
+	if (r == NULL) { return; }
+
+	spin_lock(&r->lock);
+	ring_reap(r);
+	spin_unlock(&r->lock);
+	ring_put(slot);
+}
+
+void
+appring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	unsigned flags = 0;
+#ifdef IORING_REGISTER_USE_REGISTERED_RING
+	if (opcode & IORING_REGISTER_USE_REGISTERED_RING) {
+		opcode &= ~IORING_REGISTER_USE_REGISTERED_RING;
+		flags = IORING_ENTER_REGISTERED_RING;
+	}
+#endif
+
+	if (opcode == IORING_REGISTER_RING_FDS || opcode == IORING_UNREGISTER_RING_FDS) {
+		/* The kernel has filled in the offsets it chose. */
+		const struct io_uring_rsrc_update *u = arg;
+		for (unsigned i = 0; i < nr_args; i++) {
+			if (u[i].offset < REGFD_MAX) {
+				regfd[u[i].offset] = opcode == IORING_REGISTER_RING_FDS ?
+					(int)u[i].data + 1 : 0;
+			}
+		}
+		return;
+	}
+
+	struct slot *slot;
+	struct appring *r = ring_get(fd, flags, &slot);
+	if (r == NULL) { return; }
+
+	spin_lock(&r->lock);
+	switch (opcode) {
+	case IORING_REGISTER_PBUF_RING: {
+		/* Rings the kernel allocates have no address until mapped. */
+		const struct io_uring_buf_reg *reg = arg;
+		if (reg->ring_addr) {
+			group_drop(r, reg->bgid);
+			struct bgroup *g = group_get(r, reg->bgid, true);
+			g->br = (struct io_uring_buf_ring *)(uintptr_t)reg->ring_addr;
+			g->entries = reg->ring_entries;
+		}
+		break;
+	}
+	case IORING_UNREGISTER_PBUF_RING:
+		group_drop(r, ((const struct io_uring_buf_reg *)arg)->bgid);
+		break;
+	}
+	spin_unlock(&r->lock);
+	ring_put(slot);
+}
+
+void
+appring_forget(int fd)
+{
+	struct slot *slot = table_get(&rings, fd);
+	if (slot == NULL) { return; }
+
+	struct appring *r = atomic_exchange(&slot->ring, NULL);
+	if (r) {
+		ring_retire(slot, r);
+		DEBUG("io_uring closed: %d", fd);
+	}
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TEEXEC_APPRING_H
+#define TEEXEC_APPRING_H
+
+#include <stdbool.h>
+
+#if HAS_IO_URING_CAPTURE
+
+#include <linux/io_uring.h>
+
+/* Follows the io_uring instances created by the traced application. Each
+ * ring is mapped a second time read-only, and the submission queue is read
+ * as the application enters the ring to note its receives, sends, accepts
+ * and closes. Completions are matched back to them on either side of each
+ * io_uring_enter, while their buffers still hold the data.
+ *
+ * Only rings driven through the hooked system calls are followed. Rings
+ * with a kernel polling thread, fixed files, or completions the application
+ * reaps without entering the ring again may be missed. */
+
+void
+appring_init(int max_fd);
+
+void
+appring_setup(int fd, const struct io_uring_params *p);
+
+void
+appring_submit(int fd, unsigned to_submit, unsigned flags);
+
+void
+appring_reap(int fd, unsigned flags);
+
+void
+appring_register(int fd, unsigned opcode, void *arg, unsigned nr_args);
+
+void
+appring_forget(int fd);
+
+#endif
+
+#endif
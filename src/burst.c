@@ -0,0 +1,135 @@
+#include "burst.h"
+#include "pool.h"
+#include "util.h"
+#include "bypass.h"
+
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define CHUNK_SIZE 16384
+#define CHUNK_IOV 64
+
+#ifdef CLOCK_MONOTONIC_COARSE
+# define BURST_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+# define BURST_CLOCK CLOCK_MONOTONIC
+#endif
+
+struct chunk {
+	struct chunk *next;
+	size_t start, end;
+	char data[CHUNK_SIZE - sizeof(void *) - 2*sizeof(size_t)];
+};
+
+static struct pool chunks = POOL_INIT(sizeof(struct chunk), 64);
+
+uint64_t
+burst_now(void)
+{
+	struct timespec ts;
+	clock_gettime(BURST_CLOCK, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool
+burst_push(struct burst *b, const struct iovec *iov, size_t iovcnt, size_t skip)
+{
+	if (b->bytes == 0) {
+		b->since = burst_now();
+	}
+
+	for (size_t i = 0; i < iovcnt; i++) {
+		const char *p = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		p += skip;
+		len -= skip;
+		skip = 0;
+
+		while (len > 0) {
+			struct chunk *c = b->tail;
+			if (c == NULL || c->end == sizeof(c->data)) {
+				c = pool_get(&chunks);
+				if (c == NULL) { return false; }
+				c->next = NULL;
+				c->start = c->end = 0;
+				if (b->tail) { b->tail->next = c; }
+				else         { b->head = c; }
+				b->tail = c;
+			}
+			size_t n = sizeof(c->data) - c->end;
+			if (n > len) { n = len; }
+			memcpy(c->data + c->end, p, n);
+			c->end += n;
+			b->bytes += n;
+			p += n;
+			len -= n;
+		}
+	}
+	return true;
+}
+
+ssize_t
+burst_flush(struct burst *b, int fd, int flags)
+{
+	while (b->bytes > 0) {
+		struct iovec iov[CHUNK_IOV];
+		size_t n = 0, want = 0;
+		for (struct chunk *c = b->head; c && n < countof(iov); c = c->next, n++) {
+			iov[n].iov_base = c->data + c->start;
+			iov[n].iov_len = c->end - c->start;
+			want += iov[n].iov_len;
+		}
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+		ssize_t rc = xsendmsg(fd, &msg, flags);
+		if (rc < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? (ssize_t)b->bytes : -1;
+		}
+
+		b->bytes -= rc;
+		bool full = (size_t)rc < want;
+		while (rc > 0) {
+			struct chunk *c = b->head;
+			size_t avail = c->end - c->start;
+			if ((size_t)rc < avail) {
+				c->start += rc;
+				break;
+			}
+			rc -= avail;
+			b->head = c->next;
+			pool_put(&chunks, c);
+		}
+		if (b->head == NULL) {
+			b->tail = NULL;
+		}
+		if (full) {
+			/* A short write means the socket is full again. */
+			break;
+		}
+	}
+	return b->bytes;
+}
+
+void
+burst_clear(struct burst *b)
+{
+	while (b->head) {
+		struct chunk *c = b->head;
+		b->head = c->next;
+		pool_put(&chunks, c);
+	}
+	b->tail = NULL;
+	b->bytes = 0;
+}
+
+void
+burst_fork(void)
+{
+	/* A thread lost in the fork may have held the chunk pool. */
+	atomic_flag_clear(&chunks.lock);
+}
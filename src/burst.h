@@ -0,0 +1,35 @@
+#ifndef TEEXEC_BURST_H
+#define TEEXEC_BURST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* A burst buffer holds the unsent tail of a trace channel's stream after a
+ * partial write. Everything written to the channel afterwards is appended
+ * behind it until the buffer has been flushed, keeping the stream intact. */
+struct burst {
+	struct chunk *head;
+	struct chunk *tail;
+	size_t bytes;        /* Total bytes waiting. */
+	uint64_t since;      /* Time in ms when the buffer became non-empty. */
+};
+
+uint64_t
+burst_now(void);
+
+bool
+burst_push(struct burst *b, const struct iovec *iov, size_t iovcnt, size_t skip);
+
+ssize_t
+burst_flush(struct burst *b, int fd, int flags);
+
+void
+burst_clear(struct burst *b);
+
+void
+burst_fork(void);
+
+#endif
@@ -2,9 +2,15 @@
 #define TEEXEC_BYPASS_H
 
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 int xclose(int);
 int xaccept(int s, bool nonblock);
+ssize_t xwrite(int fd, const void *buf, size_t len);
+ssize_t xsendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t xrecv(int fd, void *buf, size_t len, int flags);
+long xsyscall(long num, long a, long b, long c, long d, long e, long f);
 
 #endif
 
@@ -0,0 +1,366 @@
+#include "filter.h"
+#include "table.h"
+#include "debug.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TRIE_STRIDE 4
+#define TRIE_FANOUT (1 << TRIE_STRIDE)
+
+#define LISTEN_UNKNOWN 0
+#define LISTEN_TRACE   1
+#define LISTEN_SKIP    2
+
+/* Peer ranges are kept in a multibit trie that consumes four address bits per
+ * level. A prefix that ends inside a level is expanded over every slot it
+ * covers, and each slot remembers the length of the prefix that set it so a
+ * longer one can replace it. A lookup walks at most 8 levels for IPv4 and 32
+ * for IPv6 regardless of how many ranges there are, and the last verdict seen
+ * on the way down belongs to the longest match. */
+struct slot {
+	uint32_t child;    /* Node index of the next level, or 0. */
+	uint8_t len;       /* Prefix length that set the verdict. */
+	uint8_t verdict;   /* FILTER_ALLOW, FILTER_DENY or 0. */
+};
+
+struct node {
+	struct slot slot[TRIE_FANOUT];
+};
+
+struct trie {
+	struct node *nodes;  /* Node 0 is the root. */
+	uint32_t count, cap;
+	uint8_t all;         /* Verdict of a zero-length prefix. */
+	unsigned bits;       /* Address length. */
+};
+
+struct listen {
+	int family;          /* AF_INET, AF_INET6 or 0 for any address. */
+	uint8_t addr[16];
+	uint16_t port;       /* Port, or 0 for any port. */
+};
+
+static struct trie trie4 = { .bits = 32 };
+static struct trie trie6 = { .bits = 128 };
+static bool has_allow = false, has_peer = false;
+
+static struct listen *listens = NULL;
+static size_t nlistens = 0;
+static struct table listeners;
+
+static uint32_t
+trie_node(struct trie *t)
+{
+	if (t->count == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 64;
+		t->nodes = xrealloc(t->nodes, t->cap * sizeof(*t->nodes));
+	}
+	memset(&t->nodes[t->count], 0, sizeof(*t->nodes));
+	return t->count++;
+}
+
+static inline unsigned
+trie_nibble(const uint8_t *addr, unsigned level)
+{
+	return (addr[level / 2] >> (level % 2 ? 0 : 4)) & (TRIE_FANOUT - 1);
+}
+
+static inline bool
+trie_wins(uint8_t len, uint8_t verdict, const struct slot *s)
+{
+	return len > s->len || (len == s->len && verdict == FILTER_DENY);
+}
+
+static void
+trie_insert(struct trie *t, const uint8_t *addr, unsigned len, uint8_t verdict)
+{
+	if (len == 0) {
+		if (t->all != FILTER_DENY) { t->all = verdict; }
+		return;
+	}
+	if (t->count == 0) {
+		trie_node(t);
+	}
+
+	unsigned last = (len - 1) / TRIE_STRIDE, rem = len - last * TRIE_STRIDE;
+	uint32_t idx = 0;
+	for (unsigned level = 0; level < last; level++) {
+		unsigned nib = trie_nibble(addr, level);
+		if (t->nodes[idx].slot[nib].child == 0) {
+			/* Allocate first, as it may move the nodes. */
+			uint32_t child = trie_node(t);
+			t->nodes[idx].slot[nib].child = child;
+		}
+		idx = t->nodes[idx].slot[nib].child;
+	}
+
+	unsigned span = 1u << (TRIE_STRIDE - rem);
+	unsigned first = trie_nibble(addr, last) & ~(span - 1);
+	for (unsigned i = first; i < first + span; i++) {
+		struct slot *s = &t->nodes[idx].slot[i];
+		if (trie_wins(len, verdict, s)) {
+			s->len = len;
+			s->verdict = verdict;
+		}
+	}
+}
+
+static uint8_t
+trie_lookup(const struct trie *t, const uint8_t *addr)
+{
+	uint8_t verdict = t->all;
+	if (t->count == 0) { return verdict; }
+
+	uint32_t idx = 0;
+	for (unsigned level = 0; level < t->bits / TRIE_STRIDE; level++) {
+		const struct slot *s = &t->nodes[idx].slot[trie_nibble(addr, level)];
+		if (s->verdict) { verdict = s->verdict; }
+		if (s->child == 0) { break; }
+		idx = s->child;
+	}
+	return verdict;
+}
+
+static bool
+parse_port(const char *s, uint16_t *port)
+{
+	char *end;
+	long val = strtol(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || val < 1 || val > 65535) { return false; }
+	*port = (uint16_t)val;
+	return true;
+}
+
+static bool
+add_peer(char *tok, uint8_t verdict)
+{
+	uint8_t addr[16];
+	char *slash = strchr(tok, '/');
+	if (slash) { *slash++ = '\0'; }
+
+	struct trie *t;
+	if (inet_pton(AF_INET, tok, addr) == 1)       { t = &trie4; }
+	else if (inet_pton(AF_INET6, tok, addr) == 1) { t = &trie6; }
+	else                                          { return false; }
+
+	long len = t->bits;
+	if (slash) {
+		char *end;
+		len = strtol(slash, &end, 10);
+		if (*slash == '\0' || *end != '\0' || len < 0 || len > (long)t->bits) {
+			return false;
+		}
+	}
+	trie_insert(t, addr, (unsigned)len, verdict);
+	has_peer = true;
+	has_allow |= verdict == FILTER_ALLOW;
+	return true;
+}
+
+static bool
+add_listen(char *tok)
+{
+	struct listen l = { 0, { 0 }, 0 };
+	char *host = tok, *port = NULL;
+
+	if (*tok == '[') {
+		char *close = strchr(tok, ']');
+		if (close == NULL) { return false; }
+		*close = '\0';
+		host = tok + 1;
+		if (close[1] == ':')       { port = close + 2; }
+		else if (close[1] != '\0') { return false; }
+	}
+	else if (strspn(tok, "0123456789") == strlen(tok)) {
+		host = NULL;
+		port = tok;
+	}
+	else {
+		/* A single colon separates an IPv4 address from its port, while
+		 * a bare IPv6 address has several. */
+		char *colon = strchr(tok, ':');
+		if (colon && strchr(colon + 1, ':') == NULL) {
+			*colon = '\0';
+			port = colon + 1;
+		}
+	}
+
+	if (port && !parse_port(port, &l.port)) { return false; }
+	if (host) {
+		if (inet_pton(AF_INET, host, l.addr) == 1)       { l.family = AF_INET; }
+		else if (inet_pton(AF_INET6, host, l.addr) == 1) { l.family = AF_INET6; }
+		else                                             { return false; }
+	}
+
+	listens = xrealloc(listens, (nlistens + 1) * sizeof(*listens));
+	listens[nlistens++] = l;
+	return true;
+}
+
+static char *
+read_list(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) { return NULL; }
+
+	char *buf = NULL;
+	size_t len = 0, cap = 0, n;
+	do {
+		if (cap - len < 4096) {
+			cap = cap ? cap * 2 : 8192;
+			buf = xrealloc(buf, cap);
+		}
+		n = fread(buf + len, 1, cap - len - 1, f);
+		len += n;
+	} while (n > 0);
+	fclose(f);
+	buf[len] = '\0';
+	return buf;
+}
+
+static bool
+add_list(int kind, char *list)
+{
+	bool ok = true;
+	char *save = NULL;
+	for (char *tok = strtok_r(list, ", \t\r\n", &save); tok && ok;
+			tok = strtok_r(NULL, ", \t\r\n", &save)) {
+		if (tok[0] == '@') {
+			char *file = read_list(tok + 1);
+			ok = file && add_list(kind, file);
+			free(file);
+		}
+		else if (kind == FILTER_LISTEN) {
+			ok = add_listen(tok);
+		}
+		else {
+			ok = add_peer(tok, kind);
+		}
+	}
+	return ok;
+}
+
+bool
+filter_add(int kind, const char *list)
+{
+	char *copy = strdup(list);
+	if (copy == NULL) { return false; }
+	bool ok = add_list(kind, copy);
+	free(copy);
+	return ok;
+}
+
+void
+filter_init(int max_fd)
+{
+	if (nlistens > 0) {
+		table_init(&listeners, sizeof(atomic_uchar), max_fd);
+	}
+	DEBUG("filter: listen=%zu peer4=%u peer6=%u",
+			nlistens, trie4.count, trie6.count);
+}
+
+static bool
+listen_match(int serverfd)
+{
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+		struct sockaddr_storage ss;
+	} addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(serverfd, &addr.sa, &len) < 0) { return false; }
+
+	int family;
+	const uint8_t *host;
+	uint16_t port;
+	if (addr.sa.sa_family == AF_INET) {
+		family = AF_INET;
+		host = (const uint8_t *)&addr.in.sin_addr;
+		port = ntohs(addr.in.sin_port);
+	}
+	else if (addr.sa.sa_family == AF_INET6) {
+		family = AF_INET6;
+		host = (const uint8_t *)&addr.in6.sin6_addr;
+		port = ntohs(addr.in6.sin6_port);
+		if (IN6_IS_ADDR_V4MAPPED(&addr.in6.sin6_addr)) {
+			family = AF_INET;
+			host += 12;
+		}
+	}
+	else {
+		return false;
+	}
+
+	for (size_t i = 0; i < nlistens; i++) {
+		const struct listen *l = &listens[i];
+		if (l->port && l->port != port) { continue; }
+		if (l->family == 0) { return true; }
+		if (l->family == family &&
+				memcmp(l->addr, host, family == AF_INET ? 4 : 16) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool
+filter_listener(int serverfd)
+{
+	if (nlistens == 0) { return true; }
+
+	/* The verdict is cached per listening fd until that fd is closed. */
+	atomic_uchar *e = table_make(&listeners, serverfd);
+	if (e == NULL) { return false; }
+	unsigned char state = atomic_load_explicit(e, memory_order_relaxed);
+	if (state == LISTEN_UNKNOWN) {
+		state = listen_match(serverfd) ? LISTEN_TRACE : LISTEN_SKIP;
+		atomic_store_explicit(e, state, memory_order_relaxed);
+		DEBUG("filter listener: %d, %s", serverfd,
+				state == LISTEN_TRACE ? "trace" : "skip");
+	}
+	return state == LISTEN_TRACE;
+}
+
+void
+filter_forget(int fd)
+{
+	if (nlistens == 0) { return; }
+	atomic_uchar *e = table_get(&listeners, fd);
+	if (e) {
+		atomic_store_explicit(e, LISTEN_UNKNOWN, memory_order_relaxed);
+	}
+}
+
+bool
+filter_peers(void)
+{
+	return has_peer;
+}
+
+bool
+filter_peer(const struct sockaddr *addr)
+{
+	if (!has_peer) { return true; }
+
+	uint8_t verdict = 0;
+	if (addr && addr->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		verdict = trie_lookup(&trie4, (const uint8_t *)&in->sin_addr);
+	}
+	else if (addr && addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		const uint8_t *host = (const uint8_t *)&in6->sin6_addr;
+		verdict = IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) ?
+			trie_lookup(&trie4, host + 12) :
+			trie_lookup(&trie6, host);
+	}
+	return verdict ? verdict == FILTER_ALLOW : !has_allow;
+}
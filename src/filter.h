@@ -0,0 +1,43 @@
+#ifndef TEEXEC_FILTER_H
+#define TEEXEC_FILTER_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/* Filters decide at accept time whether a connection is traced. A listener
+ * filter selects listening sockets by local port and/or address, and peer
+ * filters allow or deny peers by CIDR range.
+ *
+ * Lists are separated by commas or whitespace. An entry beginning with '@'
+ * names a file to read more entries from. Listener entries take the
+ * form "port", "addr", "addr:port" or "[addr]:port". Peer entries take the
+ * form "addr/len" or "addr".
+ *
+ * The longest matching peer range decides, and a deny wins over an allow of
+ * the same length. When any allow range is given, unmatched peers are
+ * denied, otherwise they are allowed. Peers that have no IP address are
+ * always unmatched. */
+
+#define FILTER_LISTEN 0
+#define FILTER_ALLOW  1
+#define FILTER_DENY   2
+
+bool
+filter_add(int kind, const char *list);
+
+void
+filter_init(int max_fd);
+
+bool
+filter_listener(int serverfd);
+
+void
+filter_forget(int fd);
+
+bool
+filter_peers(void);
+
+bool
+filter_peer(const struct sockaddr *addr);
+
+#endif
@@ -4,18 +4,39 @@
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#if HAS_SENDFILE || HAS_SENDFILE64
+# include <sys/sendfile.h>
+#endif
+#if HAS_IO_URING_CAPTURE
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
 
 #include "util.h"
+#include "sock.h"
 #include "advice.h"
+#include "hoist.h"
+#include "trace.h"
+#include "stats.h"
+
+/* Every hook is listed by name with its switch, so hooks can be turned off
+ * at launch. The entries are walked as an array, so each one is kept to its
+ * natural alignment rather than whatever the compiler prefers for data. */
+struct init {
+	const char *name;
+	void (*init)(void);
+	bool *off;
+};
 
 #if __APPLE__
 
 #include <unistd.h>
 
-#include "sock.h"
-
 #define hoist(name, ret, ...) \
 	export ret hoist_##name(__VA_ARGS__); \
+	static bool off_##name; \
+	__attribute__((used, aligned(sizeof(void *)), section("__DATA,hoist_array"))) \
+	static struct init fp_##name = { #name, NULL, &off_##name }; \
 	__attribute__((used, section("__DATA,__interpose"))) \
 	static struct { \
 		ret (*src)(__VA_ARGS__); \
@@ -28,6 +49,9 @@
 
 #define libc(name) name
 
+extern struct init hoist_start __asm("section$start$__DATA$hoist_array");
+extern struct init hoist_stop __asm("section$end$__DATA$hoist_array");
+
 void
 hoist_init(void)
 {
@@ -37,40 +61,102 @@ hoist_init(void)
 
 #include <dlfcn.h>
 
-struct init {
-	void (*init)(void);
-};
-
 #define hoist(name, ret, ...) \
 	static ret (*libc_##name)(__VA_ARGS__); \
+	static bool off_##name; \
 	static void hoist_##name(void) { libc_##name = dlsym(RTLD_NEXT, #name); } \
-	__attribute__((used, section("hoist_array"))) \
-	static struct init fp_##name = { hoist_##name }; \
+	__attribute__((used, aligned(sizeof(void *)), section("hoist_array"))) \
+	static struct init fp_##name = { #name, hoist_##name, &off_##name }; \
 	export ret name(__VA_ARGS__)
 
 #define libc(name) libc_##name
 
+extern struct init __start_hoist_array;
+extern struct init __stop_hoist_array;
+#define hoist_start __start_hoist_array
+#define hoist_stop __stop_hoist_array
+
 void
 hoist_init(void)
 {
-	extern struct init __start_hoist_array;
-	extern struct init __stop_hoist_array;
-	for (struct init *i = &__start_hoist_array; i != &__stop_hoist_array; i++) {
+	for (struct init *i = &hoist_start; i != &hoist_stop; i++) {
 		i->init();
 	}
 }
 
 #endif
 
+bool
+hoist_disable(const char *names)
+{
+	if (names == NULL) {
+		for (struct init *i = &hoist_start; i != &hoist_stop; i++) {
+			*i->off = true;
+		}
+		return true;
+	}
+
+	bool ok = true;
+	for (const char *p = names; *p; ) {
+		size_t len = strcspn(p, ",");
+		struct init *i;
+		for (i = &hoist_start; i != &hoist_stop; i++) {
+			if (strlen(i->name) == len && memcmp(i->name, p, len) == 0) {
+				*i->off = true;
+				break;
+			}
+		}
+		if (i == &hoist_stop && len > 0) { ok = false; }
+		p += len;
+		if (*p == ',') { p++; }
+	}
+	return ok;
+}
+
+/* debug.h would bring in unistd.h, which clashes with the syscall hook. */
+extern atomic_bool debug_more_enabled;
+
+/* A hook that is turned off goes straight to libc. Hooks that only trace
+ * data also do so while no connection is being traced, unless every call is
+ * being logged, so an idle teexec costs a couple of loads and branches per
+ * call. */
+#define skip(hook, name, ...) do { \
+	if (unlikely(off_##hook)) { return libc(name)(__VA_ARGS__); } \
+} while (0)
+
+#define idle(hook, name, ...) do { \
+	if (unlikely(off_##hook) || (likely(trace_idle()) && \
+			likely(!atomic_load_explicit(&debug_more_enabled, memory_order_relaxed)))) { \
+		return libc(name)(__VA_ARGS__); \
+	} \
+} while (0)
+
 #define join(name, ret, ...) do { \
 	ret rc = libc(name)(__VA_ARGS__); \
 	after_##name(rc, __VA_ARGS__); \
 	return rc; \
 } while (0)
 
+/* A data hook joins the same way, but with --latency the work it adds after
+ * the libc call is timed, by kind and by whether the fd is traced. */
+#define timed(kind, name, ret, fd, ...) do { \
+	ret rc = libc(name)(fd, __VA_ARGS__); \
+	if (unlikely(stats_latency)) { \
+		uint64_t t = stats_clock(); \
+		after_##name(rc, fd, __VA_ARGS__); \
+		t = stats_clock() - t; \
+		stats_time(STATS_HOOK_##kind, trace_active(fd), t); \
+	} \
+	else { \
+		after_##name(rc, fd, __VA_ARGS__); \
+	} \
+	return rc; \
+} while (0)
+
 hoist(close, int,
 		int fd)
 {
+	skip(close, close, fd);
 	before_close(fd);
 	join(close, int, fd);
 }
@@ -78,6 +164,8 @@ hoist(close, int,
 hoist(accept, int,
 		int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
+	skip(accept, accept, sockfd, addr, addrlen);
+	before_accept(sockfd);
 	join(accept, int, sockfd, addr, addrlen);
 }
 
@@ -85,60 +173,129 @@ hoist(accept, int,
 hoist(accept4, int,
 		int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
 {
+	skip(accept4, accept4, sockfd, addr, addrlen, flags);
+	before_accept(sockfd);
 	join(accept4, int, sockfd, addr, addrlen, flags);
 }
 #endif
 
-#if HAS_SYS_ACCEPT4
+#if HAS_SYS_ACCEPT4 || HAS_IO_URING_CAPTURE
 hoist(syscall, long,
 		long num, long a, long b, long c, long d, long e, long f)
 {
+	skip(syscall, syscall, num, a, b, c, d, e, f);
+#if HAS_SYS_ACCEPT4
+	if (unlikely(num == HAS_SYS_ACCEPT4)) {
+		before_accept((int)a);
+	}
+#endif
+#if HAS_IO_URING_CAPTURE
+	if (unlikely(num == SYS_io_uring_enter)) {
+		before_io_uring_enter((unsigned)a, (unsigned)b, (unsigned)c, (unsigned)d);
+	}
+#endif
 	long n = libc(syscall)(num, a, b, c, d, e, f);
+#if HAS_SYS_ACCEPT4
 	if (unlikely(num == HAS_SYS_ACCEPT4)) {
 		after_accept4((int)n, (int)a, (struct sockaddr *)b, (socklen_t *)c, (int)d);
 	}
+#endif
+#if HAS_IO_URING_CAPTURE
+	if (unlikely(num == SYS_io_uring_enter)) {
+		after_io_uring_enter((int)n, (unsigned)a, (unsigned)b, (unsigned)c, (unsigned)d);
+	}
+	else if (unlikely(num == SYS_io_uring_setup)) {
+		after_io_uring_setup((int)n, (unsigned)a, (struct io_uring_params *)b);
+	}
+	else if (unlikely(num == SYS_io_uring_register)) {
+		after_io_uring_register((int)n, (unsigned)a, (unsigned)b, (void *)c, (unsigned)d);
+	}
+#endif
 	return n;
 }
 #endif
 
+#if HAS_IO_URING_CAPTURE
+/* liburing also exports the raw system calls, returning a negative errno
+ * rather than setting it. They are replaced outright, calling the kernel
+ * directly so each call is only seen once. */
+hoist(io_uring_setup, int,
+		unsigned entries, struct io_uring_params *p)
+{
+	skip(io_uring_setup, io_uring_setup, entries, p);
+	int rc = (int)libc(syscall)(SYS_io_uring_setup, entries, (long)p, 0, 0, 0, 0);
+	after_io_uring_setup(rc, entries, p);
+	return rc < 0 ? -errno : rc;
+}
+
+hoist(io_uring_enter, int,
+		unsigned fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags, void *sig)
+{
+	skip(io_uring_enter, io_uring_enter, fd, to_submit, min_complete, flags, sig);
+	before_io_uring_enter(fd, to_submit, min_complete, flags);
+	/* signal.h would clash with the syscall hook, so the kernel's sigset
+	 * size is given directly. */
+	int rc = (int)libc(syscall)(SYS_io_uring_enter, fd, to_submit, min_complete,
+			flags, (long)sig, 64 / 8);
+	after_io_uring_enter(rc, fd, to_submit, min_complete, flags);
+	return rc < 0 ? -errno : rc;
+}
+
+hoist(io_uring_register, int,
+		unsigned fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	skip(io_uring_register, io_uring_register, fd, opcode, arg, nr_args);
+	int rc = (int)libc(syscall)(SYS_io_uring_register, fd, opcode, (long)arg, nr_args, 0, 0);
+	after_io_uring_register(rc, fd, opcode, arg, nr_args);
+	return rc < 0 ? -errno : rc;
+}
+#endif
+
 hoist(read, ssize_t,
 		int fd, void *buf, size_t count)
 {
-	join(read, ssize_t, fd, buf, count);
+	idle(read, read, fd, buf, count);
+	timed(READ, read, ssize_t, fd, buf, count);
 }
 
 #if HAS_READ_CHK
 hoist(__read_chk, ssize_t,
 		int fd, void *buf, size_t nbytes, size_t buflen)
 {
-	join(__read_chk, ssize_t, fd, buf, nbytes, buflen);
+	idle(__read_chk, __read_chk, fd, buf, nbytes, buflen);
+	timed(READ, __read_chk, ssize_t, fd, buf, nbytes, buflen);
 }
 #endif
 
 hoist(readv, ssize_t,
 		int fd, const struct iovec *iov, int iovcnt)
 {
-	join(readv, ssize_t, fd, iov, iovcnt);
+	idle(readv, readv, fd, iov, iovcnt);
+	timed(READV, readv, ssize_t, fd, iov, iovcnt);
 }
 
 hoist(recvfrom, ssize_t,
 		int sockfd, void *buf, size_t len, int flags,
 		struct sockaddr *src_addr, socklen_t *addrlen)
 {
-	join(recvfrom, ssize_t, sockfd, buf, len, flags, src_addr, addrlen);
+	idle(recvfrom, recvfrom, sockfd, buf, len, flags, src_addr, addrlen);
+	timed(RECV, recvfrom, ssize_t, sockfd, buf, len, flags, src_addr, addrlen);
 }
 
 hoist(recv, ssize_t,
 		int sockfd, void *buf, size_t len, int flags)
 {
-	join(recvfrom, ssize_t, sockfd, buf, len, flags, NULL, NULL);
+	idle(recv, recvfrom, sockfd, buf, len, flags, NULL, NULL);
+	timed(RECV, recvfrom, ssize_t, sockfd, buf, len, flags, NULL, NULL);
 }
 
 #if HAS_RECV_CHK
 hoist(__recv_chk, ssize_t,
 		int sockfd, void *buf, size_t len, size_t buflen, int flags)
 {
-	join(__recv_chk, ssize_t, sockfd, buf, len, buflen, flags);
+	idle(__recv_chk, __recv_chk, sockfd, buf, len, buflen, flags);
+	timed(RECV, __recv_chk, ssize_t, sockfd, buf, len, buflen, flags);
 }
 #endif
 
@@ -147,14 +304,16 @@ hoist(__recvfrom_chk, ssize_t,
 		int sockfd, void *buf, size_t len, size_t buflen, int flags,
 		struct sockaddr *src_addr, socklen_t *addrlen)
 {
-	join(__recvfrom_chk, ssize_t, sockfd, buf, len, buflen, flags, src_addr, addrlen);
+	idle(__recvfrom_chk, __recvfrom_chk, sockfd, buf, len, buflen, flags, src_addr, addrlen);
+	timed(RECV, __recvfrom_chk, ssize_t, sockfd, buf, len, buflen, flags, src_addr, addrlen);
 }
 #endif
 
 hoist(recvmsg, ssize_t,
 		int sockfd, struct msghdr *msg, int flags)
 {
-	join(recvmsg, ssize_t, sockfd, msg, flags);
+	idle(recvmsg, recvmsg, sockfd, msg, flags);
+	timed(RECVMSG, recvmsg, ssize_t, sockfd, msg, flags);
 }
 
 #if HAS_RECVMMSG
@@ -162,7 +321,72 @@ hoist(recvmmsg, int,
 		int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 		int flags, struct timespec *timeout)
 {
-	join(recvmmsg, int, sockfd, msgvec, vlen, flags, timeout);
+	idle(recvmmsg, recvmmsg, sockfd, msgvec, vlen, flags, timeout);
+	timed(RECVMMSG, recvmmsg, int, sockfd, msgvec, vlen, flags, timeout);
+}
+#endif
+
+hoist(write, ssize_t,
+		int fd, const void *buf, size_t count)
+{
+	idle(write, write, fd, buf, count);
+	timed(WRITE, write, ssize_t, fd, buf, count);
+}
+
+hoist(writev, ssize_t,
+		int fd, const struct iovec *iov, int iovcnt)
+{
+	idle(writev, writev, fd, iov, iovcnt);
+	timed(WRITEV, writev, ssize_t, fd, iov, iovcnt);
+}
+
+hoist(sendto, ssize_t,
+		int sockfd, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	idle(sendto, sendto, sockfd, buf, len, flags, dest_addr, addrlen);
+	timed(SEND, sendto, ssize_t, sockfd, buf, len, flags, dest_addr, addrlen);
+}
+
+hoist(send, ssize_t,
+		int sockfd, const void *buf, size_t len, int flags)
+{
+	idle(send, sendto, sockfd, buf, len, flags, NULL, 0);
+	timed(SEND, sendto, ssize_t, sockfd, buf, len, flags, NULL, 0);
+}
+
+hoist(sendmsg, ssize_t,
+		int sockfd, const struct msghdr *msg, int flags)
+{
+	idle(sendmsg, sendmsg, sockfd, msg, flags);
+	timed(SENDMSG, sendmsg, ssize_t, sockfd, msg, flags);
+}
+
+#if HAS_SENDMMSG
+hoist(sendmmsg, int,
+		int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	idle(sendmmsg, sendmmsg, sockfd, msgvec, vlen, flags);
+	timed(SENDMMSG, sendmmsg, int, sockfd, msgvec, vlen, flags);
+}
+#endif
+
+#if HAS_SENDFILE
+hoist(sendfile, ssize_t,
+		int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	idle(sendfile, sendfile, out_fd, in_fd, offset, count);
+	timed(SENDFILE, sendfile, ssize_t, out_fd, in_fd, offset, count);
+}
+#endif
+
+#if HAS_SENDFILE64
+/* Programs built with _FILE_OFFSET_BITS=64 call this one instead. */
+hoist(sendfile64, ssize_t,
+		int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+	idle(sendfile64, sendfile64, out_fd, in_fd, offset, count);
+	timed(SENDFILE, sendfile64, ssize_t, out_fd, in_fd, offset, count);
 }
 #endif
 
@@ -190,3 +414,28 @@ int xaccept(int s, bool nonblock)
 	return fd;
 }
 
+ssize_t xwrite(int fd, const void *buf, size_t len)
+{
+	return libc(write)(fd, buf, len);
+}
+
+ssize_t xsendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	return libc(sendmsg)(fd, msg, flags);
+}
+
+ssize_t xrecv(int fd, void *buf, size_t len, int flags)
+{
+	return libc(recvfrom)(fd, buf, len, flags, NULL, NULL);
+}
+
+#if !__APPLE__ && !(HAS_SYS_ACCEPT4 || HAS_IO_URING_CAPTURE)
+extern long syscall(long, ...);
+#define libc_syscall syscall
+#endif
+
+long xsyscall(long num, long a, long b, long c, long d, long e, long f)
+{
+	return libc(syscall)(num, a, b, c, d, e, f);
+}
+
@@ -1,8 +1,13 @@
 #ifndef TEEXEC_HOIST_H
 #define TEEXEC_HOIST_H
 
+#include <stdbool.h>
+
 void
 hoist_init(void);
 
+bool
+hoist_disable(const char *names);
+
 #endif
 
@@ -5,6 +5,20 @@
 #include "debug.h"
 #include "hoist.h"
 #include "trace.h"
+#include "sender.h"
+#include "filter.h"
+#include "appring.h"
+#include "record.h"
+
+static long
+getenv_long(const char *name, long def, long min, long max)
+{
+	char *env = getenv(name), *end;
+	if (env == NULL) { return def; }
+	long val = strtol(env, &end, 10);
+	if (*end != '\0' || val < min || val > max) { return def; }
+	return val;
+}
 
 constructor(init)
 {
@@ -12,6 +26,7 @@ constructor(init)
 	int max_fd;
 	long fd, mode;
 	struct rlimit limit;
+	struct trace_opt opt;
 
 	/* Get the maximum number of file descriptors. This will limit the
 	 * valid range for the configured file descriptor, and it will be
@@ -19,17 +34,26 @@ constructor(init)
 	getrlimit(RLIMIT_NOFILE, &limit);
 	max_fd = limit.rlim_max > INT_MAX ? INT_MAX : (int)limit.rlim_max;
 
+	/* The hooks are resolved even when tracing isn't configured, as the
+	 * process may still call them, including teexec itself. They do
+	 * nothing until trace_init. */
+	hoist_init();
+
 	/* Check for the TEEXEC_INIT environment variable with the format:
 	 *
 	 *     fd:flags
 	 *
-	 * where `fd` is the integer value of the inherited trace socket and
-	 * `flags` is the bit flags to configure the run mode. */
-	if (!(env = getenv("TEEXEC_INIT"))) { return; }
+	 * where `fd` is the integer value of the inherited trace socket, or -1
+	 * when pushing to the collectors in TEEXEC_PUSH or recording to the
+	 * directory in TEEXEC_RECORD instead, and `flags` is
+	 * the bit flags to configure the run mode. */
+	if (!(env = getenv("TEEXEC_INIT"))) { goto off; }
 	fd = strtol(env, &end, 10);
-	if (*end != ':' || fd < 0 || fd > max_fd) { return; }
+	opt.push = getenv("TEEXEC_PUSH");
+	opt.record = getenv("TEEXEC_RECORD");
+	if (*end != ':' || fd < (opt.push || opt.record ? -1 : 0) || fd > max_fd) { goto off; }
 	mode = strtol(end+1, &end, 10);
-	if (*end != '\0' || mode < 0 || mode > INT_MAX) { return; }
+	if (*end != '\0' || mode < 0 || mode > INT_MAX) { goto off; }
 
 	/* We've got a possibly valid file descriptor and flag set. */
 	if (mode & TRACE_DEBUG) {
@@ -38,7 +62,50 @@ constructor(init)
 	if (mode & TRACE_DEBUG_MORE) {
 		debug_more_enable();
 	}
-	hoist_init();
-	trace_init(max_fd, (int)fd, (int)mode);
+	if ((env = getenv("TEEXEC_NOHOOK")) && !hoist_disable(env)) {
+		DEBUG("invalid TEEXEC_NOHOOK: %s", env);
+	}
+	/* Additional tuning is passed in separate variables, each of which falls
+	 * back to its default when missing or invalid. */
+	opt.mode = (int)mode;
+	opt.ringsize = (size_t)getenv_long("TEEXEC_RING", SENDER_RINGSIZE, 0, LONG_MAX);
+	opt.cpu = (int)getenv_long("TEEXEC_CPU", -1, -1, INT_MAX);
+	opt.burst = (size_t)getenv_long("TEEXEC_BURST", 0, 0, LONG_MAX);
+	opt.burst_age = (unsigned)getenv_long("TEEXEC_BURST_AGE", 1000, 0, UINT_MAX);
+	opt.coalesce = (size_t)getenv_long("TEEXEC_COALESCE", 0, 0, LONG_MAX);
+	opt.coalesce_frames = (unsigned)getenv_long("TEEXEC_COALESCE_FRAMES", 256, 1, UINT_MAX);
+	opt.coalesce_delay = (unsigned)getenv_long("TEEXEC_COALESCE_DELAY", 1000, 0, UINT_MAX);
+	opt.sample = (unsigned)getenv_long("TEEXEC_SAMPLE", TRACE_SAMPLE_ALL, 0, TRACE_SAMPLE_ALL);
+	opt.sample_peer = getenv_long("TEEXEC_SAMPLE_PEER", 0, 0, 1);
+	opt.shm = (size_t)getenv_long("TEEXEC_SHM", 1 << 22, 4096, LONG_MAX);
+	opt.shm_huge = getenv_long("TEEXEC_SHM_HUGE", 0, 0, 1);
+	opt.push_conns = (unsigned)getenv_long("TEEXEC_PUSH_CONNS", 1, 1, UINT_MAX);
+	opt.push_cork = getenv_long("TEEXEC_PUSH_CORK", 0, 0, 1);
+	opt.record_size = (size_t)getenv_long("TEEXEC_RECORD_SIZE", RECORD_SIZE, 4096, LONG_MAX);
+	opt.record_age = (unsigned)getenv_long("TEEXEC_RECORD_AGE", RECORD_AGE, 0, UINT_MAX);
+
+	/* Filters are given as lists rather than numbers. A list that fails to
+	 * parse is reported and whatever parsed before it is kept. */
+	static const struct { const char *name; int kind; } filters[] = {
+		{ "TEEXEC_LISTEN", FILTER_LISTEN },
+		{ "TEEXEC_ALLOW", FILTER_ALLOW },
+		{ "TEEXEC_DENY", FILTER_DENY },
+	};
+	for (size_t i = 0; i < countof(filters); i++) {
+		if ((env = getenv(filters[i].name)) && !filter_add(filters[i].kind, env)) {
+			DEBUG("invalid %s: %s", filters[i].name, env);
+		}
+	}
+	filter_init(max_fd);
+#if HAS_IO_URING_CAPTURE
+	appring_init(max_fd);
+#endif
+
+	trace_init(max_fd, (int)fd, &opt);
+	return;
+
+off:
+	/* Without a trace socket every hook goes straight to libc. */
+	hoist_disable(NULL);
 }
 
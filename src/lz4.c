@@ -0,0 +1,142 @@
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5   /* The block always ends with this many literals, */
+#define LZ4_MF_LIMIT 12       /* and the last match starts at least this far back. */
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_SKIP_TRIGGER 6
+
+static inline uint32_t
+lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz4_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline size_t
+lz4_extend(const uint8_t *in, size_t p, size_t r, size_t limit)
+{
+	/* Compares a word at a time where the byte order allows finding the
+	 * first difference from the low bits. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (p + sizeof(uint64_t) <= limit) {
+		uint64_t a, b;
+		memcpy(&a, in + p, sizeof(a));
+		memcpy(&b, in + r, sizeof(b));
+		if (a != b) {
+			return p + ((size_t)__builtin_ctzll(a ^ b) >> 3);
+		}
+		p += sizeof(uint64_t);
+		r += sizeof(uint64_t);
+	}
+#endif
+	while (p < limit && in[p] == in[r]) {
+		p++;
+		r++;
+	}
+	return p;
+}
+
+static inline uint8_t *
+lz4_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255) { *op++ = 255; }
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+size_t
+lz4_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = src;
+	uint8_t *op = dst, *oend = op + cap;
+	size_t ip = 0, anchor = 0;
+
+	/* Positions are kept as offsets into the input, all starting out as a
+	 * candidate at offset zero that the match check rejects. */
+	uint32_t table[1 << LZ4_HASH_LOG];
+	memset(table, 0, sizeof(table));
+
+	if (len > LZ4_MF_LIMIT) {
+		size_t mflimit = len - LZ4_MF_LIMIT;
+		size_t matchlimit = len - LZ4_LAST_LITERALS;
+		ip = 1;
+		for (;;) {
+			size_t ref;
+			unsigned attempts = 1 << LZ4_SKIP_TRIGGER;
+			for (;;) {
+				if (ip > mflimit) { goto last; }
+				uint32_t h = lz4_hash(lz4_read32(in + ip));
+				ref = table[h];
+				table[h] = (uint32_t)ip;
+				if (ref < ip && ip - ref <= LZ4_MAX_OFFSET &&
+						lz4_read32(in + ref) == lz4_read32(in + ip)) {
+					break;
+				}
+				ip += attempts++ >> LZ4_SKIP_TRIGGER;
+			}
+
+			while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+				ip--;
+				ref--;
+			}
+			size_t end = lz4_extend(in, ip + LZ4_MIN_MATCH, ref + LZ4_MIN_MATCH, matchlimit);
+			size_t lit = ip - anchor, mlen = end - ip - LZ4_MIN_MATCH;
+			if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1) {
+				return 0;
+			}
+
+			uint8_t *token = op++;
+			if (lit >= 15) {
+				*token = 15 << 4;
+				op = lz4_length(op, lit - 15);
+			}
+			else {
+				*token = (uint8_t)(lit << 4);
+			}
+			memcpy(op, in + anchor, lit);
+			op += lit;
+			size_t off = ip - ref;
+			*op++ = (uint8_t)off;
+			*op++ = (uint8_t)(off >> 8);
+			if (mlen >= 15) {
+				*token |= 15;
+				op = lz4_length(op, mlen - 15);
+			}
+			else {
+				*token |= (uint8_t)mlen;
+			}
+
+			anchor = ip = end;
+			if (ip > mflimit) { break; }
+			table[lz4_hash(lz4_read32(in + ip - 2))] = (uint32_t)(ip - 2);
+		}
+	}
+
+last:;
+	size_t lit = len - anchor;
+	if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1) {
+		return 0;
+	}
+	if (lit >= 15) {
+		*op++ = 15 << 4;
+		op = lz4_length(op, lit - 15);
+	}
+	else {
+		*op++ = (uint8_t)(lit << 4);
+	}
+	memcpy(op, in + anchor, lit);
+	op += lit;
+	return (size_t)(op - (uint8_t *)dst);
+}
@@ -0,0 +1,23 @@
+#ifndef TEEXEC_LZ4_H
+#define TEEXEC_LZ4_H
+
+#include <stddef.h>
+
+/* A compressor for the LZ4 block format, so a consumer can expand blocks
+ * with any LZ4 library's block decoder. It trades ratio for speed the same
+ * way LZ4's default does: a single hash probe per position, skipping ahead
+ * faster the longer it goes without a match. */
+
+/* Largest output lz4_compress can produce for len bytes of input. */
+static inline size_t
+lz4_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+/* Compresses len bytes of src into dst, returning the compressed length, or
+ * 0 if it would not fit in cap bytes. */
+size_t
+lz4_compress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
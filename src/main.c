@@ -1,11 +1,16 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <getopt.h>
+#include <signal.h>
+#include <poll.h>
 #include <err.h>
 
 #include "cmd.h"
@@ -13,6 +18,8 @@
 #include "sock.h"
 #include "debug.h"
 #include "trace.h"
+#include "filter.h"
+#include "stats.h"
 
 #if __APPLE__
 #define ENV_PRELOAD "DYLD_INSERT_LIBRARIES="
@@ -23,42 +30,393 @@
 #define ENV_DEBUG_LIBS "LD_DEBUG=libs:statistics"
 #endif
 #define ENV_INIT "TEEXEC_INIT="
+#define ENV_PREFIX "TEEXEC_"
+#define ENV_EXTRA 27
 
 #define TRACE_DEFAULT "/tmp/teexec.sock"
 
 static const struct opt opts[] = {
 	{ 'v', "verbose",      NULL,   "verbose output (for furthur diagnostics repeat up to 4 )" },
 	{ 't', "trace",        "sock", "trace socket (default \"" TRACE_DEFAULT "\")" },
+	{ 23,  "push",         "list", "connect out to these collectors instead of listening on --trace" },
+	{ 24,  "push-conns",   "n",    "connections to keep open to each --push collector (default 1)" },
+	{ 25,  "push-cork",    NULL,   "cork --push TCP connections instead of disabling Nagle" },
+	{ 27,  "record",       "dir",  "write frames to rotating segment files in dir (implies --drop)" },
+	{ 28,  "record-size",  "size", "bytes per --record segment (default 67108864)" },
+	{ 29,  "record-age",   "s",    "seconds before a --record segment is rotated (default 60)" },
 	{ 'm', "multiplex",    NULL,   "bundle primary connections into a single channel" },
+	{ 9,   "text",         NULL,   "use the text --multiplex header instead of binary" },
+	{ 18,  "tx",           NULL,   "also trace data sent by the command (implies -m)" },
+	{ 19,  "events",       NULL,   "send open and close events for each connection (implies -m)" },
+	{ 'a', "async",        NULL,   "copy reads to a ring and send from a background thread" },
+	{ 1,   "ring",         "size", "per-thread ring size in bytes for --async" },
+	{ 2,   "cpu",          "cpu",  "pin the --async sender thread to a cpu" },
+	{ 5,   "uring",        NULL,   "submit --async sends through io_uring" },
+	{ 6,   "sqpoll",       NULL,   "submit --uring sends with a kernel polling thread" },
+	{ 21,  "drop",         NULL,   "skip frames a slow channel can't take and mark the gap (implies -m)" },
+	{ 3,   "burst",        "size", "bytes a slow channel may buffer before disconnecting (implies --async without --drop)" },
+	{ 4,   "burst-age",    "ms",   "milliseconds buffered bytes may wait (default 1000)" },
+	{ 10,  "coalesce",     "size", "gather up to size bytes per channel into one send (implies --async without --drop)" },
+	{ 11,  "coalesce-frames", "n", "send gathered frames once n have built up (default 256)" },
+	{ 12,  "coalesce-delay", "us", "microseconds a gathered frame may wait (default 1000)" },
+	{ 26,  "compress",     NULL,   "send gathered frames as LZ4 blocks (implies -m --async, --coalesce 65536)" },
+	{ 13,  "sample",       "pct",  "trace only pct percent of accepted connections" },
+	{ 14,  "sample-peer",  NULL,   "choose --sample connections by peer address" },
+	{ 15,  "listen",       "list", "trace only connections accepted on these ports or addresses" },
+	{ 16,  "allow",        "list", "trace only peers in these CIDR ranges" },
+	{ 17,  "deny",         "list", "never trace peers in these CIDR ranges" },
+	{ 7,   "shm",          "size", "hand consumers a shared-memory ring instead of streaming" },
+	{ 8,   "hugepages",    NULL,   "back --shm rings with huge pages when available" },
+	{ 22,  "latency",      NULL,   "time the work each data hook adds, for \"teexec stat\" and on exit" },
+	{ 20,  "no-hook",      "list", "leave these calls unhooked, e.g. recvmmsg,sendfile" },
 	{ 'E', "preserve-env", NULL,   "preserve environment variables" },
 	{ 0,   NULL,           NULL,   NULL },
 };
 
+static void
+env_add(char **env, int *envc, const char *fmt, ...)
+{
+	if (*envc == ENV_EXTRA) {
+		errx(1, "too many options");
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	if (vasprintf(&env[*envc], fmt, ap) < 0) {
+		err(1, "failed to format environment");
+	}
+	va_end(ap);
+	(*envc)++;
+}
+
+static long
+arg_long(const char *name, const char *arg, long min, long max)
+{
+	char *end;
+	long val = strtol(arg, &end, 10);
+	if (*end != '\0' || val < min || val > max) {
+		errx(1, "invalid %s: %s", name, arg);
+	}
+	return val;
+}
+
+static long
+arg_percent(const char *name, const char *arg, long scale)
+{
+	char *end;
+	double val = strtod(arg, &end);
+	if (*end != '\0' || !(val >= 0.0 && val <= 100.0)) {
+		errx(1, "invalid %s: %s", name, arg);
+	}
+	return (long)(val * scale / 100.0 + 0.5);
+}
+
+static void
+arg_filter(const char *name, const char *arg, int kind)
+{
+	/* Parse here too so a bad list fails before the command runs. */
+	if (!filter_add(kind, arg)) {
+		errx(1, "invalid %s: %s", name, arg);
+	}
+}
+
+static void
+arg_push(const char *name, const char *arg)
+{
+	/* Each collector is a host and port or a UNIX socket path. */
+	const char *p = arg;
+	for (;;) {
+		size_t len = strcspn(p, ",");
+		if (len == 0 || len >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+			errx(1, "invalid %s: %s", name, arg);
+		}
+		if (p[len] == '\0') { break; }
+		p += len + 1;
+	}
+}
+
+static char *
+arg_dir(const char *name, const char *arg)
+{
+	/* The command may change directory, so the library gets a full path. */
+	struct stat st;
+	char *path = realpath(arg, NULL);
+	if (path == NULL || stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		errx(1, "invalid %s: %s", name, arg);
+	}
+	return path;
+}
+
+static char *
+arg_join(char *list, const char *arg)
+{
+	/* Repeated list options are joined into a single variable. */
+	char *out;
+	if (list == NULL) { return strdup(arg); }
+	if (asprintf(&out, "%s,%s", list, arg) < 0) {
+		err(1, "failed to format list");
+	}
+	free(list);
+	return out;
+}
+
 static const struct cmd cmd = {
 	"teexec",
 	opts,
 	"command [args...]",
 	NULL,
+	"Run \"teexec stat <pid>\" to print the counters of a traced process."
+};
+
+static const struct opt stat_opts[] = {
+	{ 'p', "prometheus",   "addr", "serve the counters in Prometheus text format on addr" },
+	{ 0,   NULL,           NULL,   NULL },
+};
+
+static const struct cmd stat_cmd = {
+	"teexec stat",
+	stat_opts,
+	"pid",
+	"print the counters of a process running under teexec",
 	NULL
 };
 
+#if HAS_STATS
+
+static void
+stat_serve(const struct stats_hdr *h, const char *addr)
+{
+	struct sock sock;
+	if (!sock_open(&sock, &SOCKOPT_STREAM_PASSIVE, addr)) {
+		sock_perror(&sock);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Each scrape gets the counters as they are and the connection closed,
+	 * which is all a Prometheus text endpoint needs. */
+	for (;;) {
+		struct sock c;
+		if (!sock_accept(&c, NULL, sock.fd)) { continue; }
+		if (kill((pid_t)h->pid, 0) < 0 && errno == ESRCH) {
+			errx(1, "process exited: %u", h->pid);
+		}
+
+		char req[1024];
+		struct pollfd pfd = { c.fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 1000) > 0 && read(c.fd, req, sizeof(req)) < 0) {
+			close(c.fd);
+			continue;
+		}
+		FILE *out = fdopen(c.fd, "w");
+		if (out == NULL) {
+			close(c.fd);
+			continue;
+		}
+		fprintf(out, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Connection: close\r\n\r\n");
+		stats_print(h, out, true);
+		fclose(out);
+	}
+}
+
+#endif
+
+static int
+stat_main(int argc, char **argv)
+{
+	const char *prometheus = NULL;
+	int ch;
+	while ((ch = cmd_getopt(argc, argv, &stat_cmd)) != -1) {
+		switch (ch) {
+		case 'p': prometheus = optarg; break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		cmd_usage(&stat_cmd);
+		exit(1);
+	}
+	pid_t pid = (pid_t)arg_long("pid", argv[0], 1, INT_MAX);
+
+#if HAS_STATS
+	const struct stats_hdr *h = stats_open(pid);
+	if (h == NULL) {
+		err(1, "no stats for %d", (int)pid);
+	}
+	if (prometheus) {
+		stat_serve(h, prometheus);
+	}
+	stats_print(h, stdout, false);
+	return 0;
+#else
+	(void)pid;
+	(void)prometheus;
+	errx(1, "stat is not supported on this system");
+#endif
+}
+
 int
 main(int argc, char **argv, char **envp)
 {
 	unsetenv("TEEXEC_INIT");
 
+	/* A command named stat can still be run as "teexec -- stat". */
+	if (argc > 1 && strcmp(argv[1], "stat") == 0) {
+		return stat_main(argc - 1, argv + 1);
+	}
+
 	const char *trace = TRACE_DEFAULT;
 	int verbose = 0;
 	int mode = 0;
 	bool preserve = false;
+	char *extra[ENV_EXTRA];
+	int extrac = 0;
+	char *listen_list = NULL, *allow_list = NULL, *deny_list = NULL, *nohook_list = NULL;
+	char *push_list = NULL, *record_dir = NULL;
+	bool trace_set = false, coalesce_set = false;
 	int ch;
 	while ((ch = cmd_getopt(argc, argv, &cmd)) != -1) {
 		switch (ch) {
 		case 'v': verbose++; break;
-		case 't': trace = optarg; break;
+		case 't': trace = optarg; trace_set = true; break;
 		case 'm': mode |= TRACE_MULTIPLEX; break;
+		case 'a': mode |= TRACE_ASYNC; break;
 		case 'E': preserve = true; break;
+		case 18: mode |= TRACE_MULTIPLEX|TRACE_TX; break;
+		case 9: mode |= TRACE_MULTIPLEX|TRACE_TEXT; break;
+		case 19: mode |= TRACE_MULTIPLEX|TRACE_EVENTS; break;
+		case 21: mode |= TRACE_MULTIPLEX|TRACE_DROP; break;
+		case 22: mode |= TRACE_LATENCY; break;
+		case 26: mode |= TRACE_MULTIPLEX|TRACE_ASYNC|TRACE_COMPRESS; break;
+		case 5: mode |= TRACE_ASYNC|TRACE_URING; break;
+		case 6: mode |= TRACE_ASYNC|TRACE_URING|TRACE_SQPOLL; break;
+		case 1:
+			env_add(extra, &extrac, "TEEXEC_RING=%ld",
+					arg_long("ring size", optarg, 4096, LONG_MAX));
+			break;
+		case 2:
+			env_add(extra, &extrac, "TEEXEC_CPU=%ld",
+					arg_long("cpu", optarg, 0, INT_MAX));
+			break;
+		case 3:
+			env_add(extra, &extrac, "TEEXEC_BURST=%ld",
+					arg_long("burst size", optarg, 0, LONG_MAX));
+			break;
+		case 4:
+			env_add(extra, &extrac, "TEEXEC_BURST_AGE=%ld",
+					arg_long("burst age", optarg, 0, UINT_MAX));
+			break;
+		case 10:
+			env_add(extra, &extrac, "TEEXEC_COALESCE=%ld",
+					arg_long("coalesce size", optarg, 0, LONG_MAX));
+			coalesce_set = true;
+			break;
+		case 11:
+			env_add(extra, &extrac, "TEEXEC_COALESCE_FRAMES=%ld",
+					arg_long("coalesce frames", optarg, 1, UINT_MAX));
+			break;
+		case 12:
+			env_add(extra, &extrac, "TEEXEC_COALESCE_DELAY=%ld",
+					arg_long("coalesce delay", optarg, 0, UINT_MAX));
+			break;
+		case 13:
+			env_add(extra, &extrac, "TEEXEC_SAMPLE=%ld",
+					arg_percent("sample", optarg, TRACE_SAMPLE_ALL));
+			break;
+		case 14:
+			env_add(extra, &extrac, "TEEXEC_SAMPLE_PEER=1");
+			break;
+		case 15:
+			arg_filter("listen", optarg, FILTER_LISTEN);
+			listen_list = arg_join(listen_list, optarg);
+			break;
+		case 16:
+			arg_filter("allow", optarg, FILTER_ALLOW);
+			allow_list = arg_join(allow_list, optarg);
+			break;
+		case 17:
+			arg_filter("deny", optarg, FILTER_DENY);
+			deny_list = arg_join(deny_list, optarg);
+			break;
+		case 20:
+			nohook_list = arg_join(nohook_list, optarg);
+			break;
+		case 23:
+			arg_push("push", optarg);
+			push_list = arg_join(push_list, optarg);
+			break;
+		case 24:
+			env_add(extra, &extrac, "TEEXEC_PUSH_CONNS=%ld",
+					arg_long("push connections", optarg, 1, 1024));
+			break;
+		case 25:
+			env_add(extra, &extrac, "TEEXEC_PUSH_CORK=1");
+			break;
+		case 27:
+			mode |= TRACE_MULTIPLEX|TRACE_DROP;
+			free(record_dir);
+			record_dir = arg_dir("record", optarg);
+			break;
+		case 28:
+			env_add(extra, &extrac, "TEEXEC_RECORD_SIZE=%ld",
+					arg_long("record size", optarg, 4096, LONG_MAX));
+			break;
+		case 29:
+			env_add(extra, &extrac, "TEEXEC_RECORD_AGE=%ld",
+					arg_long("record age", optarg, 0, UINT_MAX));
+			break;
+		case 7:
+			mode |= TRACE_SHM|TRACE_MULTIPLEX;
+			env_add(extra, &extrac, "TEEXEC_SHM=%ld",
+					arg_long("shm size", optarg, 4096, LONG_MAX));
+			break;
+		case 8:
+			env_add(extra, &extrac, "TEEXEC_SHM_HUGE=1");
+			break;
+		}
+	}
+	if ((mode & TRACE_EVENTS) && (mode & TRACE_TEXT)) {
+		errx(1, "--events requires the binary header");
+	}
+	if (record_dir) {
+		if (mode & TRACE_TEXT) {
+			errx(1, "--record requires the binary header");
+		}
+		if (mode & TRACE_SHM) {
+			errx(1, "--record does not apply to --shm");
+		}
+		if (mode & TRACE_COMPRESS) {
+			errx(1, "--record does not apply to --compress");
+		}
+		env_add(extra, &extrac, "TEEXEC_RECORD=%s", record_dir);
+	}
+	if ((mode & TRACE_DROP) && (mode & TRACE_TEXT)) {
+		errx(1, "--drop requires the binary header");
+	}
+	if (mode & TRACE_COMPRESS) {
+		if (mode & TRACE_TEXT) {
+			errx(1, "--compress requires the binary header");
+		}
+		if (mode & TRACE_SHM) {
+			errx(1, "--compress does not apply to --shm");
 		}
+		/* Blocks are made from gathered frames, so gather some. */
+		if (!coalesce_set) {
+			env_add(extra, &extrac, "TEEXEC_COALESCE=65536");
+		}
+	}
+	if (listen_list) { env_add(extra, &extrac, "TEEXEC_LISTEN=%s", listen_list); }
+	if (allow_list)  { env_add(extra, &extrac, "TEEXEC_ALLOW=%s", allow_list); }
+	if (deny_list)   { env_add(extra, &extrac, "TEEXEC_DENY=%s", deny_list); }
+	if (nohook_list) { env_add(extra, &extrac, "TEEXEC_NOHOOK=%s", nohook_list); }
+	if (push_list) {
+		if (trace_set) {
+			errx(1, "--push replaces --trace");
+		}
+		env_add(extra, &extrac, "TEEXEC_PUSH=%s", push_list);
 	}
 	argc -= optind;
 	argv += optind;
@@ -79,14 +437,18 @@ main(int argc, char **argv, char **envp)
 		errx(1, "command not found: %s", argv[0]);
 	}
 
-	struct sockopt opt = SOCKOPT_STREAM_PASSIVE;
-	opt.nonblock = true;
-	opt.cloexec = false;
-
-	struct sock sock;
-	if (!sock_open(&sock, &opt, trace)) {
-		sock_perror(&sock);
-		exit(1);
+	/* Pushing to collectors leaves nothing to listen on, and the library
+	 * is told so with a trace socket of -1. So does recording, unless
+	 * consumers are to listen on --trace as well. */
+	struct sock sock = { .fd = -1 };
+	if (push_list == NULL && (record_dir == NULL || trace_set)) {
+		struct sockopt opt = SOCKOPT_STREAM_PASSIVE;
+		opt.nonblock = true;
+		opt.cloexec = false;
+		if (!sock_open(&sock, &opt, trace)) {
+			sock_perror(&sock);
+			exit(1);
+		}
 	}
 
 	char env_lib[4096+sizeof(ENV_PRELOAD)];
@@ -106,9 +468,16 @@ main(int argc, char **argv, char **envp)
 		for (char *const *e = envp; *e; e++, envc++) {}
 	}
 
-	char *env[envc+5];
+	char *env[envc+extrac+5];
 	if (preserve) {
-		for (int i = 0; i < envc; i++) { env[i] = envp[i]; }
+		/* Drop any stale configuration inherited from an outer teexec. */
+		int n = 0;
+		for (int i = 0; i < envc; i++) {
+			if (strncmp(envp[i], ENV_PREFIX, sizeof(ENV_PREFIX)-1) != 0) {
+				env[n++] = envp[i];
+			}
+		}
+		envc = n;
 	}
 	env[envc++] = env_lib;
 	if (verbose > 3) {
@@ -120,6 +489,9 @@ main(int argc, char **argv, char **envp)
 #	endif
 	}
 	env[envc++] = env_init;
+	for (int i = 0; i < extrac; i++) {
+		env[envc++] = extra[i];
+	}
 	env[envc] = NULL;
 
 	char *name = strrchr(argv[0], '/');
@@ -137,7 +509,9 @@ main(int argc, char **argv, char **envp)
 			fprintf(stderr, "\"%s\"", argv[i]);
 		}
 		fprintf(stderr, "]\n");
-		DEBUG("trace=%s [%d]", trace, sock.fd);
+		if (push_list)         { DEBUG("push=%s", push_list); }
+		else if (sock.fd >= 0) { DEBUG("trace=%s [%d]", trace, sock.fd); }
+		if (record_dir)        { DEBUG("record=%s", record_dir); }
 		DEBUG("environment=%d", envc);
 		for (int i = 0; i < envc; i++) {
 			DEBUG("  %s", env[i]);
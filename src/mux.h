@@ -0,0 +1,120 @@
+#ifndef TEEXEC_MUX_H
+#define TEEXEC_MUX_H
+
+#include <stdint.h>
+
+/* In multiplex mode every chunk of traced data on a channel is preceded by a
+ * header identifying the connection it came from. A header with type
+ * MUX_CLOSE marks the end of a connection.
+ *
+ * The binary header is a fixed 24 bytes in little-endian byte order. `seq`
+ * counts the frames of each connection from zero, so a consumer reading
+ * frames that were written from different threads can put them back in
+ * order. Connection ids are never reused within a process, and carry its
+ * pid in their upper 32 bits, so the ids from a forking server's workers
+ * never collide either.
+ *
+ * With --events, a MUX_OPEN frame carrying struct mux_open precedes the
+ * first data of each connection, and the MUX_CLOSE frame carries struct
+ * mux_close. Without it MUX_CLOSE has no payload. A channel that fails is
+ * closed as a whole, so its consumer sees the socket end rather than close
+ * events for the connections on it.
+ *
+ * With --tx, data the application sent is traced as well and carries
+ * MUX_FLAG_TX; frames without it hold data the application received. Data
+ * sent with sendfile never passes through the application, so it is not
+ * read back; the range is reported as a gap, as described for --drop.
+ *
+ * With --drop, data frames a slow consumer can't take are skipped whole
+ * instead of failing the channel. The connection's next frame is then
+ * preceded by a MUX_GAP frame carrying struct mux_gap, whose `seq` is the
+ * lowest of the skipped frames. Skipped frames keep their sequence numbers,
+ * so the consumer can account for the ones missing.
+ *
+ * With --compress, coalesced frames are gathered per channel and sent as a
+ * MUX_BLOCK frame carrying MUX_FLAG_LZ4, whose payload is the LZ4 block
+ * format compression of those frames, headers and all. A block's `id` is
+ * zero and its `seq` holds the length the payload expands to. A batch that
+ * doesn't compress is sent as the plain frames, so both can appear on the
+ * same channel, and blocks never split a frame.
+ *
+ * The text header "@<id>#<len>\r\n" is still available with --text. It
+ * carries no sequence number, writes '>' in place of '#' for sent data and
+ * marks a close with a length of 0. It carries no events. */
+
+#define MUX_MAGIC   0x7e
+#define MUX_VERSION 1
+
+#define MUX_DATA  1
+#define MUX_CLOSE 2
+#define MUX_OPEN  3
+#define MUX_GAP   4
+#define MUX_BLOCK 5
+
+#define MUX_FLAG_TX  0x01
+#define MUX_FLAG_LZ4 0x02
+
+struct mux_hdr {
+	uint8_t magic;    /* MUX_MAGIC. */
+	uint8_t version;  /* MUX_VERSION. */
+	uint8_t type;     /* MUX_DATA, MUX_CLOSE, MUX_OPEN, MUX_GAP or MUX_BLOCK. */
+	uint8_t flags;
+	uint32_t len;     /* Payload length following the header. */
+	uint64_t id;      /* Connection id. */
+	uint64_t seq;     /* Frame number within the connection. */
+};
+
+_Static_assert(sizeof(struct mux_hdr) == 24, "mux header size");
+
+#define MUX_AF_NONE  0
+#define MUX_AF_INET  4
+#define MUX_AF_INET6 6
+
+struct mux_addr {
+	uint16_t family;    /* MUX_AF_INET, MUX_AF_INET6 or MUX_AF_NONE. */
+	uint16_t port;
+	uint8_t addr[16];   /* IPv4 addresses use the first 4 bytes. */
+};
+
+struct mux_open {
+	uint64_t time;      /* Accept time in ns since the epoch. */
+	uint32_t pid;
+	uint32_t tid;       /* Thread that accepted the connection. */
+	struct mux_addr peer;
+	struct mux_addr local; /* Address the connection was accepted on. */
+};
+
+#define MUX_CLOSE_APP   0  /* The application closed the connection. */
+#define MUX_CLOSE_SLOW  1  /* Tracing stopped as the consumer fell behind. */
+
+struct mux_close {
+	uint64_t rx;        /* Bytes traced in each direction. */
+	uint64_t tx;
+	uint32_t reason;    /* MUX_CLOSE_APP or MUX_CLOSE_SLOW. */
+	uint32_t reserved;
+};
+
+struct mux_gap {
+	uint64_t rx_off;    /* Stream offset of the first received byte skipped. */
+	uint64_t rx;        /* Received bytes skipped. */
+	uint64_t tx_off;    /* Likewise for sent data. */
+	uint64_t tx;
+	uint32_t frames;    /* Frames skipped. */
+	uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct mux_open) == 56, "mux open size");
+_Static_assert(sizeof(struct mux_close) == 24, "mux close size");
+_Static_assert(sizeof(struct mux_gap) == 40, "mux gap size");
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define mux_le16(v) __builtin_bswap16(v)
+# define mux_le32(v) __builtin_bswap32(v)
+# define mux_le64(v) __builtin_bswap64(v)
+#else
+# define mux_le16(v) (v)
+# define mux_le32(v) (v)
+# define mux_le64(v) (v)
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#include "pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+static void *
+pool_pop(struct pool *p)
+{
+	void **obj = p->free;
+	if (obj != NULL) { p->free = *obj; }
+	return obj;
+}
+
+void *
+pool_get(struct pool *p)
+{
+	spin_lock(&p->lock);
+	void *obj = pool_pop(p);
+	spin_unlock(&p->lock);
+	if (obj != NULL) { return obj; }
+
+	/* Carve a new slab outside the lock, threading all but the first
+	 * object into a list of its own. */
+	char *slab = malloc(p->size * p->count);
+	if (slab == NULL) { return NULL; }
+	void **head = NULL, **tail = NULL;
+	for (size_t i = p->count - 1; i > 0; i--) {
+		void **o = (void **)(slab + i * p->size);
+		*o = head;
+		head = o;
+		if (tail == NULL) { tail = o; }
+	}
+
+	/* Another thread may have refilled the pool meanwhile, in which case
+	 * the slab is dropped and one of its objects taken instead. */
+	spin_lock(&p->lock);
+	obj = pool_pop(p);
+	if (obj == NULL && head != NULL) {
+		*tail = p->free;
+		p->free = head;
+	}
+	spin_unlock(&p->lock);
+	if (obj != NULL) {
+		free(slab);
+		return obj;
+	}
+	return slab;
+}
+
+void
+pool_put(struct pool *p, void *obj)
+{
+	if (obj == NULL) { return; }
+	spin_lock(&p->lock);
+	*(void **)obj = p->free;
+	p->free = obj;
+	spin_unlock(&p->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef TEEXEC_POOL_H
+#define TEEXEC_POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* A pool hands out fixed-size objects carved from larger slabs. Freed objects
+ * are kept on a free list for reuse and slabs are never returned, so once the
+ * pool has grown to the working set it no longer calls malloc. */
+struct pool {
+	size_t size;         /* Object size. */
+	size_t count;        /* Objects per slab. */
+	atomic_flag lock;
+	void *free;
+};
+
+#define POOL_INIT(_size, _count) { \
+	.size = (_size), \
+	.count = (_count), \
+	.lock = ATOMIC_FLAG_INIT, \
+	.free = NULL \
+}
+
+void *
+pool_get(struct pool *p);
+
+void
+pool_put(struct pool *p, void *obj);
+
+#endif
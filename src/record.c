@@ -0,0 +1,406 @@
+#include "record.h"
+#include "bypass.h"
+#include "debug.h"
+#include "sock.h"
+#include "mux.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define RECORD_BUFFER (1 << 22)
+#define RECORD_RETRY_MS 1000
+
+enum {
+	RECORD_READ,   /* Read all there was, or filled the segment. */
+	RECORD_WAIT,   /* No segment to read into until the retry. */
+	RECORD_STOP
+};
+
+/* A segment file while it is mapped. Bytes up to `used` are whole frames,
+ * and those up to `fill` the start of the next one, which is moved to the
+ * next segment should it not fit. */
+struct segment {
+	int fd;
+	char *map;
+	size_t cap;
+	size_t used;
+	size_t fill;
+	unsigned n;
+	uint64_t opened;    /* Time in ms the segment was opened. */
+	struct record_index *idx;
+	size_t nidx, capidx;
+};
+
+/* Everything past the options belongs to the recorder thread, apart from
+ * the final drain at exit, so the lock is only ever contended then. */
+static struct record_opt record;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct segment seg = { .fd = -1 };
+static int sock = -1;
+static unsigned count = 0;
+static bool done = false;
+
+static uint64_t
+record_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void
+record_path(char *buf, unsigned n, const char *ext)
+{
+	snprintf(buf, PATH_MAX, "%s/teexec-%d-%u.%s", record.dir, (int)getpid(), n, ext);
+}
+
+static bool
+record_open(struct segment *s, size_t cap)
+{
+	char path[PATH_MAX];
+	record_path(path, count, "mux");
+	int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		DEBUG("record failed: %s, %s", path, strerror(errno));
+		return false;
+	}
+
+	/* Running out of space while writing through a mapping raises SIGBUS,
+	 * so the blocks are reserved up front, where it is only an error. */
+#if HAS_POSIX_FALLOCATE
+	int rc = posix_fallocate(fd, 0, (off_t)cap);
+#else
+	int rc = ftruncate(fd, (off_t)cap) < 0 ? errno : 0;
+#endif
+	void *map = MAP_FAILED;
+	if (rc == 0) {
+		map = mmap(NULL, cap, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) { rc = errno; }
+	}
+	if (rc != 0) {
+		DEBUG("record failed: %s, %s", path, strerror(rc));
+		unlink(path);
+		xclose(fd);
+		return false;
+	}
+
+	*s = (struct segment) {
+		.fd = fd,
+		.map = map,
+		.cap = cap,
+		.n = count++,
+		.opened = record_now()
+	};
+	DEBUG("record: %s, %zu", path, cap);
+	return true;
+}
+
+static int
+record_cmp(const void *a, const void *b)
+{
+	const struct record_index *x = a, *y = b;
+	if (x->id != y->id) { return x->id < y->id ? -1 : 1; }
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static bool
+record_write(int fd, const void *buf, size_t len)
+{
+	for (const char *p = buf; len > 0; ) {
+		ssize_t n = xwrite(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+static void
+record_index(const struct segment *s)
+{
+	char path[PATH_MAX];
+	record_path(path, s->n, "idx");
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		DEBUG("record failed: %s, %s", path, strerror(errno));
+		return;
+	}
+	qsort(s->idx, s->nidx, sizeof(*s->idx), record_cmp);
+	for (size_t i = 0; i < s->nidx; i++) {
+		s->idx[i].id = mux_le64(s->idx[i].id);
+		s->idx[i].off = mux_le64(s->idx[i].off);
+	}
+	if (!record_write(fd, s->idx, s->nidx * sizeof(*s->idx))) {
+		DEBUG("record failed: %s, %s", path, strerror(errno));
+	}
+	xclose(fd);
+}
+
+/* Trims the segment to its whole frames and writes its index. A segment
+ * that never got a frame is removed instead. */
+static void
+record_seal(struct segment *s)
+{
+	if (s->map == NULL) { return; }
+	munmap(s->map, s->cap);
+	if (s->used > 0) {
+		if (ftruncate(s->fd, (off_t)s->used) < 0) {
+			DEBUG("record failed: %u, %s", s->n, strerror(errno));
+		}
+		record_index(s);
+	}
+	else {
+		char path[PATH_MAX];
+		record_path(path, s->n, "mux");
+		unlink(path);
+	}
+	xclose(s->fd);
+	free(s->idx);
+	*s = (struct segment) { .fd = -1 };
+}
+
+/* Bytes the partly read frame at the end of the segment needs in all. */
+static size_t
+record_need(const struct segment *s)
+{
+	struct mux_hdr h;
+	if (s->fill - s->used < sizeof(h)) { return sizeof(h); }
+	memcpy(&h, s->map + s->used, sizeof(h));
+	return sizeof(h) + mux_le32(h.len);
+}
+
+static bool
+record_rotate(void)
+{
+	size_t need = record_need(&seg);
+	struct segment next;
+	if (!record_open(&next, need > record.size ? need : record.size)) {
+		return false;
+	}
+	next.fill = seg.fill - seg.used;
+	memcpy(next.map, seg.map + seg.used, next.fill);
+	record_seal(&seg);
+	seg = next;
+	return true;
+}
+
+static bool
+record_scan(struct segment *s)
+{
+	while (s->fill - s->used >= sizeof(struct mux_hdr)) {
+		struct mux_hdr h;
+		memcpy(&h, s->map + s->used, sizeof(h));
+		if (h.magic != MUX_MAGIC) {
+			DEBUG("record failed: %u, bad frame at %zu", s->n, s->used);
+			return false;
+		}
+		size_t size = sizeof(h) + mux_le32(h.len);
+		if (s->fill - s->used < size) { break; }
+
+		if (s->nidx == s->capidx) {
+			s->capidx = s->capidx ? s->capidx * 2 : 4096;
+			s->idx = xrealloc(s->idx, s->capidx * sizeof(*s->idx));
+		}
+		s->idx[s->nidx++] = (struct record_index) { mux_le64(h.id), s->used };
+		if (h.type == MUX_DATA) {
+			stats_add(STATS_RECORDED, 1);
+			stats_add(STATS_RECORDED_BYTES, size - sizeof(h));
+		}
+		s->used += size;
+	}
+	return true;
+}
+
+static int
+record_read(void)
+{
+	/* A segment past its age is closed, and unless it ends partway into a
+	 * frame, the next is only opened once there is a frame to put in it. */
+	if (record.age > 0 && seg.used > 0 &&
+			record_now() - seg.opened >= (uint64_t)record.age * 1000) {
+		if (seg.fill == seg.used) { record_seal(&seg); }
+		else                      { record_rotate(); }
+	}
+	if (seg.map == NULL) {
+		char c;
+		if (xrecv(sock, &c, 1, MSG_PEEK|MSG_DONTWAIT) < 0 &&
+				(errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return RECORD_READ;
+		}
+		if (!record_open(&seg, record.size)) {
+			return RECORD_WAIT;
+		}
+	}
+
+	/* Reads go straight into the mapping until there is nothing left or
+	 * the segment is full, and a segment only fills with a frame that
+	 * doesn't fit, which the next one is sized to hold. */
+	for (;;) {
+		if (seg.fill == seg.cap && !record_rotate()) {
+			return RECORD_WAIT;
+		}
+		ssize_t n = xrecv(sock, seg.map + seg.fill, seg.cap - seg.fill, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			if (errno == EAGAIN || errno == EWOULDBLOCK) { return RECORD_READ; }
+			DEBUG("record failed: %s", strerror(errno));
+			return RECORD_STOP;
+		}
+		if (n == 0) {
+			DEBUG("record closed");
+			return RECORD_STOP;
+		}
+		seg.fill += (size_t)n;
+		if (!record_scan(&seg)) { return RECORD_STOP; }
+	}
+}
+
+static int
+record_timeout(int rc)
+{
+	if (rc == RECORD_WAIT) { return RECORD_RETRY_MS; }
+	if (record.age == 0 || seg.used == 0) { return -1; }
+	uint64_t due = seg.opened + (uint64_t)record.age * 1000, now = record_now();
+	return due > now ? (int)(due - now) : 0;
+}
+
+static void
+record_stop(void)
+{
+	record_seal(&seg);
+	if (sock >= 0) {
+		xclose(sock);
+		sock = -1;
+	}
+	done = true;
+}
+
+/* The thread sleeps on the socket, or only for the retry while it has
+ * nowhere to put what it reads, which leaves the stream to back up. */
+static void *
+record_main(void *arg)
+{
+	(void)arg;
+	int rc = RECORD_READ, timeout = 0;
+	for (;;) {
+		struct pollfd pfd = { rc == RECORD_WAIT ? -1 : sock, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) { break; }
+		pthread_mutex_lock(&lock);
+		if (done) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		rc = record_read();
+		timeout = record_timeout(rc);
+		pthread_mutex_unlock(&lock);
+		if (rc == RECORD_STOP) { break; }
+	}
+	pthread_mutex_lock(&lock);
+	record_stop();
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* Takes whatever has reached the socket by exit and completes the
+ * segment, so a normal exit leaves every segment indexed. */
+static void
+record_exit(void)
+{
+	pthread_mutex_lock(&lock);
+	if (!done) {
+		record_read();
+		record_stop();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static int
+record_start(void)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		DEBUG("record failed: %s", strerror(errno));
+		return -1;
+	}
+	sock_cloexec(sv[0], true);
+	sock_cloexec(sv[1], true);
+	sock_nonblock(sv[0], true);
+
+	/* The pair's buffer is all the slack the recorder has, so it is made
+	 * as large as the system allows. */
+	int size = RECORD_BUFFER;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	sock = sv[1];
+	done = false;
+
+	/* Keep application signals off the recorder thread. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t t;
+	int rc = pthread_create(&t, NULL, record_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		DEBUG("record failed: %s", strerror(rc));
+		xclose(sv[0]);
+		xclose(sv[1]);
+		sock = -1;
+		done = true;
+		return -1;
+	}
+	pthread_detach(t);
+	return sv[0];
+}
+
+int
+record_init(const struct record_opt *opt)
+{
+	record = *opt;
+	if (record.size < sizeof(struct mux_hdr)) {
+		record.size = RECORD_SIZE;
+	}
+	atexit(record_exit);
+	return record_start();
+}
+
+void
+record_fork(void)
+{
+	/* The parent's thread is gone, and may have held the lock. Until the
+	 * child records for itself, nothing is left to drain at exit. */
+	lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	done = true;
+	if (seg.fd >= 0) { xclose(seg.fd); }
+	seg.fd = -1;
+	if (sock >= 0) { xclose(sock); }
+	sock = -1;
+}
+
+int
+record_restart(void)
+{
+	/* The parent's segment is only unmapped, as it is still writing it. */
+	if (seg.map) {
+		munmap(seg.map, seg.cap);
+		free(seg.idx);
+	}
+	seg = (struct segment) { .fd = -1 };
+	count = 0;
+	return record_start();
+}
@@ -0,0 +1,55 @@
+#ifndef TEEXEC_RECORD_H
+#define TEEXEC_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A recording keeps the multiplexed stream on disk in place of a consumer
+ * process. The recorder is fed through a socket pair and offered as a
+ * consumer like any other, so tracing never waits on the disk: once the
+ * pair's buffer is full, frames are skipped under the drop policy and the
+ * gaps they leave are recorded instead.
+ *
+ * A thread reads the stream straight into a segment file mapped in memory,
+ * and moves on to a new segment once the current one is full or has been
+ * open for the given age. A segment is a plain stream of whole frames, as
+ * described in mux.h, named for the process and a count from zero:
+ *
+ *     DIR/teexec-<pid>-<n>.mux
+ *
+ * Once a segment is complete its index is written beside it, listing the
+ * offset of each of its frames by connection id, as an array of struct
+ * record_index sorted by id and then offset:
+ *
+ *     DIR/teexec-<pid>-<n>.idx
+ *
+ * A segment without an index is still being written, or belonged to a
+ * process that didn't exit normally, and may end with zeroed space. A
+ * forked child records to segments of its own, from when it first traces. */
+
+struct record_index {
+	uint64_t id;   /* Connection id, little-endian. */
+	uint64_t off;  /* Offset of the frame in the segment, little-endian. */
+};
+
+_Static_assert(sizeof(struct record_index) == 16, "record index size");
+
+struct record_opt {
+	const char *dir;
+	size_t size;   /* Bytes per segment, unless a single frame needs more. */
+	unsigned age;  /* Seconds a segment stays open, or 0 for no limit. */
+};
+
+#define RECORD_SIZE (1 << 26)
+#define RECORD_AGE 60
+
+int
+record_init(const struct record_opt *opt);
+
+void
+record_fork(void);
+
+int
+record_restart(void);
+
+#endif
@@ -0,0 +1,347 @@
+#include "sender.h"
+#include "debug.h"
+#include "table.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#if HAS_PTHREAD_SETAFFINITY
+# include <sched.h>
+#endif
+
+#define FRAME_ALIGN 8
+#define IDLE_MIN_NS 1000
+#define IDLE_MAX_NS 1000000
+
+/* A single-producer single-consumer ring owned by one application thread.
+ * The producer and consumer positions sit on separate cache lines so the
+ * sender thread advancing the tail doesn't invalidate the producer's line on
+ * every frame. Positions increase without wrapping and are masked on use. */
+struct ring {
+	_Alignas(CACHE_LINE) atomic_size_t head;  /* Written by the producer. */
+	size_t pend;                               /* Reserved, not yet committed. */
+	_Alignas(CACHE_LINE) atomic_size_t tail;  /* Written by the sender. */
+	_Alignas(CACHE_LINE) struct ring *next;
+	size_t done;                               /* Tail to publish after flush. */
+	atomic_bool idle;                          /* Owning thread has exited. */
+	size_t size;
+	char *buf;
+};
+
+static struct sender_opt sender;
+static _Atomic(struct ring *) rings = NULL;
+static _Atomic(struct frame *) stops = NULL;
+static pthread_key_t ring_key;
+static _Thread_local struct ring *local = NULL;
+static bool started = false;
+static struct frame *stale = NULL;
+
+static void
+ring_exit(void *arg)
+{
+	/* Leave the ring for the sender to drain and for a later thread to
+	 * adopt. Rings are never unlinked so the sender can walk them freely. */
+	struct ring *r = arg;
+	atomic_store_explicit(&r->idle, true, memory_order_release);
+}
+
+static struct ring *
+ring_adopt(void)
+{
+	for (struct ring *r = atomic_load(&rings); r; r = r->next) {
+		bool expect = true;
+		if (atomic_compare_exchange_strong(&r->idle, &expect, false)) {
+			return r;
+		}
+	}
+
+	struct ring *r;
+	if (posix_memalign((void **)&r, CACHE_LINE, sizeof(*r))) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->size = sender.ringsize;
+	r->buf = malloc(r->size);
+	if (r->buf == NULL) {
+		free(r);
+		return NULL;
+	}
+
+	r->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {}
+	return r;
+}
+
+static inline struct ring *
+ring_local(void)
+{
+	if (unlikely(local == NULL)) {
+		local = ring_adopt();
+		if (local) {
+			pthread_setspecific(ring_key, local);
+		}
+	}
+	return local;
+}
+
+size_t
+sender_frame_max(void)
+{
+	/* A frame of at most half the ring always fits once the ring drains:
+	 * if it doesn't fit before the end of the buffer, the start of the
+	 * buffer is free and longer than the frame. */
+	return sender.ringsize / 2 - sizeof(struct frame);
+}
+
+struct frame *
+sender_reserve(size_t len)
+{
+	struct ring *r = ring_local();
+	if (r == NULL) { return NULL; }
+
+	size_t size = (sizeof(struct frame) + len + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1);
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t off = head & (r->size - 1), room = r->size - off;
+
+	/* Frames are contiguous, so a frame that doesn't fit before the end of
+	 * the buffer is preceded by padding up to the end. */
+	size_t need = size + (room < size ? room : 0);
+	if (need > r->size - (head - tail)) {
+		return NULL;
+	}
+	if (room < size) {
+		struct frame *pad = (struct frame *)(r->buf + off);
+		pad->size = room;
+		pad->kind = FRAME_PAD;
+		head += room;
+		off = 0;
+	}
+
+	struct frame *f = (struct frame *)(r->buf + off);
+	f->size = size;
+	f->kind = FRAME_DATA;
+	f->flags = 0;
+	f->type = 0;
+	f->len = len;
+	r->pend = head;
+	return f;
+}
+
+void
+sender_commit(struct frame *f)
+{
+	struct ring *r = local;
+	atomic_store_explicit(&r->head, r->pend + f->size, memory_order_release);
+}
+
+bool
+sender_wait(void)
+{
+	/* The sender never blocks on a channel, so a full ring only waits out
+	 * its current pass. There is nothing to wait for in an empty ring. */
+	struct ring *r = local;
+	if (!started || r == NULL) { return false; }
+
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (tail == head) { return false; }
+	while (atomic_load_explicit(&r->tail, memory_order_acquire) == tail) {
+		struct timespec ts = { 0, IDLE_MIN_NS };
+		nanosleep(&ts, NULL);
+	}
+	return true;
+}
+
+void
+sender_stop(int clientfd, int tracefd, uint64_t id, uint64_t seq, uint16_t flags,
+		const void *data, size_t len)
+{
+	struct frame *f = xmalloc(sizeof(*f) + len);
+	f->size = sizeof(*f) + len;
+	f->kind = FRAME_STOP;
+	f->flags = flags;
+	f->type = 0;
+	f->len = len;
+	if (len > 0) {
+		memcpy(f->data, data, len);
+	}
+	f->clientfd = clientfd;
+	f->tracefd = tracefd;
+	f->id = id;
+	f->seq = seq;
+	f->off = 0;
+	f->gen = 0;
+	f->next = atomic_load(&stops);
+	while (!atomic_compare_exchange_weak(&stops, &f->next, f)) {}
+}
+
+static size_t
+sender_drain(void)
+{
+	size_t n = 0;
+	struct ring *first = atomic_load(&rings);
+	for (struct ring *r = first; r; r = r->next) {
+		size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		while (tail != head) {
+			struct frame *f = (struct frame *)(r->buf + (tail & (r->size - 1)));
+			if (f->kind == FRAME_DATA) {
+				sender.send(f);
+				n++;
+			}
+			tail += f->size;
+		}
+		r->done = tail;
+	}
+
+	/* Frames may still be referenced by a batched send, so the space is
+	 * only handed back to the producers once the batch is flushed. */
+	if (n > 0 && sender.flush) {
+		sender.flush();
+	}
+	for (struct ring *r = first; r; r = r->next) {
+		atomic_store_explicit(&r->tail, r->done, memory_order_release);
+	}
+	return n;
+}
+
+static void *
+sender_main(void *arg)
+{
+	(void)arg;
+
+	long idle = IDLE_MIN_NS;
+	for (;;) {
+		/* Take the pending stops before draining, so every frame committed
+		 * ahead of a stop has been sent by the time the stop is handled. */
+		struct frame *s = atomic_exchange(&stops, NULL), *rev = NULL;
+		size_t n = sender_drain();
+		while (s) {
+			struct frame *next = s->next;
+			s->next = rev;
+			rev = s;
+			s = next;
+		}
+		while (rev) {
+			struct frame *next = rev->next;
+			sender.stop(rev);
+			free(rev);
+			rev = next;
+			n++;
+		}
+		if (sender.drain) {
+			n += sender.drain();
+		}
+
+		if (n > 0) {
+			idle = IDLE_MIN_NS;
+		}
+		else {
+			struct timespec ts = { 0, idle };
+			nanosleep(&ts, NULL);
+			if (idle < sender.idle) { idle *= 2; }
+		}
+	}
+	return NULL;
+}
+
+static bool
+sender_start(void)
+{
+	/* Keep application signals off the sender thread. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_t t;
+	int rc = pthread_create(&t, NULL, sender_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		DEBUG("sender failed: %s", strerror(rc));
+		return false;
+	}
+	pthread_detach(t);
+
+#if HAS_PTHREAD_SETAFFINITY
+	if (sender.cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(sender.cpu, &set);
+		rc = pthread_setaffinity_np(t, sizeof(set), &set);
+		if (rc) {
+			DEBUG("sender affinity failed: %s", strerror(rc));
+		}
+	}
+#endif
+	return true;
+}
+
+bool
+sender_init(const struct sender_opt *opt)
+{
+	sender = *opt;
+	if (sender.ringsize < 4096) {
+		sender.ringsize = 4096;
+	}
+	/* Round up to a power of two for masking. */
+	size_t sz = 4096;
+	while (sz < sender.ringsize) { sz <<= 1; }
+	sender.ringsize = sz;
+	if (sender.idle <= 0 || sender.idle > IDLE_MAX_NS) {
+		sender.idle = IDLE_MAX_NS;
+	}
+
+	if (pthread_key_create(&ring_key, ring_exit)) {
+		return false;
+	}
+	if (!sender_start()) {
+		return false;
+	}
+	started = true;
+
+	DEBUG("sender: ring=%zu cpu=%d", sender.ringsize, sender.cpu);
+	return true;
+}
+
+void
+sender_fork(void)
+{
+	if (!started) { return; }
+
+	/* Every queued frame was meant for the parent's channels, and only the
+	 * forking thread came along, so the other rings are left to be adopted
+	 * by the child's own threads. */
+	for (struct ring *r = atomic_load(&rings); r; r = r->next) {
+		size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		atomic_store_explicit(&r->tail, head, memory_order_relaxed);
+		r->done = head;
+		if (r != local) {
+			atomic_store_explicit(&r->idle, true, memory_order_relaxed);
+		}
+	}
+	struct frame *s = atomic_exchange(&stops, NULL);
+	while (s) {
+		struct frame *next = s->next;
+		s->next = stale;
+		stale = s;
+		s = next;
+	}
+}
+
+void
+sender_restart(void)
+{
+	if (!started) { return; }
+	while (stale) {
+		struct frame *next = stale->next;
+		free(stale);
+		stale = next;
+	}
+	if (!sender_start()) {
+		started = false;
+	}
+}
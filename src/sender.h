@@ -0,0 +1,75 @@
+#ifndef TEEXEC_SENDER_H
+#define TEEXEC_SENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FRAME_PAD  0
+#define FRAME_DATA 1
+#define FRAME_STOP 2
+
+/* A frame is a record in a per-thread ring. The trace path copies each read
+ * into a frame, and the sender thread hands the frames to the send callback
+ * in the order they were committed by that thread. Frames stay valid until
+ * the flush callback returns at the end of each pass over the rings. Stop frames are queued
+ * separately and only delivered once every ring has been drained past the
+ * point where the stop was queued, so no frame ever outlives its pairing.
+ *
+ * In a forked child, sender_fork discards whatever was queued, touching
+ * nothing but memory, and sender_restart later starts the child's own
+ * sender thread. */
+struct frame {
+	uint32_t size;    /* Record size in the ring, including this header. */
+	uint16_t kind;    /* FRAME_PAD, FRAME_DATA or FRAME_STOP. */
+	uint16_t flags;   /* Free for use by the callbacks. */
+	uint16_t type;    /* Free for use by the callbacks. */
+	uint32_t len;     /* Payload length following the header. */
+	int clientfd;
+	int tracefd;
+	uint64_t id;
+	uint64_t seq;
+	uint64_t off;     /* Free for use by the callbacks. */
+	unsigned gen;
+	struct frame *next;
+	char data[];
+};
+
+struct sender_opt {
+	size_t ringsize;  /* Bytes of ring per producing thread. */
+	int cpu;          /* CPU to pin the sender thread to, or -1. */
+	void (*send)(struct frame *f);
+	void (*stop)(struct frame *f);
+	void (*flush)(void);
+	size_t (*drain)(void);
+	long idle;        /* Longest idle sleep in ns, or 0 for the default. */
+};
+
+#define SENDER_RINGSIZE (1 << 20)
+
+bool
+sender_init(const struct sender_opt *opt);
+
+size_t
+sender_frame_max(void);
+
+struct frame *
+sender_reserve(size_t len);
+
+bool
+sender_wait(void);
+
+void
+sender_commit(struct frame *f);
+
+void
+sender_fork(void);
+
+void
+sender_restart(void);
+
+void
+sender_stop(int clientfd, int tracefd, uint64_t id, uint64_t seq, uint16_t flags,
+		const void *data, size_t len);
+
+#endif
@@ -0,0 +1,283 @@
+#include "shmring.h"
+
+#if HAS_SHMRING
+
+#include "util.h"
+#include "bypass.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+#define HUGE_SIZE (2u << 20)
+
+struct shmring {
+	struct shmring_hdr *hdr;
+	char *data;
+	size_t size;
+	size_t maplen;
+	int memfd;
+	int efd;
+	struct shmring *next;
+};
+
+/* Rings are never unmapped, as a thread that looked up a channel just before
+ * it was released may still be writing. Released rings are reused instead.
+ * The exception is a forked child, whose only thread is the one forking. */
+static atomic_flag free_lock = ATOMIC_FLAG_INIT;
+static struct shmring *free_list = NULL;
+static struct shmring *stale = NULL;
+
+static uint64_t
+ring_key(void)
+{
+	uint64_t key = 0;
+	int fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		if (read(fd, &key, sizeof(key)) != sizeof(key)) { key = 0; }
+		xclose(fd);
+	}
+	if (key == 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		key = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)getpid();
+	}
+	return key | 1;
+}
+
+static void
+ring_reset(struct shmring *r)
+{
+	struct shmring_hdr *h = r->hdr;
+	h->magic = SHMRING_MAGIC;
+	h->version = SHMRING_VERSION;
+	h->size = r->size;
+	h->data = (char *)r->data - (char *)r->hdr;
+	h->key = ring_key();
+	atomic_store(&h->head, 0);
+	atomic_store(&h->tail, 0);
+	atomic_store(&h->waiting, 0);
+	atomic_store(&h->dropped, 0);
+}
+
+static struct shmring *
+ring_create(size_t size, bool huge)
+{
+	size_t hdr = (sizeof(struct shmring_hdr) + 4095) & ~(size_t)4095;
+	size_t maplen = hdr + size;
+	unsigned flags = MFD_CLOEXEC;
+	if (huge) {
+		maplen = (maplen + HUGE_SIZE - 1) & ~(size_t)(HUGE_SIZE - 1);
+		flags |= MFD_HUGETLB;
+	}
+
+	int memfd = memfd_create("teexec", flags);
+	if (memfd < 0) { return NULL; }
+	if (ftruncate(memfd, maplen) < 0) {
+		xclose(memfd);
+		return NULL;
+	}
+	void *map = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED) {
+		xclose(memfd);
+		return NULL;
+	}
+	int efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (efd < 0) {
+		munmap(map, maplen);
+		xclose(memfd);
+		return NULL;
+	}
+
+	struct shmring *r = xmalloc(sizeof(*r));
+	r->hdr = map;
+	r->data = (char *)map + hdr;
+	r->size = size;
+	r->maplen = maplen;
+	r->memfd = memfd;
+	r->efd = efd;
+	r->next = NULL;
+	return r;
+}
+
+struct shmring *
+shmring_get(size_t size, bool huge)
+{
+	size_t sz = 4096;
+	while (sz < size) { sz <<= 1; }
+
+	spin_lock(&free_lock);
+	struct shmring *r = free_list;
+	if (r) { free_list = r->next; }
+	spin_unlock(&free_lock);
+
+	if (r == NULL && (!huge || !(r = ring_create(sz, true)))) {
+		r = ring_create(sz, false);
+	}
+	if (r) {
+		ring_reset(r);
+	}
+	return r;
+}
+
+void
+shmring_put(struct shmring *r)
+{
+	if (r == NULL) { return; }
+	spin_lock(&free_lock);
+	r->next = free_list;
+	free_list = r;
+	spin_unlock(&free_lock);
+}
+
+void
+shmring_drop(struct shmring *r)
+{
+	if (r == NULL) { return; }
+	munmap(r->hdr, r->maplen);
+	if (r->memfd >= 0) { xclose(r->memfd); }
+	if (r->efd >= 0)   { xclose(r->efd); }
+	free(r);
+}
+
+void
+shmring_close(struct shmring *r)
+{
+	if (r == NULL) { return; }
+	xclose(r->memfd);
+	xclose(r->efd);
+	r->memfd = r->efd = -1;
+}
+
+void
+shmring_fork(void)
+{
+	/* Released rings are still mapped by the parent, which may hand them to
+	 * a consumer of its own, so the child can never reuse them. Their fds
+	 * are closed right away, before the child can reuse the numbers. */
+	atomic_flag_clear(&free_lock);
+	struct shmring *r = free_list;
+	free_list = NULL;
+	while (r) {
+		struct shmring *next = r->next;
+		shmring_close(r);
+		r->next = stale;
+		stale = r;
+		r = next;
+	}
+}
+
+void
+shmring_restart(void)
+{
+	while (stale) {
+		struct shmring *next = stale->next;
+		shmring_drop(stale);
+		stale = next;
+	}
+}
+
+bool
+shmring_hello(struct shmring *r, int fd)
+{
+	struct shmring_hello hello = { SHMRING_MAGIC, SHMRING_VERSION };
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	memset(&ctl, 0, sizeof(ctl));
+
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctl.buf,
+		.msg_controllen = sizeof(ctl.buf)
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = { r->memfd, r->efd };
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	return xsendmsg(fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT) == (ssize_t)sizeof(hello);
+}
+
+uint64_t
+shmring_backlog(struct shmring *r)
+{
+	struct shmring_hdr *h = r->hdr;
+	uint64_t tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+	return head > tail ? head - tail : 0;
+}
+
+bool
+shmring_write(struct shmring *r, uint64_t id, uint16_t type, uint16_t flags,
+		const struct iovec *iov, size_t iovcnt, size_t len)
+{
+	struct shmring_hdr *h = r->hdr;
+	size_t size = (sizeof(struct shmring_rec) + len + SHMRING_ALIGN - 1) &
+		~(size_t)(SHMRING_ALIGN - 1);
+	uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+	uint64_t off, room, need;
+
+	/* Reserve space, including padding to the end of the buffer when the
+	 * record doesn't fit before it. The ring never waits for the consumer;
+	 * a record that doesn't fit is dropped. */
+	do {
+		uint64_t tail = atomic_load_explicit(&h->tail, memory_order_acquire);
+		off = head & (r->size - 1);
+		room = r->size - off;
+		need = size + (room < size ? room : 0);
+		if (head + need - tail > r->size) {
+			atomic_fetch_add_explicit(&h->dropped, 1, memory_order_relaxed);
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&h->head, &head, head + need,
+				memory_order_relaxed, memory_order_relaxed));
+
+	if (room < size) {
+		struct shmring_rec *pad = (struct shmring_rec *)(r->data + off);
+		pad->size = room;
+		pad->type = SHMRING_PAD;
+		atomic_store_explicit(&pad->commit, head ^ h->key, memory_order_release);
+		head += room;
+		off = 0;
+	}
+
+	struct shmring_rec *rec = (struct shmring_rec *)(r->data + off);
+	rec->size = size;
+	rec->type = type;
+	rec->flags = flags;
+	rec->id = id;
+	rec->len = len;
+	rec->reserved = 0;
+	char *p = (char *)(rec + 1);
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	atomic_store_explicit(&rec->commit, head ^ h->key, memory_order_release);
+
+	/* Pairs with the consumer setting waiting before its final check. */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&h->waiting, memory_order_relaxed) &&
+			atomic_exchange(&h->waiting, 0)) {
+		uint64_t one = 1;
+		ssize_t rc = xwrite(r->efd, &one, sizeof(one));
+		(void)rc;
+	}
+	return true;
+}
+
+#endif
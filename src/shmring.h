@@ -0,0 +1,109 @@
+#ifndef TEEXEC_SHMRING_H
+#define TEEXEC_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#if HAS_MEMFD_CREATE && HAS_EVENTFD
+# define HAS_SHMRING 1
+#else
+# define HAS_SHMRING 0
+#endif
+
+/* A shared-memory ring is handed to a consumer over its trace socket as two
+ * descriptors passed with SCM_RIGHTS: a memfd holding the ring and an eventfd
+ * used for wakeups. The message payload is struct shmring_hello.
+ *
+ * The memfd begins with struct shmring_hdr, followed by `size` bytes of
+ * records starting at offset `data`. Positions increase without wrapping and
+ * are masked by size-1. Each record is aligned to SHMRING_ALIGN and begins
+ * with struct shmring_rec. A record at position `pos` is complete once its
+ * `commit` field equals `pos ^ key`. Records may be committed out of order
+ * by different threads, so the consumer waits for the record at its tail.
+ *
+ * After reading a record the consumer advances `tail` by the record's size.
+ * Before sleeping on the eventfd it sets `waiting` to 1 and checks the next
+ * record once more; producers write to the eventfd when they find `waiting`
+ * set after committing.
+ *
+ * Record types and payloads match the multiplexing frames in mux.h. */
+
+#define SHMRING_MAGIC 0x74656578u   /* "teex" */
+#define SHMRING_VERSION 1
+#define SHMRING_ALIGN 16
+
+#define SHMRING_PAD   0
+#define SHMRING_DATA  1
+#define SHMRING_CLOSE 2
+#define SHMRING_OPEN  3
+#define SHMRING_GAP   4
+
+#define SHMRING_TX 0x0001  /* Record holds data the application sent. */
+
+struct shmring_hello {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct shmring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;                          /* Bytes of record space. */
+	uint64_t data;                          /* Offset of the record space. */
+	uint64_t key;                           /* Commit word key. */
+	_Alignas(64) _Atomic uint64_t head;     /* Reserved by producers. */
+	_Alignas(64) _Atomic uint64_t tail;     /* Consumed by the consumer. */
+	_Alignas(64) _Atomic uint32_t waiting;  /* Consumer sleeps on eventfd. */
+	_Alignas(64) _Atomic uint64_t dropped;  /* Records that didn't fit. */
+};
+
+struct shmring_rec {
+	_Atomic uint64_t commit;  /* Position xor key once complete. */
+	uint32_t size;            /* Record size including this header. */
+	uint16_t type;            /* SHMRING_* record type. */
+	uint16_t flags;
+	uint64_t id;              /* Connection id. */
+	uint32_t len;             /* Payload length following the header. */
+	uint32_t reserved;
+};
+
+#if HAS_SHMRING
+
+struct shmring;
+
+struct shmring *
+shmring_get(size_t size, bool huge);
+
+void
+shmring_put(struct shmring *r);
+
+void
+shmring_drop(struct shmring *r);
+
+void
+shmring_close(struct shmring *r);
+
+/* Run in a forked child, shmring_fork closes the fds of the parent's spare
+ * rings, and shmring_restart unmaps them once the child starts tracing. */
+void
+shmring_fork(void);
+
+void
+shmring_restart(void);
+
+bool
+shmring_hello(struct shmring *r, int fd);
+
+uint64_t
+shmring_backlog(struct shmring *r);
+
+bool
+shmring_write(struct shmring *r, uint64_t id, uint16_t type, uint16_t flags,
+		const struct iovec *iov, size_t iovcnt, size_t len);
+
+#endif
+
+#endif
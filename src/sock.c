@@ -193,7 +193,7 @@ sock_set_inet(struct sock *sock, const struct sockopt *opt, const char *host, co
 		return set_error(sock, ec, SOCK_ERROR_GAI);
 	}
 
-	for (struct addrinfo *r = res; res; res = res->ai_next) {
+	for (struct addrinfo *r = res; r; r = r->ai_next) {
 		if (set_addr(sock, opt, r->ai_family, r->ai_addr, r->ai_addrlen)) {
 			memcpy(&sock->addr.ss, r->ai_addr, r->ai_addrlen);
 			break;
@@ -305,6 +305,15 @@ sock_setopt(int fd, const struct sockopt *opt)
 		if (opt->nodelay) {
 			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 		}
+#if defined(TCP_CORK)
+		if (opt->cork) {
+			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+		}
+#elif defined(TCP_NOPUSH)
+		if (opt->cork) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+		}
+#endif
 	}
 #ifdef SO_NOSIGPIPE
 	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
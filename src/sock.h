@@ -41,6 +41,7 @@ struct sockopt {
 	bool reuseaddr;    /* Allow reuse of local addresses. */
 	bool reuseport;    /* Allow multiple binds to the same address and port. */
 	bool nodelay;      /* Disable TCP Nagle algorithm. */
+	bool cork;         /* Only send full TCP segments (TCP_CORK or TCP_NOPUSH). */
 	bool defer_accept; /* Awaken listener only when data arrives on the socket. */
 	bool keepalive;    /* Send TCP keep alive probes. */
 
@@ -104,6 +105,7 @@ addr_equal(const struct sockaddr *a, const struct sockaddr *b);
 	.reuseaddr = true, \
 	.reuseport = false, \
 	.nodelay = false, \
+	.cork = false, \
 	.defer_accept = false, \
 	.keepalive = false, \
 	.cloexec = true, \
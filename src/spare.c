@@ -0,0 +1,648 @@
+#include "spare.h"
+#include "bypass.h"
+#include "debug.h"
+#include "table.h"
+#include "sock.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#if HAS_EPOLL
+# include <sys/epoll.h>
+#endif
+
+#define SPARE_LISTENER UINT64_MAX
+#define SPARE_BACKOFF_NS 1000000
+#define SPARE_LOAD_SHIFT 16
+#define SPARE_DEFER_NS 1000000
+#define SPARE_DEFER_MAX 16
+#define SPARE_PEER (UINT32_C(1) << 31)
+#define SPARE_CONNECT_MS 5000
+#define SPARE_RETRY_MIN_MS 100
+#define SPARE_RETRY_MAX_MS 30000
+
+/* The head packs the top fd plus one into the low half and a count of every
+ * change into the high half, so a pop that raced with a pop and push of the
+ * same fd fails its compare-and-swap. Links also hold the next fd plus one,
+ * with zero ending the stack. */
+static struct spare_opt spare;
+static _Atomic uint64_t head = 0;
+static struct table links;
+static atomic_bool running = false;
+
+/* Index slots are kept in a table so they never move under a reader. A slot
+ * being overwritten may be read half changed, which the caller catches by
+ * checking the generation once it holds the consumer. */
+struct member {
+	atomic_int fd;
+	atomic_uint gen;
+	_Atomic uint64_t load;
+};
+
+static struct table members;
+static atomic_uint nmembers = 0;
+static atomic_flag members_lock = ATOMIC_FLAG_INIT;
+#if HAS_EPOLL
+static int watch = -1;
+#endif
+
+/* Once the process has forked, its helper shares the listener with those of
+ * its siblings. Each takes one consumer at a time, first waiting a little
+ * for every idle consumer it already holds, so the one with the fewest gets
+ * the next consumer and the pools even out across processes. */
+static atomic_bool siblings = false;
+static atomic_uint idle = 0;
+
+static void
+spare_add(int fd, unsigned gen)
+{
+	spin_lock(&members_lock);
+	unsigned n = atomic_load_explicit(&nmembers, memory_order_relaxed);
+	struct member *m = table_make(&members, (int)n);
+	if (m) {
+		atomic_store_explicit(&m->fd, fd, memory_order_relaxed);
+		atomic_store_explicit(&m->gen, gen, memory_order_relaxed);
+		atomic_store_explicit(&m->load, 0, memory_order_relaxed);
+		atomic_store_explicit(&nmembers, n + 1, memory_order_release);
+	}
+	spin_unlock(&members_lock);
+	if (m == NULL) {
+		spare.drop(fd);
+	}
+}
+
+static void
+spare_tick(void)
+{
+	/* Dead consumers are swapped out for the last slot, and dropped once
+	 * they are no longer listed. */
+	spin_lock(&members_lock);
+	unsigned n = atomic_load_explicit(&nmembers, memory_order_relaxed);
+	for (unsigned i = 0; i < n; ) {
+		struct member *m = table_get(&members, (int)i);
+		int fd = atomic_load_explicit(&m->fd, memory_order_relaxed);
+		if (spare.alive(fd)) {
+			atomic_store_explicit(&m->load, spare.backlog(fd), memory_order_relaxed);
+			i++;
+			continue;
+		}
+		struct member *last = table_get(&members, (int)--n);
+		atomic_store_explicit(&m->fd,
+				atomic_load_explicit(&last->fd, memory_order_relaxed),
+				memory_order_relaxed);
+		atomic_store_explicit(&m->gen,
+				atomic_load_explicit(&last->gen, memory_order_relaxed),
+				memory_order_relaxed);
+		atomic_store_explicit(&m->load,
+				atomic_load_explicit(&last->load, memory_order_relaxed),
+				memory_order_relaxed);
+		atomic_store_explicit(&nmembers, n, memory_order_release);
+		DEBUG("spare dropped: %d", fd);
+		spare.drop(fd);
+	}
+	spin_unlock(&members_lock);
+}
+
+static inline uint64_t
+spare_neglog(uint64_t h)
+{
+	/* -log2(h / 2^64) in 16.16 fixed point, interpolating linearly between
+	 * powers of two. */
+	if (h == 0) { h = 1; }
+	int lz = __builtin_clzll(h);
+	uint64_t frac = ((h << lz) << 1) >> 48;
+	return ((uint64_t)64 << 16) - (((uint64_t)(63 - lz) << 16) | frac);
+}
+
+static void
+spare_offer(int fd, unsigned gen)
+{
+	if (spare.shared) { spare_add(fd, gen); }
+	else              { spare_put(fd); }
+	DEBUG("spare: %d", fd);
+}
+
+bool
+spare_adopt(int fd)
+{
+	unsigned gen = 0;
+	if (!spare.ready(fd, &gen)) {
+		return false;
+	}
+#if HAS_EPOLL
+	if (watch >= 0) {
+		struct epoll_event ev = {
+			.events = EPOLLRDHUP | EPOLLET,
+			.data.u64 = ((uint64_t)gen << 32) | (uint32_t)fd
+		};
+		if (epoll_ctl(watch, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			DEBUG("spare watch failed: %d, %s", fd, strerror(errno));
+		}
+	}
+#endif
+	spare_offer(fd, gen);
+	return true;
+}
+
+static bool
+spare_accept(bool one)
+{
+	if (spare.fd < 0) { return true; }
+	for (;;) {
+		int fd = xaccept(spare.fd, true);
+		if (fd < 0) {
+			switch (errno) {
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+				return true;
+			case ECONNABORTED:
+			case EPROTO:
+				continue;
+			case EMFILE:
+			case ENFILE:
+			case ENOBUFS:
+			case ENOMEM:
+				/* The consumer stays queued on the listener until an fd
+				 * frees up, so the helper backs off rather than spin. */
+				if (atomic_load_explicit(&running, memory_order_relaxed)) {
+					struct timespec ts = { 0, SPARE_BACKOFF_NS };
+					nanosleep(&ts, NULL);
+				}
+				return true;
+			default:
+				DEBUG("spare accept failed: %s", strerror(errno));
+				return false;
+			}
+		}
+
+		if (spare_adopt(fd) && one) { return true; }
+	}
+}
+
+#if HAS_EPOLL
+
+/* A connection kept open to a collector. Once connected the helper holds a
+ * duplicate of the fd and watches that instead, so the hangup is still seen
+ * should the trace side close its fd first. Peers are watched under their
+ * index with SPARE_PEER set, which no fd has. */
+struct peer {
+	const char *host; /* Host name, or UNIX socket path when serv is NULL. */
+	const char *serv;
+	int fd;           /* Connection, or -1 while waiting to retry. */
+	int dup;          /* Watched duplicate once connected, or -1. */
+	unsigned gen;
+	unsigned backoff; /* Milliseconds, doubled by each failure. */
+	uint64_t when;    /* Retry time, or connect deadline while connecting. */
+};
+
+static struct peer *peers = NULL;
+static unsigned npeers = 0;
+static uint64_t peer_rng = 0;
+
+static uint64_t
+spare_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static const char *
+spare_name(const struct peer *p)
+{
+	/* Only the helper reports on peers, so one buffer will do. */
+	static char buf[512];
+	snprintf(buf, sizeof(buf), "%s%s%s", p->host, p->serv ? ":" : "", p->serv ? p->serv : "");
+	return buf;
+}
+
+static void
+spare_retry(struct peer *p, uint64_t now)
+{
+	/* Each wait is drawn from the upper half of the backoff, so producers
+	 * that lost a collector together don't all come back at once. */
+	peer_rng ^= peer_rng << 13;
+	peer_rng ^= peer_rng >> 7;
+	peer_rng ^= peer_rng << 17;
+	unsigned half = p->backoff / 2;
+	p->when = now + half + peer_rng % (half + 1);
+	if (p->backoff < SPARE_RETRY_MAX_MS) {
+		p->backoff = p->backoff * 2 < SPARE_RETRY_MAX_MS ?
+			p->backoff * 2 : SPARE_RETRY_MAX_MS;
+	}
+	p->fd = -1;
+	p->dup = -1;
+}
+
+static void
+spare_dial(struct peer *p, uint64_t now)
+{
+	struct sockopt opt = SOCKOPT_STREAM;
+	opt.reuseaddr = false;
+	opt.nonblock = true;
+	opt.keepalive = true;
+	opt.nodelay = !spare.cork;
+	opt.cork = spare.cork;
+
+	struct sock sock;
+	bool ok = p->serv ?
+		sock_set_inet(&sock, &opt, p->host, p->serv) :
+		sock_set_un(&sock, &opt, p->host);
+	if (!ok) {
+		DEBUG("push failed: %s, %s", spare_name(p), sock.errortype == SOCK_ERROR_GAI ?
+				gai_strerror(sock.error) : strerror(sock.error));
+		spare_retry(p, now);
+		return;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data.u64 = SPARE_PEER | (uint32_t)(p - peers)
+	};
+	if (epoll_ctl(watch, EPOLL_CTL_ADD, sock.fd, &ev) < 0) {
+		DEBUG("push watch failed: %d, %s", sock.fd, strerror(errno));
+		xclose(sock.fd);
+		spare_retry(p, now);
+		return;
+	}
+	p->fd = sock.fd;
+	p->when = now + SPARE_CONNECT_MS;
+}
+
+static void
+spare_connected(struct peer *p, uint64_t now)
+{
+	int fd = p->fd, err = 0;
+	socklen_t len = sizeof(err);
+	epoll_ctl(watch, EPOLL_CTL_DEL, fd, NULL);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) { err = errno; }
+	if (err) {
+		DEBUG("push failed: %s, %s", spare_name(p), strerror(err));
+		xclose(fd);
+		spare_retry(p, now);
+		return;
+	}
+
+	int dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup < 0) {
+		DEBUG("push failed: %s, %s", spare_name(p), strerror(errno));
+		xclose(fd);
+		spare_retry(p, now);
+		return;
+	}
+	if (!spare.ready(fd, &p->gen)) {
+		xclose(dup);
+		spare_retry(p, now);
+		return;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLRDHUP | EPOLLET,
+		.data.u64 = SPARE_PEER | (uint32_t)(p - peers)
+	};
+	if (epoll_ctl(watch, EPOLL_CTL_ADD, dup, &ev) < 0) {
+		DEBUG("push watch failed: %d, %s", dup, strerror(errno));
+	}
+	p->dup = dup;
+	p->backoff = SPARE_RETRY_MIN_MS;
+	DEBUG("push: %s", spare_name(p));
+	spare_offer(fd, p->gen);
+}
+
+static void
+spare_peer(uint32_t i, uint32_t events)
+{
+	struct peer *p = &peers[i];
+	uint64_t now = spare_now();
+	if (p->fd < 0) { return; }
+	if (p->dup < 0) {
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) { spare_connected(p, now); }
+		return;
+	}
+
+	/* The collector went away, or the trace side gave up on it. Either way
+	 * the duplicate is all the helper has left to close. */
+	DEBUG("push closed: %s", spare_name(p));
+	spare.hangup(p->fd, p->gen);
+	xclose(p->dup);
+	p->backoff = SPARE_RETRY_MIN_MS;
+	spare_retry(p, now);
+}
+
+static int
+spare_redial(int timeout)
+{
+	/* Dials each peer that is due, gives up on connects that took too long,
+	 * and shortens the timeout to whichever comes next. */
+	uint64_t now = spare_now();
+	for (unsigned i = 0; i < npeers; i++) {
+		struct peer *p = &peers[i];
+		if (p->dup >= 0) { continue; }
+		if (p->when <= now) {
+			if (p->fd >= 0) {
+				DEBUG("push failed: %s, %s", spare_name(p), strerror(ETIMEDOUT));
+				xclose(p->fd);
+				spare_retry(p, now);
+			}
+			else {
+				spare_dial(p, now);
+			}
+		}
+		if (p->dup < 0 && p->when > now) {
+			uint64_t wait = p->when - now;
+			if (timeout < 0 || wait < (uint64_t)timeout) { timeout = (int)wait; }
+		}
+	}
+	return timeout;
+}
+
+static bool
+spare_peers(const char *list, unsigned conns)
+{
+	/* The list is split in place in a copy that lives as long as the peers.
+	 * An address with a colon is a host and port, with brackets allowed
+	 * around an IPv6 host, and anything else is a UNIX socket path. */
+	char *copy = strdup(list);
+	if (copy == NULL) { return false; }
+	unsigned n = 1;
+	for (const char *c = copy; *c; c++) { n += *c == ','; }
+	if (conns == 0) { conns = 1; }
+	peers = calloc((size_t)n * conns, sizeof(*peers));
+	if (peers == NULL) {
+		free(copy);
+		return false;
+	}
+
+	char *save = NULL;
+	for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *serv = strrchr(tok, ':');
+		if (serv) {
+			*serv++ = '\0';
+			size_t len = strlen(tok);
+			if (len > 1 && tok[0] == '[' && tok[len-1] == ']') {
+				tok[len-1] = '\0';
+				tok++;
+			}
+		}
+		for (unsigned i = 0; i < conns; i++) {
+			peers[npeers++] = (struct peer) {
+				.host = tok,
+				.serv = serv,
+				.fd = -1,
+				.dup = -1,
+				.backoff = SPARE_RETRY_MIN_MS,
+				.when = 0
+			};
+		}
+	}
+	peer_rng = (uint64_t)getpid() << 32 ^ spare_now() ^ 0x9e3779b97f4a7c15ULL;
+	return npeers > 0;
+}
+
+#endif
+
+static bool
+spare_listen(void)
+{
+	bool one = atomic_load_explicit(&siblings, memory_order_relaxed);
+	if (one) {
+		unsigned n = spare.shared ?
+			atomic_load_explicit(&nmembers, memory_order_relaxed) :
+			atomic_load_explicit(&idle, memory_order_relaxed);
+		if (n > SPARE_DEFER_MAX) { n = SPARE_DEFER_MAX; }
+		if (n > 0) {
+			struct timespec ts = { 0, (long)n * SPARE_DEFER_NS };
+			nanosleep(&ts, NULL);
+		}
+	}
+	return spare_accept(one);
+}
+
+static void *
+spare_main(void *arg)
+{
+	(void)arg;
+
+	/* Shared consumers are revisited every tick, whether or not anything
+	 * else woke the helper. */
+	int timeout = spare.shared || spare.tick ? SPARE_TICK_MS : -1;
+
+#if HAS_EPOLL
+	struct epoll_event ev[64];
+	for (;;) {
+		int wait = npeers ? spare_redial(timeout) : timeout;
+		int n = epoll_wait(watch, ev, countof(ev), wait);
+		if (n < 0 && errno != EINTR) { break; }
+		for (int i = 0; i < n; i++) {
+			uint64_t data = ev[i].data.u64;
+			if (data == SPARE_LISTENER) {
+				if (!spare_listen()) { goto done; }
+			}
+			else if ((uint32_t)data & SPARE_PEER) {
+				spare_peer((uint32_t)data & ~SPARE_PEER, ev[i].events);
+			}
+			else {
+				spare.hangup((int)(uint32_t)data, (unsigned)(data >> 32));
+			}
+		}
+		if (spare.shared) { spare_tick(); }
+		if (spare.tick)   { spare.tick(); }
+	}
+done:
+#else
+	struct pollfd pfd = { spare.fd, POLLIN, 0 };
+	for (;;) {
+		int n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno != EINTR) { break; }
+		if (n > 0 && ((pfd.revents & POLLNVAL) || !spare_listen())) { break; }
+		if (spare.shared) { spare_tick(); }
+		if (spare.tick)   { spare.tick(); }
+	}
+#endif
+	DEBUG("spare stopped");
+	atomic_store(&running, false);
+	return NULL;
+}
+
+int
+spare_get(void)
+{
+	/* Without the helper thread consumers are accepted as clients are. */
+	if (unlikely(!atomic_load_explicit(&running, memory_order_relaxed))) {
+		spare_accept(false);
+	}
+
+	uint64_t old = atomic_load_explicit(&head, memory_order_acquire), new;
+	int fd;
+	do {
+		fd = (int)(uint32_t)old - 1;
+		if (fd < 0) { return -1; }
+		atomic_int *link = table_get(&links, fd);
+		new = (((old >> 32) + 1) << 32) |
+			(uint32_t)atomic_load_explicit(link, memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&head, &old, new,
+				memory_order_acquire, memory_order_acquire));
+	atomic_fetch_sub_explicit(&idle, 1, memory_order_relaxed);
+	return fd;
+}
+
+bool
+spare_put(int fd)
+{
+	atomic_int *link = table_make(&links, fd);
+	if (link == NULL) { return false; }
+
+	uint64_t old = atomic_load_explicit(&head, memory_order_relaxed), new;
+	do {
+		atomic_store_explicit(link, (int)(uint32_t)old, memory_order_relaxed);
+		new = (((old >> 32) + 1) << 32) | (uint32_t)(fd + 1);
+	} while (!atomic_compare_exchange_weak_explicit(&head, &old, new,
+				memory_order_release, memory_order_relaxed));
+	atomic_fetch_add_explicit(&idle, 1, memory_order_relaxed);
+	return true;
+}
+
+int
+spare_pick(uint64_t key, unsigned *gen)
+{
+	if (unlikely(!atomic_load_explicit(&running, memory_order_relaxed))) {
+		spare_accept(false);
+		spare_tick();
+	}
+
+	/* Weighted rendezvous hashing: each consumer draws an exponential from
+	 * the key and its generation, stretched by its backlog, and the
+	 * smallest draw wins. */
+	unsigned n = atomic_load_explicit(&nmembers, memory_order_acquire);
+	uint64_t best = UINT64_MAX;
+	int fd = -1;
+	for (unsigned i = 0; i < n; i++) {
+		struct member *m = table_get(&members, (int)i);
+		int mfd = atomic_load_explicit(&m->fd, memory_order_relaxed);
+		unsigned mgen = atomic_load_explicit(&m->gen, memory_order_relaxed);
+		if (!spare.alive(mfd)) { continue; }
+
+		uint64_t h = (key ^ mgen) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+		h *= 0xd6e8feb86659fd93ULL;
+		h ^= h >> 32;
+		uint64_t load = atomic_load_explicit(&m->load, memory_order_relaxed);
+		uint64_t score = spare_neglog(h) * (1 + (load >> SPARE_LOAD_SHIFT));
+		if (score < best) {
+			best = score;
+			fd = mfd;
+			*gen = mgen;
+		}
+	}
+	return fd;
+}
+
+unsigned
+spare_count(void)
+{
+	return atomic_load_explicit(&nmembers, memory_order_relaxed);
+}
+
+static bool
+spare_start(void)
+{
+#if HAS_EPOLL
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SPARE_LISTENER };
+	watch = epoll_create1(EPOLL_CLOEXEC);
+	if (watch < 0 || (spare.fd >= 0 && epoll_ctl(watch, EPOLL_CTL_ADD, spare.fd, &ev) < 0)) {
+		DEBUG("spare failed: %s", strerror(errno));
+		if (watch >= 0) { xclose(watch); }
+		watch = -1;
+		return false;
+	}
+#else
+	if (spare.push) {
+		DEBUG("spare failed: push needs epoll");
+		return false;
+	}
+#endif
+
+	/* Keep application signals off the helper thread. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	atomic_store(&running, true);
+	pthread_t t;
+	int rc = pthread_create(&t, NULL, spare_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		atomic_store(&running, false);
+		DEBUG("spare failed: %s", strerror(rc));
+		return false;
+	}
+	pthread_detach(t);
+	return true;
+}
+
+bool
+spare_init(const struct spare_opt *opt)
+{
+	spare = *opt;
+	table_init(&links, sizeof(atomic_int), spare.max);
+	table_init(&members, sizeof(struct member), spare.max);
+#if HAS_EPOLL
+	if (spare.push && !spare_peers(spare.push, spare.conns)) {
+		DEBUG("spare failed: no collectors");
+		return false;
+	}
+#endif
+	return spare_start();
+}
+
+void
+spare_fork(bool child)
+{
+	if (spare.ready == NULL) { return; }
+	atomic_store(&siblings, true);
+	if (!child) { return; }
+
+	/* The consumers listed were accepted by the parent, which keeps them.
+	 * The caller closes the child's copies; here they are only forgotten,
+	 * and spare_restart has the child accept consumers of its own. The
+	 * epoll instance is shared with the parent, so the child makes its own
+	 * then. */
+	atomic_store(&head, 0);
+	atomic_store(&idle, 0);
+	atomic_store(&nmembers, 0);
+	atomic_flag_clear(&members_lock);
+	atomic_store(&running, false);
+#if HAS_EPOLL
+	if (watch >= 0) {
+		xclose(watch);
+		watch = -1;
+	}
+	/* Connected peers were closed with the rest of the consumers, and the
+	 * child dials its own as soon as its helper starts. */
+	for (unsigned i = 0; i < npeers; i++) {
+		struct peer *p = &peers[i];
+		if (p->dup >= 0)     { xclose(p->dup); }
+		else if (p->fd >= 0) { xclose(p->fd); }
+		p->fd = -1;
+		p->dup = -1;
+		p->backoff = SPARE_RETRY_MIN_MS;
+		p->when = 0;
+	}
+	peer_rng ^= (uint64_t)getpid() << 32;
+#endif
+}
+
+void
+spare_restart(void)
+{
+	if (spare.ready == NULL) { return; }
+	spare_start();
+}
@@ -0,0 +1,82 @@
+#ifndef TEEXEC_SPARE_H
+#define TEEXEC_SPARE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Spare trace fds are consumers that are connected and ready to be paired. A
+ * helper thread waits on the trace listener, accepts each consumer as it
+ * connects, and hands it to the ready callback before making it available,
+ * so pairing a client only pops a lock-free stack and makes no system calls.
+ * The stack is linked through a table indexed by fd, so it holds as many
+ * consumers as there are fds.
+ *
+ * Where epoll is available the helper also watches every consumer it has
+ * accepted, and reports a consumer that hangs up to the hangup callback with
+ * the value the ready callback gave it.
+ *
+ * Shared consumers are kept in an index instead, and a client is given one
+ * by rendezvous hashing on a key, so the same key keeps picking the same
+ * consumer and a consumer leaving only moves the keys it held. Each
+ * consumer's score is weighted by its backlog, which the helper samples
+ * every tick, while also dropping the consumers that are no longer alive.
+ * Only the helper changes the index, so picking a consumer takes no locks.
+ *
+ * When given a tick callback, the helper also calls it every tick.
+ *
+ * In push mode there is no listener. The helper instead keeps connections
+ * open to a list of collectors, each a host and port or a UNIX socket path,
+ * and offers each one as a consumer once it connects. A connection that
+ * fails or hangs up is dialed again after a jittered, doubling backoff.
+ *
+ * A forked child shares the trace listener with its parent, and calls
+ * spare_fork to drop the parent's consumers, then spare_restart to start a
+ * helper of its own, so each process accepts and pairs from its own pool. The parent calls it
+ * too, and from then on the helpers of related processes take consumers one
+ * at a time, favoring whichever holds the fewest.
+ *
+ * A consumer that was connected some other way is handed over with
+ * spare_adopt, which readies, watches and offers it as the helper would. */
+
+struct spare_opt {
+	int fd;         /* Trace listener, or -1 for none. */
+	int max;        /* Largest valid file descriptor. */
+	bool shared;    /* Index consumers for spare_pick instead of stacking. */
+	const char *push; /* Collectors to connect out to, separated by commas. */
+	unsigned conns; /* Connections to keep open to each collector. */
+	bool cork;      /* Cork pushed TCP connections instead of disabling Nagle. */
+	bool (*ready)(int fd, unsigned *gen);
+	void (*hangup)(int fd, unsigned gen);
+	bool (*alive)(int fd);
+	uint64_t (*backlog)(int fd);
+	void (*drop)(int fd);
+	void (*tick)(void);
+};
+
+#define SPARE_TICK_MS 10
+
+bool
+spare_init(const struct spare_opt *opt);
+
+void
+spare_fork(bool child);
+
+void
+spare_restart(void);
+
+bool
+spare_adopt(int fd);
+
+int
+spare_get(void);
+
+bool
+spare_put(int fd);
+
+int
+spare_pick(uint64_t key, unsigned *gen);
+
+unsigned
+spare_count(void);
+
+#endif
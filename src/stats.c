@@ -0,0 +1,548 @@
+#include "stats.h"
+
+const char *const stats_names[STATS_COUNT] = {
+	[STATS_PAIRED] = "paired",
+	[STATS_UNPAIRED] = "unpaired",
+	[STATS_SLOW] = "slow",
+	[STATS_NO_PAIR] = "no_pair",
+	[STATS_FRAMES] = "frames",
+	[STATS_BYTES] = "bytes",
+	[STATS_SKIPPED] = "skipped",
+	[STATS_SKIPPED_BYTES] = "skipped_bytes",
+	[STATS_PACKED] = "packed",
+	[STATS_PACKED_BYTES] = "packed_bytes",
+	[STATS_RECORDED] = "recorded",
+	[STATS_RECORDED_BYTES] = "recorded_bytes",
+};
+
+const char *const stats_hooks[STATS_HOOKS] = {
+	[STATS_HOOK_READ] = "read",
+	[STATS_HOOK_READV] = "readv",
+	[STATS_HOOK_RECV] = "recv",
+	[STATS_HOOK_RECVMSG] = "recvmsg",
+	[STATS_HOOK_RECVMMSG] = "recvmmsg",
+	[STATS_HOOK_WRITE] = "write",
+	[STATS_HOOK_WRITEV] = "writev",
+	[STATS_HOOK_SEND] = "send",
+	[STATS_HOOK_SENDMSG] = "sendmsg",
+	[STATS_HOOK_SENDMMSG] = "sendmmsg",
+	[STATS_HOOK_SENDFILE] = "sendfile",
+};
+
+bool stats_latency = false;
+
+#if HAS_STATS
+
+#include "util.h"
+#include "debug.h"
+#include "bypass.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Slot states, kept out of the segment as only this process needs them. */
+enum { SLOT_FREE, SLOT_OWNED, SLOT_IDLE };
+
+static struct stats_hdr *seg = NULL;
+static int seg_fd = -1;
+static size_t seg_len = 0;
+static struct stats_slot *slots = NULL;
+static struct stats_slot *overflow = NULL;
+static struct stats_consumer *consumers = NULL;
+static _Atomic uint64_t *hists = NULL;
+static uint64_t clock0, mono0;
+static atomic_uchar slot_state[STATS_SLOTS - 1];
+static pthread_key_t slot_key;
+static _Thread_local struct stats_slot *local = NULL;
+
+/* The parent's segment, left mapped in a forked child until it restarts. */
+static struct stats_hdr *stale = NULL;
+static size_t stale_len = 0;
+static int stale_mode = 0;
+static bool stale_latency = false;
+
+static uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+stats_exit(void);
+
+static void
+stats_calibrate(void);
+
+static uint64_t
+stats_mono(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t
+stats_hist_size(void)
+{
+	return (size_t)STATS_HOOKS * 2 * STATS_BUCKETS * sizeof(uint64_t);
+}
+
+static void
+slot_exit(void *arg)
+{
+	/* A later thread adopts the slot and keeps adding to its counters, so
+	 * the sums never go backwards. */
+	atomic_store_explicit((atomic_uchar *)arg, SLOT_IDLE, memory_order_release);
+}
+
+static struct stats_slot *
+slot_adopt(void)
+{
+	if (seg == NULL) { return NULL; }
+	for (unsigned i = 0; i < countof(slot_state); i++) {
+		unsigned char st = atomic_load_explicit(&slot_state[i], memory_order_relaxed);
+		if (st != SLOT_OWNED && atomic_compare_exchange_strong(&slot_state[i],
+					&st, SLOT_OWNED)) {
+			pthread_setspecific(slot_key, &slot_state[i]);
+			return &slots[i];
+		}
+	}
+	return overflow;
+}
+
+static bool
+stats_map(int mode, bool latency)
+{
+	/* Histograms take up most of the segment, but their pages are only
+	 * ever touched by the threads that record into them. */
+	size_t hist = (sizeof(struct stats_hdr) + STATS_SLOTS * sizeof(struct stats_slot) +
+			STATS_CONSUMERS * sizeof(struct stats_consumer) + 63) & ~(size_t)63;
+	size_t len = hist + (latency ? STATS_SLOTS * stats_hist_size() : 0);
+	int fd = memfd_create(STATS_NAME, MFD_CLOEXEC);
+	if (fd < 0) {
+		DEBUG("stats failed: %s", strerror(errno));
+		return false;
+	}
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, len) == 0) {
+		map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		DEBUG("stats failed: %s", strerror(errno));
+		xclose(fd);
+		return false;
+	}
+
+	/* The fd stays open for the life of the process, as it is how a reader
+	 * finds the segment. */
+	struct stats_hdr *h = map;
+	h->magic = STATS_MAGIC;
+	h->version = STATS_VERSION;
+	h->pid = (uint32_t)getpid();
+	h->mode = (uint32_t)mode;
+	h->start = stats_now();
+	h->counters = STATS_COUNT;
+	h->slots = STATS_SLOTS;
+	h->slot_off = sizeof(*h);
+	h->consumers = STATS_CONSUMERS;
+	h->consumer_off = h->slot_off + STATS_SLOTS * sizeof(struct stats_slot);
+	if (latency) {
+		h->hist_kinds = STATS_HOOKS;
+		h->hist_buckets = STATS_BUCKETS;
+		h->hist_off = hist;
+		h->hist_size = stats_hist_size();
+		hists = (_Atomic uint64_t *)((char *)map + hist);
+		clock0 = stats_clock();
+		mono0 = stats_mono();
+	}
+
+	slots = (struct stats_slot *)((char *)map + h->slot_off);
+	overflow = &slots[STATS_SLOTS - 1];
+	consumers = (struct stats_consumer *)((char *)map + h->consumer_off);
+	for (int i = 0; i < STATS_CONSUMERS; i++) {
+		atomic_store_explicit(&consumers[i].fd, -1, memory_order_relaxed);
+	}
+	seg_fd = fd;
+	seg_len = len;
+	atomic_store_explicit(&seg, h, memory_order_release);
+	DEBUG("stats: %d", fd);
+	return true;
+}
+
+bool
+stats_init(int mode, bool latency)
+{
+	if (pthread_key_create(&slot_key, slot_exit) != 0) {
+		DEBUG("stats failed: %s", strerror(errno));
+		return false;
+	}
+	if (!stats_map(mode, latency)) {
+		return false;
+	}
+	stats_latency = latency;
+	if (latency) {
+		atexit(stats_exit);
+	}
+	return true;
+}
+
+void
+stats_fork(void)
+{
+	/* The segment is shared with the parent, so a child counts into one of
+	 * its own. The parent's copy is closed so that readers looking for the
+	 * child's pid only find the child's segment, and nothing is counted
+	 * until the child has its own. */
+	struct stats_hdr *h = seg;
+	if (h == NULL) { return; }
+	stale = h;
+	stale_len = seg_len;
+	stale_mode = (int)h->mode;
+	stale_latency = hists != NULL;
+
+	atomic_store_explicit(&seg, NULL, memory_order_relaxed);
+	xclose(seg_fd);
+	seg_fd = -1;
+	slots = overflow = NULL;
+	consumers = NULL;
+	hists = NULL;
+	for (unsigned i = 0; i < countof(slot_state); i++) {
+		atomic_store_explicit(&slot_state[i], SLOT_FREE, memory_order_relaxed);
+	}
+	local = NULL;
+}
+
+void
+stats_restart(void)
+{
+	if (stale == NULL) { return; }
+	munmap(stale, stale_len);
+	stale = NULL;
+	pthread_setspecific(slot_key, NULL);
+	if (!stats_map(stale_mode, stale_latency)) {
+		stats_latency = false;
+	}
+}
+
+static inline struct stats_slot *
+slot_local(void)
+{
+	if (unlikely(local == NULL)) {
+		local = slot_adopt();
+	}
+	return local;
+}
+
+static inline void
+slot_bump(struct stats_slot *s, _Atomic uint64_t *v, uint64_t n)
+{
+	if (likely(s != overflow)) {
+		atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+				memory_order_relaxed);
+	}
+	else {
+		atomic_fetch_add_explicit(v, n, memory_order_relaxed);
+	}
+}
+
+void
+stats_add(int idx, uint64_t n)
+{
+	struct stats_slot *s = slot_local();
+	if (s) {
+		slot_bump(s, &s->val[idx], n);
+	}
+}
+
+void
+stats_time(int kind, bool traced, uint64_t ticks)
+{
+	struct stats_slot *s = slot_local();
+	if (s == NULL || hists == NULL) { return; }
+	size_t off = (((size_t)(s - slots) * STATS_HOOKS + kind) * 2 + traced) * STATS_BUCKETS;
+	slot_bump(s, &hists[off + stats_bucket(ticks)], 1);
+}
+
+static void
+stats_calibrate(void)
+{
+	/* The clock's rate is taken over the whole run so far, which only gets
+	 * more precise with time. */
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t ns = stats_mono() - mono0, ticks = stats_clock() - clock0;
+	if (ns >= 1000000) {
+		atomic_store_explicit(&seg->ticks_per_ms,
+				(uint64_t)((double)ticks * 1e6 / (double)ns), memory_order_relaxed);
+	}
+#else
+	atomic_store_explicit(&seg->ticks_per_ms, 1000000, memory_order_relaxed);
+#endif
+}
+
+int
+stats_consumer_add(int fd)
+{
+	if (seg == NULL) { return -1; }
+	for (int i = 0; i < STATS_CONSUMERS; i++) {
+		int32_t expect = -1;
+		if (atomic_compare_exchange_strong(&consumers[i].fd, &expect, -2)) {
+			atomic_store_explicit(&consumers[i].pairs, 0, memory_order_relaxed);
+			atomic_store_explicit(&consumers[i].lag, 0, memory_order_relaxed);
+			atomic_store_explicit(&consumers[i].fd, fd, memory_order_release);
+			return i;
+		}
+	}
+	return -1;
+}
+
+void
+stats_consumer_del(int slot)
+{
+	if (slot >= 0) {
+		atomic_store_explicit(&consumers[slot].fd, -1, memory_order_release);
+	}
+}
+
+struct stats_consumer *
+stats_consumer(int slot)
+{
+	return slot >= 0 && slot < STATS_CONSUMERS ? &consumers[slot] : NULL;
+}
+
+void
+stats_gauge(uint64_t pool, uint64_t live)
+{
+	if (seg == NULL) { return; }
+	atomic_store_explicit(&seg->pool, pool, memory_order_relaxed);
+	atomic_store_explicit(&seg->live, live, memory_order_relaxed);
+	atomic_store_explicit(&seg->sampled, stats_now(), memory_order_relaxed);
+	if (hists) {
+		stats_calibrate();
+	}
+}
+
+static int
+stats_find(pid_t pid)
+{
+	char path[320], link[256];
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	DIR *d = opendir(path);
+	if (d == NULL) { return -1; }
+
+	int fd = -1;
+	struct dirent *ent;
+	while (fd < 0 && (ent = readdir(d))) {
+		if (ent->d_name[0] == '.') { continue; }
+		snprintf(path, sizeof(path), "/proc/%d/fd/%s", (int)pid, ent->d_name);
+		ssize_t n = readlink(path, link, sizeof(link) - 1);
+		if (n < 0) { continue; }
+		link[n] = '\0';
+		if (strncmp(link, "/memfd:" STATS_NAME " ", sizeof("/memfd:" STATS_NAME)) == 0) {
+			fd = open(path, O_RDONLY|O_CLOEXEC);
+		}
+	}
+	closedir(d);
+	if (fd < 0) { errno = ENOENT; }
+	return fd;
+}
+
+const struct stats_hdr *
+stats_open(pid_t pid)
+{
+	int fd = stats_find(pid);
+	if (fd < 0) { return NULL; }
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct stats_hdr)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	int e = errno;
+	xclose(fd);
+	if (map == MAP_FAILED) {
+		errno = e;
+		return NULL;
+	}
+
+	const struct stats_hdr *h = map;
+	if (h->magic != STATS_MAGIC || h->version != STATS_VERSION ||
+			h->consumer_off + h->consumers * sizeof(struct stats_consumer) >
+			(size_t)st.st_size ||
+			h->hist_off + h->slots * h->hist_size > (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+	return h;
+}
+
+uint64_t
+stats_sum(const struct stats_hdr *h, int idx)
+{
+	if (idx < 0 || (unsigned)idx >= h->counters) { return 0; }
+	const struct stats_slot *s = (const void *)((const char *)h + h->slot_off);
+	uint64_t sum = 0;
+	for (unsigned i = 0; i < h->slots; i++) {
+		sum += atomic_load_explicit(&s[i].val[idx], memory_order_relaxed);
+	}
+	return sum;
+}
+
+static uint64_t
+stats_bucket_max(unsigned b)
+{
+	if (b < STATS_SUB) { return b; }
+	unsigned e = b / STATS_SUB + STATS_SUB_BITS - 1;
+	return ((uint64_t)(STATS_SUB + b % STATS_SUB + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+struct latency {
+	uint64_t count;
+	uint64_t q[countof(quantiles)];  /* Upper bound of each quantile's bucket. */
+	uint64_t max;
+};
+
+static void
+stats_latency_of(const struct stats_hdr *h, int kind, int traced, struct latency *l)
+{
+	/* Each bucket is summed across the thread slots before walking up to
+	 * the quantiles. */
+	uint64_t b[STATS_BUCKETS];
+	memset(l, 0, sizeof(*l));
+	for (unsigned j = 0; j < STATS_BUCKETS; j++) {
+		b[j] = 0;
+		for (unsigned i = 0; i < h->slots; i++) {
+			const _Atomic uint64_t *hist = (const void *)((const char *)h +
+					h->hist_off + i * h->hist_size);
+			b[j] += atomic_load_explicit(
+					&hist[((size_t)kind * 2 + traced) * STATS_BUCKETS + j],
+					memory_order_relaxed);
+		}
+		l->count += b[j];
+	}
+
+	uint64_t sum = 0;
+	size_t q = 0;
+	for (unsigned j = 0; j < STATS_BUCKETS && l->count > 0; j++) {
+		if (b[j] == 0) { continue; }
+		sum += b[j];
+		for (; q < countof(quantiles) && sum >= quantiles[q] * l->count; q++) {
+			l->q[q] = stats_bucket_max(j);
+		}
+		l->max = stats_bucket_max(j);
+	}
+}
+
+static void
+stats_print_latency(const struct stats_hdr *h, FILE *out, bool prometheus)
+{
+	if (h->hist_kinds != STATS_HOOKS || h->hist_buckets != STATS_BUCKETS) { return; }
+	double ns = 1e6 / (double)(atomic_load_explicit(&h->ticks_per_ms,
+				memory_order_relaxed) ?: 1000000);
+
+	if (prometheus) {
+		fprintf(out, "# TYPE teexec_hook_seconds summary\n");
+	}
+	else {
+		fprintf(out, "\n%-10s %-9s %12s %10s %10s %10s %10s\n",
+				"hook", "fd", "count", "p50", "p99", "p999", "max");
+	}
+	for (int k = 0; k < STATS_HOOKS; k++) {
+		for (int t = 0; t < 2; t++) {
+			struct latency l;
+			stats_latency_of(h, k, t, &l);
+			if (l.count == 0) { continue; }
+			if (prometheus) {
+				for (size_t q = 0; q < countof(quantiles); q++) {
+					fprintf(out, "teexec_hook_seconds{pid=\"%u\",hook=\"%s\",traced=\"%d\","
+							"quantile=\"%g\"} %.9f\n", h->pid, stats_hooks[k], t,
+							quantiles[q], (double)l.q[q] * ns / 1e9);
+				}
+				fprintf(out, "teexec_hook_seconds_count{pid=\"%u\",hook=\"%s\",traced=\"%d\"} %"
+						PRIu64 "\n", h->pid, stats_hooks[k], t, l.count);
+				continue;
+			}
+			fprintf(out, "%-10s %-9s %12" PRIu64 " %8.0fns %8.0fns %8.0fns %8.0fns\n",
+					stats_hooks[k], t ? "traced" : "untraced", l.count,
+					(double)l.q[0] * ns, (double)l.q[1] * ns, (double)l.q[2] * ns,
+					(double)l.max * ns);
+		}
+	}
+}
+
+static void
+stats_exit(void)
+{
+	if (seg == NULL) { return; }
+	stats_calibrate();
+	flockfile(stderr);
+	fprintf(stderr, "teexec: hook latency for pid %u", seg->pid);
+	stats_print_latency(seg, stderr, false);
+	funlockfile(stderr);
+}
+
+void
+stats_print(const struct stats_hdr *h, FILE *out, bool prometheus)
+{
+	const struct stats_consumer *c = (const void *)((const char *)h + h->consumer_off);
+	uint64_t pool = atomic_load_explicit(&h->pool, memory_order_relaxed);
+	uint64_t live = atomic_load_explicit(&h->live, memory_order_relaxed);
+
+	if (prometheus) {
+		for (int i = 0; i < STATS_COUNT; i++) {
+			fprintf(out, "# TYPE teexec_%s_total counter\n"
+					"teexec_%s_total{pid=\"%u\"} %" PRIu64 "\n",
+					stats_names[i], stats_names[i], h->pid, stats_sum(h, i));
+		}
+		fprintf(out, "# TYPE teexec_pool gauge\nteexec_pool{pid=\"%u\"} %" PRIu64 "\n",
+				h->pid, pool);
+		fprintf(out, "# TYPE teexec_live gauge\nteexec_live{pid=\"%u\"} %" PRIu64 "\n",
+				h->pid, live);
+		fprintf(out, "# TYPE teexec_consumer_pairs gauge\n");
+		for (unsigned i = 0; i < h->consumers; i++) {
+			int32_t fd = atomic_load_explicit(&c[i].fd, memory_order_acquire);
+			if (fd < 0) { continue; }
+			fprintf(out, "teexec_consumer_pairs{pid=\"%u\",fd=\"%d\"} %u\n", h->pid, fd,
+					atomic_load_explicit(&c[i].pairs, memory_order_relaxed));
+		}
+		fprintf(out, "# TYPE teexec_consumer_lag_bytes gauge\n");
+		for (unsigned i = 0; i < h->consumers; i++) {
+			int32_t fd = atomic_load_explicit(&c[i].fd, memory_order_acquire);
+			if (fd < 0) { continue; }
+			fprintf(out, "teexec_consumer_lag_bytes{pid=\"%u\",fd=\"%d\"} %" PRIu64 "\n",
+					h->pid, fd, atomic_load_explicit(&c[i].lag, memory_order_relaxed));
+		}
+		stats_print_latency(h, out, true);
+		return;
+	}
+
+	uint64_t now = stats_now();
+	fprintf(out, "pid %u  mode 0x%x  up %.1fs\n", h->pid, h->mode,
+			now > h->start ? (double)(now - h->start) / 1e9 : 0.0);
+	for (int i = 0; i < STATS_COUNT; i++) {
+		fprintf(out, "%-16s%" PRIu64 "\n", stats_names[i], stats_sum(h, i));
+	}
+	fprintf(out, "%-16s%" PRIu64 "\n%-16s%" PRIu64 "\n", "pool", pool, "live", live);
+	fprintf(out, "\n%8s %8s %12s\n", "consumer", "pairs", "lag");
+	for (unsigned i = 0; i < h->consumers; i++) {
+		int32_t fd = atomic_load_explicit(&c[i].fd, memory_order_acquire);
+		if (fd < 0) { continue; }
+		fprintf(out, "%8d %8u %12" PRIu64 "\n", fd,
+				atomic_load_explicit(&c[i].pairs, memory_order_relaxed),
+				atomic_load_explicit(&c[i].lag, memory_order_relaxed));
+	}
+	stats_print_latency(h, out, false);
+}
+
+#endif
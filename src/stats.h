@@ -0,0 +1,199 @@
+#ifndef TEEXEC_STATS_H
+#define TEEXEC_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#if HAS_MEMFD_CREATE
+# define HAS_STATS 1
+#else
+# define HAS_STATS 0
+#endif
+
+/* A traced process keeps its counters in a memfd named STATS_NAME, which
+ * `teexec stat <pid>` finds through /proc/<pid>/fd and maps read-only.
+ *
+ * The segment begins with struct stats_hdr, followed by `slots` thread slots
+ * of struct stats_slot at `slot_off`, then `consumers` consumer slots of
+ * struct stats_consumer at `consumer_off`. Each application thread adopts a
+ * thread slot of its own and bumps its counters with plain loads and stores,
+ * so tracing a read adds no contended atomics. A reader sums the counters
+ * across the slots. Threads that find every other slot taken share the last
+ * one, which is only ever updated with atomic adds.
+ *
+ * Consumer slots and the gauges in the header are written by the helper
+ * thread every SPARE_TICK_MS.
+ *
+ * A forked child drops its copy of the parent's segment with stats_fork, and
+ * once it starts tracing, stats_restart has it count from zero in a segment
+ * of its own.
+ *
+ * With --latency, each thread slot also owns a set of histograms at
+ * `hist_off` + slot * `hist_size`: one per hook kind, each split into
+ * untraced and traced fds, of `hist_buckets` counts each. They time the
+ * part of a data hook after the libc call returns, which is all the work
+ * teexec adds, in clock ticks. A tick is converted to time with
+ * `ticks_per_ms`. Buckets are log-linear: values below STATS_SUB count
+ * exactly, and each power of two above that is split into STATS_SUB equal
+ * buckets, so a bucket is never wider than 1/STATS_SUB of its value. */
+
+#define STATS_NAME "teexec-stats"
+#define STATS_MAGIC 0x74656573u   /* "tees" */
+#define STATS_VERSION 1
+#define STATS_SLOTS 64
+#define STATS_CONSUMERS 256
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1u << STATS_SUB_BITS)
+#define STATS_BUCKETS ((32 - STATS_SUB_BITS + 1) * STATS_SUB)
+
+enum {
+	STATS_PAIRED,         /* Connections paired with a consumer. */
+	STATS_UNPAIRED,       /* Pairings ended, for whatever reason. */
+	STATS_SLOW,           /* Pairings ended by a slow or failed consumer. */
+	STATS_NO_PAIR,        /* Connections that found no consumer. */
+	STATS_FRAMES,         /* Data frames traced. */
+	STATS_BYTES,          /* Data bytes traced. */
+	STATS_SKIPPED,        /* Data frames skipped under the drop policy. */
+	STATS_SKIPPED_BYTES,
+	STATS_PACKED,         /* Coalesced bytes sent as compressed blocks. */
+	STATS_PACKED_BYTES,   /* Bytes those blocks took, headers included. */
+	STATS_RECORDED,       /* Data frames written to --record segments. */
+	STATS_RECORDED_BYTES,
+	STATS_COUNT,
+	STATS_MAX = 16        /* Counters a slot has room for. */
+};
+
+/* Hook kinds timed under --latency. Variants of a call share its kind. */
+enum {
+	STATS_HOOK_READ,
+	STATS_HOOK_READV,
+	STATS_HOOK_RECV,
+	STATS_HOOK_RECVMSG,
+	STATS_HOOK_RECVMMSG,
+	STATS_HOOK_WRITE,
+	STATS_HOOK_WRITEV,
+	STATS_HOOK_SEND,
+	STATS_HOOK_SENDMSG,
+	STATS_HOOK_SENDMMSG,
+	STATS_HOOK_SENDFILE,
+	STATS_HOOKS
+};
+
+struct stats_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t mode;               /* TRACE_* flags in effect. */
+	uint64_t start;              /* CLOCK_REALTIME ns when tracing began. */
+	uint32_t counters;           /* Counters in use per thread slot. */
+	uint32_t slots;
+	uint64_t slot_off;
+	uint32_t consumers;
+	uint32_t reserved;
+	uint64_t consumer_off;
+	uint32_t hist_kinds;         /* Hook kinds, or 0 without --latency. */
+	uint32_t hist_buckets;
+	uint64_t hist_off;
+	uint64_t hist_size;          /* Bytes of histograms per thread slot. */
+	_Alignas(64) _Atomic uint64_t pool;     /* Consumers ready for a pairing. */
+	_Atomic uint64_t live;                  /* Connections paired right now. */
+	_Atomic uint64_t sampled;               /* CLOCK_REALTIME ns of the last tick. */
+	_Atomic uint64_t ticks_per_ms;          /* Latency clock rate. */
+};
+
+struct stats_slot {
+	_Alignas(64) _Atomic uint64_t val[STATS_MAX];
+};
+
+struct stats_consumer {
+	_Atomic int32_t fd;          /* Consumer fd, or -1 for a free slot. */
+	_Atomic uint32_t pairs;      /* Connections paired with it. */
+	_Atomic uint64_t lag;        /* Bytes written that it hasn't read. */
+};
+
+extern const char *const stats_names[STATS_COUNT];
+extern const char *const stats_hooks[STATS_HOOKS];
+
+/* Set when hooks are being timed. */
+extern bool stats_latency;
+
+static inline uint64_t
+stats_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline unsigned
+stats_bucket(uint64_t v)
+{
+	if (v < STATS_SUB) { return (unsigned)v; }
+	unsigned e = 63 - __builtin_clzll(v);
+	if (e > 31) { return STATS_BUCKETS - 1; }
+	return (e - STATS_SUB_BITS + 1) * STATS_SUB +
+		(unsigned)((v >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+#if HAS_STATS
+
+bool
+stats_init(int mode, bool latency);
+
+void
+stats_fork(void);
+
+void
+stats_restart(void);
+
+void
+stats_add(int idx, uint64_t n);
+
+int
+stats_consumer_add(int fd);
+
+void
+stats_consumer_del(int slot);
+
+struct stats_consumer *
+stats_consumer(int slot);
+
+void
+stats_gauge(uint64_t pool, uint64_t live);
+
+void
+stats_time(int kind, bool traced, uint64_t ticks);
+
+const struct stats_hdr *
+stats_open(pid_t pid);
+
+uint64_t
+stats_sum(const struct stats_hdr *h, int idx);
+
+void
+stats_print(const struct stats_hdr *h, FILE *out, bool prometheus);
+
+#else
+
+static inline bool stats_init(int mode, bool latency) { (void)mode; (void)latency; return false; }
+static inline void stats_fork(void) { }
+static inline void stats_restart(void) { }
+static inline void stats_add(int idx, uint64_t n) { (void)idx; (void)n; }
+static inline int stats_consumer_add(int fd) { (void)fd; return -1; }
+static inline void stats_consumer_del(int slot) { (void)slot; }
+static inline struct stats_consumer *stats_consumer(int slot) { (void)slot; return NULL; }
+static inline void stats_gauge(uint64_t pool, uint64_t live) { (void)pool; (void)live; }
+static inline void stats_time(int kind, bool traced, uint64_t ticks) { (void)kind; (void)traced; (void)ticks; }
+
+#endif
+
+#endif
@@ -0,0 +1,41 @@
+#include "table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void
+table_init(struct table *t, size_t esize, int max)
+{
+	t->esize = esize;
+	/* A zeroed table has no valid descriptors, so lookups on a table that
+	 * was never initialized safely find nothing. */
+	t->limit = max < 0 ? 0 : (unsigned)max + 1;
+	t->npages = t->limit ? ((t->limit - 1) >> TABLE_PAGE_SHIFT) + 1 : 1;
+	t->pages = calloc(t->npages, sizeof(*t->pages));
+	if (t->pages == NULL) { xoom(); }
+}
+
+void *
+table_make(struct table *t, int fd)
+{
+	if (fd < 0 || (unsigned)fd >= t->limit) { return NULL; }
+
+	void *e = table_get(t, fd);
+	if (e != NULL) { return e; }
+
+	/* Allocate the page and try to publish it. If another thread won the
+	 * race, discard ours and use theirs. */
+	char *page, *expect = NULL;
+	if (posix_memalign((void **)&page, CACHE_LINE, t->esize * TABLE_PAGE_SIZE)) {
+		xoom();
+	}
+	memset(page, 0, t->esize * TABLE_PAGE_SIZE);
+
+	_Atomic(char *) *slot = &t->pages[(unsigned)fd >> TABLE_PAGE_SHIFT];
+	if (!atomic_compare_exchange_strong_explicit(slot, &expect, page,
+				memory_order_acq_rel, memory_order_acquire)) {
+		free(page);
+		page = expect;
+	}
+	return page + ((unsigned)fd & TABLE_PAGE_MASK) * t->esize;
+}
@@ -0,0 +1,49 @@
+#ifndef TEEXEC_TABLE_H
+#define TEEXEC_TABLE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "util.h"
+
+/* A table maps file descriptors to fixed-size entries. The storage is split
+ * into pages that are allocated on first use and are never moved or freed,
+ * so an entry pointer stays valid for the life of the process. Lookups are a
+ * pair of loads and need no locks, and no lookup ever observes a realloc.
+ *
+ * Pages are aligned to the cache line size. Entries are kept compact rather
+ * than padded: they are written only when a descriptor is paired or unpaired
+ * and are otherwise read-only, so neighbouring descriptors being read on
+ * different threads share lines without bouncing them. */
+
+#define CACHE_LINE 64
+
+#define TABLE_PAGE_SHIFT 10
+#define TABLE_PAGE_SIZE (1u << TABLE_PAGE_SHIFT)
+#define TABLE_PAGE_MASK (TABLE_PAGE_SIZE - 1)
+
+struct table {
+	size_t esize;            /* Size of each entry. */
+	unsigned limit;          /* Largest valid file descriptor plus one. */
+	unsigned npages;         /* Number of slots in the page directory. */
+	_Atomic(char *) *pages;  /* Page directory sized from limit. */
+};
+
+void
+table_init(struct table *t, size_t esize, int max);
+
+void *
+table_make(struct table *t, int fd);
+
+static inline void *
+table_get(const struct table *t, int fd)
+{
+	if (unlikely(fd < 0 || (unsigned)fd >= t->limit)) { return NULL; }
+	char *page = atomic_load_explicit(&t->pages[(unsigned)fd >> TABLE_PAGE_SHIFT],
+			memory_order_acquire);
+	if (page == NULL) { return NULL; }
+	return page + ((unsigned)fd & TABLE_PAGE_MASK) * t->esize;
+}
+
+#endif
@@ -2,209 +2,1897 @@
 #include "debug.h"
 #include "bypass.h"
 #include "util.h"
+#include "table.h"
+#include "sender.h"
+#include "spare.h"
+#include "burst.h"
+#include "uring.h"
+#include "shmring.h"
+#include "mux.h"
+#include "filter.h"
+#include "stats.h"
+#include "lz4.h"
+#include "record.h"
 
 #include <stdlib.h>
 #include <unistd.h>
-#include <poll.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#if HAS_SIOCOUTQ
+# include <sys/ioctl.h>
+# include <linux/sockios.h>
+#endif
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+#define MULTIBUF 64
+
+/* Entries a frame may take in a single write, including its header. Two are
+ * left over for a gap marker written ahead of it. */
+#define FRAME_IOV (IOV_MAX - 2)
+#define PACK_MAX (1 << 22)
+#define PACK_SKIP 16
+
+/* Stop frame flag requesting the multiplexed close marker. */
+#define TRACE_STOP_MARK 1
+
+/* Outcome of writing a frame to a trace socket. */
+enum {
+	WRITE_SENT,
+	WRITE_DROPPED,  /* Skipped whole under the drop policy. */
+	WRITE_FAILED
+};
+
+/* Data frames skipped from a connection since it last had a frame sent. */
+struct loss {
+	uint64_t id;        /* Connection the frames belonged to. */
+	uint64_t seq;       /* First frame skipped. */
+	uint32_t frames;
+	uint64_t off[2];    /* Stream offset of the first byte skipped each way. */
+	uint64_t bytes[2];  /* Bytes skipped each way. */
+};
+
+/* A gap is written by whichever thread skips a frame, and taken by the one
+ * sending the connection's next frame, so it has its own lock. The frame
+ * count is checked without it. */
+struct gap {
+	atomic_flag lock;
+	_Atomic uint32_t frames;
+	struct loss loss;
+};
+
+atomic_uint trace_live = 0;
+
+static int trace_mode = 0;
+static int trace_fd = -1;
+static bool trace_on = false;
+static bool trace_record = false;
+static bool trace_gaps = false;
+static int max_fd = 0;
+static size_t burst_max = 0;
+static unsigned burst_age = 0;
+static size_t coalesce_max = 0;
+static unsigned coalesce_frames = 0;
+static unsigned coalesce_delay = 0;
+static size_t pack_size = 0;
+static char *pack_out = NULL;
+static unsigned sample_rate = TRACE_SAMPLE_ALL;
+static bool sample_peer = false;
+static _Atomic uint64_t sample_count = 0;
+static size_t shm_size = 0;
+static bool shm_huge = false;
+
+/* Each client fd maps to an entry holding its paired trace fd. The pairing is
+ * published with a release store of fd after id is written, and cleared with
+ * a compare-and-swap so that exactly one thread releases the trace fd. */
+struct entry {
+	atomic_int fd;       /* Paired trace fd plus one, or 0 when unpaired. */
+	_Atomic uint64_t id; /* Multiplexing id of the current pairing. */
+	_Atomic uint64_t seq; /* Next multiplexing frame number. */
+	_Atomic uint64_t rx;  /* Bytes traced each way, for events and gaps. */
+	_Atomic uint64_t tx;
+	_Atomic uint64_t born; /* Accept time until the open event is sent. */
+	uint32_t tid;          /* Thread that accepted the connection. */
+	atomic_bool adopt;     /* Paired before a fork, waiting to pair again. */
+	struct gap gap;        /* Frames skipped under the drop policy. */
+};
+
+/* A frame left for whichever thread holds a channel's lock. */
+struct defer {
+	struct defer *next;
+	uint8_t type;
+	size_t len;
+	char data[];
+};
+
+/* Each trace fd maps to a channel. In multiplex mode a channel is shared by
+ * many client fds, so the trace fd is only released when the last pair is
+ * removed. */
+struct chan {
+	atomic_uint refs;    /* Number of client fds paired with the trace fd. */
+	atomic_bool dead;    /* Set once a write fails; closes on last unpair. */
+	atomic_uint gen;     /* Changes whenever the fd number is reassigned. */
+	atomic_flag lock;    /* Serializes writes while bursting is enabled. */
+	_Atomic(struct defer *) defer; /* Frames left for the lock holder. */
+	bool pending;        /* Listed for flushing by the sender thread. */
+	unsigned batch;      /* Index plus one of the sender's open batch. */
+	unsigned frames;     /* Frames coalesced since the last flush. */
+	uint64_t due;        /* Time in us when coalesced frames must be sent. */
+	char *pack;          /* Coalesced frames waiting to be compressed. */
+	size_t packed;       /* Bytes waiting in pack. */
+	unsigned pack_skip;  /* Batches left to send as they are. */
+	struct burst burst;  /* Unsent tail of the stream. */
+	struct shmring *shm; /* Shared-memory ring replacing the socket, or NULL. */
+	int slot;            /* Stats consumer slot, or -1. */
+};
+
+static struct table entries;
+static struct table chans;
+static _Atomic uint64_t table_id = 0;
+static atomic_uint chan_gen = 0;
+
+/* Set in a forked child until its first traced connection restarts what the
+ * fork left behind. */
+static atomic_bool trace_forked = false;
+static atomic_flag fork_lock = ATOMIC_FLAG_INIT;
+
+/* Trace fds with a non-empty burst buffer, flushed by the sender thread. */
+static atomic_flag pending_lock = ATOMIC_FLAG_INIT;
+static int *pending = NULL;
+static size_t pending_len = 0, pending_cap = 0;
+
+static void
+fd_undefer(int tracefd, struct chan *c, bool send);
+
+static void
+fd_close(int tracefd)
+{
+	struct chan *c = table_get(&chans, tracefd);
+	bool async = trace_mode & TRACE_ASYNC;
+	if (!async) { spin_lock(&c->lock); }
+	burst_clear(&c->burst);
+	c->packed = 0;
+	fd_undefer(tracefd, c, false);
+	if (!async) { spin_unlock(&c->lock); }
+#if HAS_SHMRING
+	shmring_put(c->shm);
+	c->shm = NULL;
+#endif
+	stats_consumer_del(c->slot);
+	c->slot = -1;
+	atomic_fetch_add(&c->gen, 1);
+	xclose(tracefd);
+}
+
+static inline int
+fd_get_pair(const struct entry *e)
+{
+	return e ? atomic_load_explicit(&e->fd, memory_order_acquire) - 1 : -1;
+}
+
+static inline uint64_t
+fd_get_id(const struct entry *e)
+{
+	return atomic_load_explicit(&e->id, memory_order_relaxed);
+}
+
+static inline uint64_t
+fd_seq(struct entry *e)
+{
+	/* Only the binary multiplexing header carries a sequence number. */
+	if ((trace_mode & (TRACE_MULTIPLEX|TRACE_TEXT)) != TRACE_MULTIPLEX) {
+		return 0;
+	}
+	return atomic_fetch_add_explicit(&e->seq, 1, memory_order_relaxed);
+}
+
+static void
+fd_lose(struct entry *e, const struct loss *l)
+{
+	struct gap *g = &e->gap;
+	struct loss *m = &g->loss;
+	spin_lock(&g->lock);
+	uint32_t frames = atomic_load_explicit(&g->frames, memory_order_relaxed);
+	/* A gap left by an earlier connection on the fd is replaced, but an
+	 * earlier connection's frames never replace a later one's gap. */
+	if (frames > 0 && m->id != l->id) {
+		if (m->id > l->id) {
+			spin_unlock(&g->lock);
+			return;
+		}
+		frames = 0;
+	}
+	if (frames == 0) {
+		*m = *l;
+	}
+	else {
+		if (l->seq < m->seq) { m->seq = l->seq; }
+		for (int i = 0; i < 2; i++) {
+			if (l->bytes[i] > 0 && (m->bytes[i] == 0 || l->off[i] < m->off[i])) {
+				m->off[i] = l->off[i];
+			}
+			m->bytes[i] += l->bytes[i];
+		}
+		m->frames += l->frames;
+	}
+	atomic_store_explicit(&g->frames, m->frames, memory_order_relaxed);
+	spin_unlock(&g->lock);
+}
+
+static void
+fd_skip(struct entry *e, uint64_t id, uint64_t seq, uint8_t flags, uint64_t off, size_t len)
+{
+	int dir = flags & MUX_FLAG_TX ? 1 : 0;
+	struct loss l = { .id = id, .seq = seq, .frames = 1 };
+	l.off[dir] = off;
+	l.bytes[dir] = len;
+	DEBUG_MORE("pair skip: %" PRIu64 ", %zu", id, len);
+	stats_add(STATS_SKIPPED, 1);
+	stats_add(STATS_SKIPPED_BYTES, len);
+	fd_lose(e, &l);
+}
+
+static inline bool
+fd_gapped(struct entry *e)
+{
+	return trace_gaps &&
+		atomic_load_explicit(&e->gap.frames, memory_order_relaxed) > 0;
+}
+
+/* Takes the connection's gap to send ahead of frame seq. A frame queued before
+ * the gap opened leaves it in place, and a gap of an earlier connection on
+ * the fd is cleared. */
+static bool
+fd_gap(struct entry *e, uint64_t id, uint64_t seq, struct loss *l)
+{
+	if (likely(!fd_gapped(e))) { return false; }
+
+	struct gap *g = &e->gap;
+	bool found = false;
+	spin_lock(&g->lock);
+	if (atomic_load_explicit(&g->frames, memory_order_relaxed) > 0 &&
+			(g->loss.id < id || (g->loss.id == id && g->loss.seq < seq))) {
+		found = g->loss.id == id;
+		if (found) { *l = g->loss; }
+		atomic_store_explicit(&g->frames, 0, memory_order_relaxed);
+	}
+	spin_unlock(&g->lock);
+	return found;
+}
+
+static size_t
+fd_gap_event(const struct loss *l, struct mux_gap *m)
+{
+	m->rx_off = mux_le64(l->off[0]);
+	m->rx = mux_le64(l->bytes[0]);
+	m->tx_off = mux_le64(l->off[1]);
+	m->tx = mux_le64(l->bytes[1]);
+	m->frames = mux_le32(l->frames);
+	m->reserved = 0;
+	return sizeof(*m);
+}
+
+static struct chan *
+fd_fresh(int tracefd)
+{
+	struct chan *c = table_make(&chans, tracefd);
+	if (c == NULL) { return NULL; }
+	atomic_store(&c->refs, 0);
+	atomic_store(&c->dead, false);
+	atomic_store(&c->gen, atomic_fetch_add(&chan_gen, 1) + 1);
+	c->slot = -1;
+	return c;
+}
+
+static bool
+fd_shm(int tracefd)
+{
+#if HAS_SHMRING
+	/* The ring is sent ahead of any pairing, so the channel is published
+	 * with it already set. */
+	struct chan *c = table_get(&chans, tracefd);
+	c->shm = shmring_get(shm_size, shm_huge);
+	if (c->shm && shmring_hello(c->shm, tracefd)) {
+		DEBUG("pair shm: %d, %zu", tracefd, shm_size);
+		return true;
+	}
+	DEBUG("pair shm failed: %d, %s", tracefd, strerror(errno));
+#else
+	(void)tracefd;
+	errno = ENOTSUP;
+	DEBUG("pair shm failed: %d, %s", tracefd, strerror(errno));
+#endif
+	return false;
+}
+
+static void
+fd_paired(struct chan *c, int n)
+{
+	/* Pairings are counted per consumer for the stats helper's tick, and
+	 * the counter is only touched as a pairing starts or ends. */
+	struct stats_consumer *sc = stats_consumer(c->slot);
+	if (sc) {
+		atomic_fetch_add_explicit(&sc->pairs, (unsigned)n, memory_order_relaxed);
+	}
+	stats_add(n > 0 ? STATS_PAIRED : STATS_UNPAIRED, 1);
+}
+
+static bool
+fd_pair(int clientfd, int tracefd)
+{
+	struct entry *e = table_make(&entries, clientfd);
+	struct chan *c = table_make(&chans, tracefd);
+	if (e == NULL || c == NULL) { return false; }
+
+	atomic_fetch_add_explicit(&trace_live, 1, memory_order_relaxed);
+	fd_paired(c, 1);
+	atomic_store_explicit(&e->id, atomic_fetch_add(&table_id, 1) + 1,
+			memory_order_relaxed);
+	atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+	atomic_store_explicit(&e->rx, 0, memory_order_relaxed);
+	atomic_store_explicit(&e->tx, 0, memory_order_relaxed);
+	atomic_store_explicit(&e->gap.frames, 0, memory_order_relaxed);
+	atomic_store_explicit(&e->born, 0, memory_order_relaxed);
+	atomic_store_explicit(&e->adopt, false, memory_order_relaxed);
+	atomic_store_explicit(&e->fd, tracefd + 1, memory_order_release);
+	return true;
+}
+
+static void
+fd_kill(int tracefd)
+{
+	struct chan *c = table_get(&chans, tracefd);
+	if (!atomic_exchange(&c->dead, true)) {
+		/* Fail writes from any other pairs sharing the channel without
+		 * releasing the fd number while they may still be using it. */
+		shutdown(tracefd, SHUT_RDWR);
+	}
+}
+
+/* A channel holds a reference for each pairing, plus one while it is on the
+ * spare stack. A dedicated channel goes back on the stack once its pairing
+ * is released, while a shared channel stays there until it dies, so either
+ * way the last reference closes it. */
+static void
+fd_release(int tracefd)
+{
+	struct chan *c = table_get(&chans, tracefd);
+	if (atomic_fetch_sub(&c->refs, 1) == 1) {
+		if (!(trace_mode & TRACE_MULTIPLEX) && !atomic_load(&c->dead)) {
+			atomic_store(&c->refs, 1);
+			if (spare_put(tracefd)) { return; }
+			atomic_store(&c->refs, 0);
+		}
+		fd_close(tracefd);
+	}
+}
+
+static bool
+fd_ready(int tracefd, unsigned *gen)
+{
+	struct chan *c = fd_fresh(tracefd);
+	if (c == NULL) {
+		xclose(tracefd);
+		return false;
+	}
+	if ((trace_mode & TRACE_SHM) && !fd_shm(tracefd)) {
+		fd_close(tracefd);
+		return false;
+	}
+	atomic_store(&c->refs, 1);
+	c->slot = stats_consumer_add(tracefd);
+	*gen = atomic_load(&c->gen);
+	return true;
+}
+
+static bool
+fd_alive(int tracefd)
+{
+	struct chan *c = table_get(&chans, tracefd);
+	return c && !atomic_load_explicit(&c->dead, memory_order_relaxed);
+}
+
+static uint64_t
+fd_backlog(int tracefd)
+{
+	/* Bytes written to the consumer that it hasn't read yet. */
+	struct chan *c = table_get(&chans, tracefd);
+#if HAS_SHMRING
+	struct shmring *shm = c->shm;
+	if (shm) {
+		return shmring_backlog(shm);
+	}
+#else
+	(void)c;
+#endif
+#if HAS_SIOCOUTQ
+	int n;
+	if (ioctl(tracefd, SIOCOUTQ, &n) == 0 && n > 0) {
+		return (uint64_t)n;
+	}
+#endif
+	return 0;
+}
+
+static void
+fd_tick(void)
+{
+	/* Sample each consumer's backlog, and count those ready for a pairing:
+	 * every live shared consumer, or dedicated ones not paired right now. */
+	uint64_t pool = (trace_mode & TRACE_MULTIPLEX) ? spare_count() : 0;
+	for (int i = 0; i < STATS_CONSUMERS; i++) {
+		struct stats_consumer *sc = stats_consumer(i);
+		if (sc == NULL) { break; }
+		int fd = atomic_load_explicit(&sc->fd, memory_order_acquire);
+		if (fd < 0 || !fd_alive(fd)) { continue; }
+		atomic_store_explicit(&sc->lag, fd_backlog(fd), memory_order_relaxed);
+		if (!(trace_mode & TRACE_MULTIPLEX) &&
+				atomic_load_explicit(&sc->pairs, memory_order_relaxed) == 0) {
+			pool++;
+		}
+	}
+	stats_gauge(pool, atomic_load_explicit(&trace_live, memory_order_relaxed));
+}
+
+static void
+fd_hangup(int tracefd, unsigned gen)
+{
+	/* The fd may have been closed and reused since the hangup was seen. */
+	struct chan *c = table_get(&chans, tracefd);
+	if (c && atomic_load(&c->gen) == gen) {
+		DEBUG("pair closed: %d", tracefd);
+		fd_kill(tracefd);
+	}
+}
+
+static int
+fd_share(uint64_t key)
+{
+	/* The pick is only a hint until a reference is held, as the helper may
+	 * drop the consumer, and its fd be reused, at any point before then. */
+	for (int tries = 0; tries < 4; tries++) {
+		unsigned gen;
+		int tracefd = spare_pick(key, &gen);
+		if (tracefd < 0) { return -1; }
+
+		struct chan *c = table_get(&chans, tracefd);
+		unsigned refs = atomic_load(&c->refs);
+		do {
+			if (refs == 0) { break; }
+		} while (!atomic_compare_exchange_weak(&c->refs, &refs, refs + 1));
+		if (refs == 0) { continue; }
+
+		if (atomic_load(&c->gen) == gen &&
+				!atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+			return tracefd;
+		}
+		fd_release(tracefd);
+	}
+	return -1;
+}
+
+/* Takes a channel for a new pairing with a reference held for it. Dead
+ * channels found on the way are dropped from the stack. */
+static int
+fd_spare(uint64_t key)
+{
+	if (trace_mode & TRACE_MULTIPLEX) {
+		return fd_share(key);
+	}
+
+	int tracefd;
+	while ((tracefd = spare_get()) >= 0) {
+		struct chan *c = table_get(&chans, tracefd);
+		if (!atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+			break;
+		}
+		fd_release(tracefd);
+	}
+	return tracefd;
+}
+
+static void
+fd_unpair(int clientfd, struct entry *e, int tracefd, bool eof)
+{
+	if (eof) {
+		fd_kill(tracefd);
+	}
+
+	/* Only the thread that clears the entry releases the trace fd. */
+	int expect = tracefd + 1;
+	if (!atomic_compare_exchange_strong(&e->fd, &expect, 0)) {
+		return;
+	}
+	atomic_fetch_sub_explicit(&trace_live, 1, memory_order_relaxed);
+	fd_paired(table_get(&chans, tracefd), -1);
+	if (eof) {
+		stats_add(STATS_SLOW, 1);
+	}
+
+	/* The sender thread may still hold frames for the trace fd, so in async
+	 * mode the release is queued behind them. */
+	if (trace_mode & TRACE_ASYNC) {
+		sender_stop(clientfd, tracefd, fd_get_id(e), 0, 0, NULL, 0);
+	}
+	else {
+		fd_release(tracefd);
+	}
+}
+
+static void
+fd_pending_add(int tracefd)
+{
+	spin_lock(&pending_lock);
+	if (pending_len == pending_cap) {
+		pending_cap = pending_cap ? pending_cap * 2 : 64;
+		pending = xrealloc(pending, pending_cap * sizeof(*pending));
+	}
+	pending[pending_len++] = tracefd;
+	spin_unlock(&pending_lock);
+}
+
+static void
+fd_pending(int tracefd, struct chan *c)
+{
+	/* The flag is guarded by the channel lock, or by being on the sender
+	 * thread in async mode. */
+	if (!c->pending) {
+		c->pending = true;
+		fd_pending_add(tracefd);
+	}
+}
+
+static int
+fd_burst(int tracefd, struct chan *c, struct msghdr *msg, ssize_t len, uint8_t type)
+{
+	struct burst *b = &c->burst;
+	ssize_t n = 0;
+
+	/* Anything already waiting must go out first to keep the stream in
+	 * order, and if it can't then the new data queues up behind it. */
+	if (b->bytes > 0 && burst_flush(b, tracefd, MSG_NOSIGNAL|MSG_DONTWAIT) < 0) {
+		DEBUG("pair failed: %d, %s", tracefd, strerror(errno));
+		return WRITE_FAILED;
+	}
+	if (b->bytes == 0) {
+		n = xsendmsg(tracefd, msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+		DEBUG_MORE("pair copy: %zd/%zd", n, len);
+		if (n == len) {
+			return WRITE_SENT;
+		}
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				DEBUG("pair failed: %d, %s", tracefd, strerror(errno));
+				return WRITE_FAILED;
+			}
+			n = 0;
+		}
+	}
+
+	/* Under the drop policy a data frame that can't be started is skipped
+	 * whole. Anything else, including the tail of a frame that was partly
+	 * written, is kept past the limits so the stream never breaks within a
+	 * frame. */
+	bool old = b->bytes > 0 && burst_now() - b->since > burst_age;
+	bool over = b->bytes + (len - n) > burst_max;
+	if ((old || over) && (trace_mode & TRACE_DROP)) {
+		if (type == MUX_DATA && n == 0) {
+			return WRITE_DROPPED;
+		}
+	}
+	else if (old) {
+		DEBUG("pair too slow: %d, burst age exceeded", tracefd);
+		return WRITE_FAILED;
+	}
+	else if (over) {
+		DEBUG("pair too slow: %d, burst size exceeded", tracefd);
+		return WRITE_FAILED;
+	}
+	if (!burst_push(b, msg->msg_iov, msg->msg_iovlen, n)) {
+		DEBUG("pair failed: %d, %s", tracefd, strerror(ENOMEM));
+		return WRITE_FAILED;
+	}
+	DEBUG_MORE("pair burst: %d, %zu", tracefd, b->bytes);
+	fd_pending(tracefd, c);
+	return WRITE_SENT;
+}
+
+static inline uint64_t
+fd_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t
+fd_header(char *buf, uint64_t id, uint64_t seq, uint8_t type, uint8_t flags, ssize_t len)
+{
+	if (trace_mode & TRACE_TEXT) {
+		int n = snprintf(buf, MULTIBUF, "@%" PRIu64 "%c%zd\r\n",
+				id, flags & MUX_FLAG_TX ? '>' : '#', type == MUX_CLOSE ? 0 : len);
+		return n > 0 && n <= MULTIBUF ? (size_t)n : 0;
+	}
+
+	struct mux_hdr *h = (struct mux_hdr *)buf;
+	h->magic = MUX_MAGIC;
+	h->version = MUX_VERSION;
+	h->type = type;
+	h->flags = flags;
+	h->len = mux_le32((uint32_t)len);
+	h->id = mux_le64(id);
+	h->seq = mux_le64(seq);
+	return sizeof(*h);
+}
+
+/* Compresses a channel's coalesced frames into a single block behind the
+ * rest of its stream. Compression only ever runs on the sender thread, which
+ * is why one output buffer serves every channel. A batch that doesn't shrink
+ * is sent as it is, and so are the next few, so incompressible traffic only
+ * pays for an occasional attempt. */
+static bool
+fd_seal(int tracefd, struct chan *c)
+{
+	if (c->packed == 0) { return true; }
+
+	size_t hdr = sizeof(struct mux_hdr), n = 0;
+	if (c->pack_skip > 0) {
+		c->pack_skip--;
+	}
+	else if (c->packed > hdr + 1) {
+		n = lz4_compress(c->pack, c->packed, pack_out + hdr, c->packed - hdr - 1);
+		if (n == 0) { c->pack_skip = PACK_SKIP; }
+	}
+
+	struct iovec iov;
+	if (n > 0) {
+		fd_header(pack_out, 0, c->packed, MUX_BLOCK, MUX_FLAG_LZ4, (ssize_t)n);
+		iov.iov_base = pack_out;
+		iov.iov_len = hdr + n;
+		stats_add(STATS_PACKED, c->packed);
+		stats_add(STATS_PACKED_BYTES, hdr + n);
+	}
+	else {
+		iov.iov_base = c->pack;
+		iov.iov_len = c->packed;
+	}
+	DEBUG_MORE("pair seal: %d, %zu -> %zu", tracefd, c->packed, iov.iov_len);
+	c->packed = 0;
+	if (!burst_push(&c->burst, &iov, 1, 0)) {
+		DEBUG("pair failed: %d, %s", tracefd, strerror(ENOMEM));
+		return false;
+	}
+	return true;
+}
+
+static bool
+fd_pack(int tracefd, struct chan *c, const struct msghdr *msg, size_t len)
+{
+	/* Frames too big to gather are sent on their own, after the batch in
+	 * front of them. */
+	if (c->pack == NULL && len <= pack_size) {
+		c->pack = malloc(pack_size);
+	}
+	if (c->pack == NULL || len > pack_size || c->packed + len > pack_size) {
+		if (!fd_seal(tracefd, c)) { return false; }
+	}
+	if (c->pack == NULL || len > pack_size) {
+		return burst_push(&c->burst, msg->msg_iov, msg->msg_iovlen, 0);
+	}
+	for (size_t i = 0; i < msg->msg_iovlen; i++) {
+		memcpy(c->pack + c->packed, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		c->packed += msg->msg_iov[i].iov_len;
+	}
+	return true;
+}
+
+static bool
+fd_spill(int tracefd, struct chan *c)
+{
+	struct burst *b = &c->burst;
+	if (!fd_seal(tracefd, c)) {
+		return false;
+	}
+	if (burst_flush(b, tracefd, MSG_NOSIGNAL|MSG_DONTWAIT) < 0) {
+		DEBUG("pair failed: %d, %s", tracefd, strerror(errno));
+		return false;
+	}
+	DEBUG_MORE("pair spill: %d, %u frames, %zu left", tracefd, c->frames, b->bytes);
+	c->frames = 0;
+	if (b->bytes > 0) {
+		/* Whatever the socket didn't take is a backlog, which is only
+		 * allowed as far as the burst limits go. Under the drop policy
+		 * the limits are kept by skipping frames instead. */
+		if (trace_mode & TRACE_DROP) {
+			c->due = 0;
+			return true;
+		}
+		if (b->bytes > burst_max) {
+			DEBUG("pair too slow: %d, burst size exceeded", tracefd);
+			return false;
+		}
+		if (burst_now() - b->since > burst_age) {
+			DEBUG("pair too slow: %d, burst age exceeded", tracefd);
+			return false;
+		}
+		c->due = 0;
+	}
+	return true;
+}
+
+static int
+fd_coalesce(int tracefd, struct chan *c, struct msghdr *msg, ssize_t len, uint8_t type)
+{
+	struct burst *b = &c->burst;
+
+	/* Frames are gathered in the burst buffer and go out together once
+	 * enough bytes or frames have built up, or when the sender thread
+	 * finds them past their delay. When compressing they are gathered
+	 * apart, and only join the burst buffer as a block. */
+	if (b->bytes + c->packed + len > coalesce_max + burst_max) {
+		if (!fd_spill(tracefd, c)) { return WRITE_FAILED; }
+		if (b->bytes + len > coalesce_max + burst_max) {
+			if (!(trace_mode & TRACE_DROP)) {
+				DEBUG("pair too slow: %d, burst size exceeded", tracefd);
+				return WRITE_FAILED;
+			}
+			if (type == MUX_DATA) {
+				return WRITE_DROPPED;
+			}
+		}
+	}
+	if (b->bytes + c->packed == 0) {
+		c->due = fd_now() + coalesce_delay;
+	}
+	if (pack_size > 0 ?
+			!fd_pack(tracefd, c, msg, (size_t)len) :
+			!burst_push(b, msg->msg_iov, msg->msg_iovlen, 0)) {
+		DEBUG("pair failed: %d, %s", tracefd, strerror(ENOMEM));
+		return WRITE_FAILED;
+	}
+	if (++c->frames >= coalesce_frames || b->bytes + c->packed >= coalesce_max) {
+		if (!fd_spill(tracefd, c)) { return WRITE_FAILED; }
+	}
+	if (b->bytes + c->packed > 0) {
+		fd_pending(tracefd, c);
+	}
+	return WRITE_SENT;
+}
+
+static int
+fd_buffer(int tracefd, struct chan *c, struct msghdr *msg, ssize_t len, uint8_t type)
+{
+	return coalesce_max > 0 ?
+		fd_coalesce(tracefd, c, msg, len, type) :
+		fd_burst(tracefd, c, msg, len, type);
+}
+
+static void
+fd_defer(struct chan *c, uint8_t type, const struct msghdr *msg, ssize_t len)
+{
+	struct defer *d = xmalloc(sizeof(*d) + len);
+	d->type = type;
+	d->len = len;
+	char *p = d->data;
+	for (size_t i = 0; i < msg->msg_iovlen; i++) {
+		memcpy(p, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		p += msg->msg_iov[i].iov_len;
+	}
+	d->next = atomic_load(&c->defer);
+	while (!atomic_compare_exchange_weak(&c->defer, &d->next, d)) {}
+	/* Pairs with the fence in fd_unlock, so either the holder finds this
+	 * frame after letting go or the caller's next try takes the lock. */
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void
+fd_undefer(int tracefd, struct chan *c, bool send)
+{
+	if (atomic_load_explicit(&c->defer, memory_order_relaxed) == NULL) { return; }
+
+	/* Frames are pushed newest first, so they are written in reverse. */
+	struct defer *d = atomic_exchange(&c->defer, NULL), *rev = NULL;
+	while (d) {
+		struct defer *next = d->next;
+		d->next = rev;
+		rev = d;
+		d = next;
+	}
+	while (rev) {
+		struct defer *next = rev->next;
+		if (send && !atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+			struct iovec iov = { .iov_base = rev->data, .iov_len = rev->len };
+			struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+			if (fd_buffer(tracefd, c, &msg, rev->len, rev->type) == WRITE_FAILED) {
+				fd_kill(tracefd);
+			}
+		}
+		free(rev);
+		rev = next;
+	}
+}
+
+static void
+fd_unlock(int tracefd, struct chan *c)
+{
+	/* A frame deferred while the lock was held is written before letting
+	 * go. One deferred in between is picked up again here, unless another
+	 * thread has already taken the lock and will write it instead. */
+	do {
+		fd_undefer(tracefd, c, true);
+		spin_unlock(&c->lock);
+		atomic_thread_fence(memory_order_seq_cst);
+	} while (atomic_load_explicit(&c->defer, memory_order_relaxed) != NULL &&
+			spin_trylock(&c->lock));
+}
+
+static int
+fd_write(int tracefd, uint64_t id, uint64_t seq, uint8_t type, uint8_t flags,
+		struct iovec *iov, size_t iovcnt, ssize_t len, const struct loss *l)
+{
+	assert(iovcnt > 0);
+	assert(iov[0].iov_len == 0);
+	assert(iovcnt <= FRAME_IOV);
+
+	if (trace_mode & TRACE_MULTIPLEX) {
+		/* The first iovec is an empty buffer for adding the multiplexing data. */
+		iov->iov_len = fd_header(iov->iov_base, id, seq, type, flags, len);
+		len += iov->iov_len;
+	}
+
+	/* A gap goes out in the same write as the frame after it, so the two
+	 * are skipped or sent together. */
+	_Alignas(8) char gap[MULTIBUF];
+	struct mux_gap gm;
+	struct iovec giov[l ? iovcnt + 2 : 1];
+	if (l) {
+		giov[0].iov_base = gap;
+		giov[0].iov_len = fd_header(gap, id, l->seq, MUX_GAP, 0, sizeof(gm));
+		giov[1].iov_base = &gm;
+		giov[1].iov_len = fd_gap_event(l, &gm);
+		memcpy(giov + 2, iov, iovcnt * sizeof(*iov));
+		len += giov[0].iov_len + giov[1].iov_len;
+		iov = giov;
+		iovcnt += 2;
+	}
+
+	struct msghdr msg = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0
+	};
+
+	/* The drop policy needs the burst buffer to hold the tail of a frame
+	 * the socket only partly took. */
+	if (burst_max > 0 || coalesce_max > 0 || (trace_mode & TRACE_DROP)) {
+		/* Writes from different threads must not interleave with a
+		 * buffered tail. The sender thread is the only writer in async
+		 * mode, so the lock is only needed when writing directly. A
+		 * thread never waits on another's send for it: a data frame is
+		 * skipped under the drop policy, and anything else is copied
+		 * for the lock holder to write in order before letting go. */
+		struct chan *c = table_get(&chans, tracefd);
+		if (trace_mode & TRACE_ASYNC) {
+			return fd_buffer(tracefd, c, &msg, len, type);
+		}
+		if (!spin_trylock(&c->lock)) {
+			if ((trace_mode & TRACE_DROP) && type == MUX_DATA) {
+				return WRITE_DROPPED;
+			}
+			fd_defer(c, type, &msg, len);
+			if (spin_trylock(&c->lock)) {
+				fd_unlock(tracefd, c);
+			}
+			return WRITE_SENT;
+		}
+		fd_undefer(tracefd, c, true);
+		int rc = fd_buffer(tracefd, c, &msg, len, type);
+		fd_unlock(tracefd, c);
+		return rc;
+	}
+
+	ssize_t n = xsendmsg(tracefd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+
+	DEBUG_MORE("pair copy: %zd/%zd", n, len);
+	if (n < len) {
+		if (n < 0)       { DEBUG("pair failed: %d, %s", tracefd, strerror(errno)); }
+		else if (n == 0) { DEBUG("pair closed: %d", tracefd); }
+		else             { DEBUG("pair too slow: %d", tracefd); }
+		return WRITE_FAILED;
+	}
+	return WRITE_SENT;
+}
+
+/* Writes a frame behind any gap left on its connection. A data frame that is
+ * skipped joins the gap, along with the gap it would have carried. */
+static int
+fd_post(struct entry *e, int tracefd, uint64_t id, uint64_t seq, uint64_t off,
+		uint8_t type, uint8_t flags, struct iovec *iov, size_t iovcnt, ssize_t len)
+{
+	struct loss l;
+	bool gap = fd_gap(e, id, seq, &l);
+	int rc = fd_write(tracefd, id, seq, type, flags, iov, iovcnt, len, gap ? &l : NULL);
+	if (rc == WRITE_DROPPED) {
+		if (gap) { fd_lose(e, &l); }
+		fd_skip(e, id, seq, flags, off, len);
+	}
+	return rc;
+}
+
+static void
+fd_queue(int clientfd, struct entry *e, int tracefd, uint8_t type, uint8_t flags,
+		uint64_t off, const struct iovec *iov, size_t iovcnt, ssize_t len)
+{
+	/* Frames larger than half the ring are queued in parts, so each part
+	 * fits once the ring drains. A full ring only means the sender is
+	 * behind, which the sender itself reports if the channel is slow. */
+	unsigned gen = atomic_load_explicit(&((struct chan *)table_get(&chans, tracefd))->gen,
+			memory_order_relaxed);
+	size_t max = sender_frame_max(), done = 0, i = 0, at = 0;
+	do {
+		size_t n = (size_t)len - done < max ? (size_t)len - done : max;
+		struct frame *f;
+		while ((f = sender_reserve(n)) == NULL) {
+			if ((trace_mode & TRACE_DROP) && type == MUX_DATA) {
+				fd_skip(e, fd_get_id(e), fd_seq(e), flags, off + done, (size_t)len - done);
+				return;
+			}
+			if (!sender_wait()) {
+				DEBUG("pair too slow: %d", tracefd);
+				fd_unpair(clientfd, e, tracefd, true);
+				return;
+			}
+		}
+
+		f->type = type;
+		f->flags = flags;
+		f->clientfd = clientfd;
+		f->tracefd = tracefd;
+		f->id = fd_get_id(e);
+		f->seq = fd_seq(e);
+		f->off = off + done;
+		f->gen = gen;
+
+		char *p = f->data;
+		for (size_t want = n; want > 0 && i < iovcnt; ) {
+			size_t part = iov[i].iov_len - at;
+			if (part > want) { part = want; }
+			memcpy(p, (char *)iov[i].iov_base + at, part);
+			p += part;
+			want -= part;
+			at += part;
+			if (at == iov[i].iov_len) { i++; at = 0; }
+		}
+		sender_commit(f);
+		done += n;
+	} while (done < (size_t)len);
+}
+
+static size_t
+fd_close_event(struct entry *e, uint32_t reason, struct mux_close *cl)
+{
+	if (!(trace_mode & TRACE_EVENTS)) { return 0; }
+	cl->rx = mux_le64(atomic_load_explicit(&e->rx, memory_order_relaxed));
+	cl->tx = mux_le64(atomic_load_explicit(&e->tx, memory_order_relaxed));
+	cl->reason = mux_le32(reason);
+	cl->reserved = 0;
+	return sizeof(*cl);
+}
+
+_Static_assert(SHMRING_DATA == MUX_DATA && SHMRING_CLOSE == MUX_CLOSE &&
+		SHMRING_OPEN == MUX_OPEN && SHMRING_GAP == MUX_GAP,
+		"ring types match frame types");
+
+static bool
+fd_ring(struct entry *e, int tracefd, uint16_t type, uint8_t flags,
+		const struct iovec *iov, size_t iovcnt, ssize_t len)
+{
+#if HAS_SHMRING
+	struct chan *c = table_get(&chans, tracefd);
+	if (!shmring_write(c->shm, fd_get_id(e), type,
+				flags & MUX_FLAG_TX ? SHMRING_TX : 0, iov, iovcnt, len)) {
+		DEBUG("pair too slow: %d, ring full", tracefd);
+		return false;
+	}
+	DEBUG_MORE("pair ring: %d, %zd", tracefd, len);
+	return true;
+#else
+	(void)e; (void)tracefd; (void)type; (void)flags;
+	(void)iov; (void)iovcnt; (void)len;
+	return false;
+#endif
+}
+
+/* Ring counterpart of fd_post. The gap record has no sequence number, as ring
+ * records have none, and is kept back if it doesn't fit so that the frame
+ * after it is skipped too. */
+static int
+fd_record(struct entry *e, int tracefd, uint16_t type, uint8_t flags,
+		uint64_t off, const struct iovec *iov, size_t iovcnt, ssize_t len)
+{
+	uint64_t id = fd_get_id(e);
+	struct loss l;
+	if (fd_gap(e, id, UINT64_MAX, &l)) {
+		struct mux_gap gm;
+		struct iovec giov = { .iov_base = &gm, .iov_len = fd_gap_event(&l, &gm) };
+		if (!fd_ring(e, tracefd, SHMRING_GAP, 0, &giov, 1, giov.iov_len)) {
+			fd_lose(e, &l);
+			if (type == MUX_DATA) {
+				fd_skip(e, id, 0, flags, off, len);
+				return WRITE_DROPPED;
+			}
+		}
+	}
+	if (fd_ring(e, tracefd, type, flags, iov, iovcnt, len)) {
+		return WRITE_SENT;
+	}
+	if ((trace_mode & TRACE_DROP) && type == MUX_DATA) {
+		fd_skip(e, id, 0, flags, off, len);
+		return WRITE_DROPPED;
+	}
+	return WRITE_FAILED;
+}
+
+static void
+fd_dropped(int clientfd, struct entry *e, int tracefd)
+{
+	/* The ring is most likely still full, so the close record is only a
+	 * best effort. The consumer sees the ring's dropped count rise either
+	 * way. */
+	struct mux_close cl;
+	size_t len = fd_close_event(e, MUX_CLOSE_SLOW, &cl);
+	if (len > 0) {
+		struct iovec iov = { .iov_base = &cl, .iov_len = len };
+		fd_ring(e, tracefd, SHMRING_CLOSE, 0, &iov, 1, len);
+	}
+	stats_add(STATS_SLOW, 1);
+	fd_unpair(clientfd, e, tracefd, false);
+}
+
+static void
+fd_opened(int clientfd, struct entry *e, int tracefd);
+
+static void
+fd_trace(int clientfd, struct entry *e, int tracefd, uint8_t type, uint8_t flags,
+		struct iovec *iov, size_t iovcnt, ssize_t len)
+{
+	uint64_t off = 0;
+	if (type == MUX_DATA) {
+		stats_add(STATS_FRAMES, 1);
+		stats_add(STATS_BYTES, len);
+	}
+	if (((trace_mode & TRACE_EVENTS) || trace_gaps) && type == MUX_DATA) {
+		if (trace_mode & TRACE_EVENTS) {
+			fd_opened(clientfd, e, tracefd);
+		}
+		off = atomic_fetch_add_explicit(flags & MUX_FLAG_TX ? &e->tx : &e->rx, len,
+				memory_order_relaxed);
+	}
+
+	if (trace_mode & TRACE_SHM) {
+		/* Ring writes are already a copy, so they skip the sender. A full
+		 * ring only drops the pair that overflowed it. */
+		if (fd_record(e, tracefd, type, flags, off, iov+1, iovcnt-1, len) == WRITE_FAILED) {
+			fd_dropped(clientfd, e, tracefd);
+		}
+	}
+	else if (trace_mode & TRACE_ASYNC) {
+		/* Skip the multiplexing buffer; the sender thread adds its own. */
+		fd_queue(clientfd, e, tracefd, type, flags, off, iov+1, iovcnt-1, len);
+	}
+	else if (fd_post(e, tracefd, fd_get_id(e), fd_seq(e), off, type, flags,
+				iov, iovcnt, len) == WRITE_FAILED) {
+		fd_unpair(clientfd, e, tracefd, true);
+	}
+}
+
+#if HAS_IO_URING
+
+/* With io_uring the sender thread gathers each pass's frames per channel and
+ * submits one sendmsg per channel, all with a single io_uring_enter. */
+
+#define BATCH_FRAMES 4096
+#define BATCH_CHAN 512
+
+struct batch {
+	int tracefd;
+	unsigned head, tail;   /* First and last frame index in the chain. */
+	unsigned count;
+	size_t len;
+	struct msghdr msg;
+};
+
+static struct uring uring;
+static bool uring_on = false;
+static struct batch *bat;
+static struct frame **bat_frame;
+static unsigned *bat_next;
+static char (*bat_hdr)[MULTIBUF];
+static struct iovec *bat_iov;
+static unsigned bat_frames = 0, bat_count = 0;
+
+static void
+fd_batch_init(bool sqpoll)
+{
+	if (!uring_init(&uring, BATCH_FRAMES, sqpoll) &&
+			(!sqpoll || !uring_init(&uring, BATCH_FRAMES, false))) {
+		DEBUG("io_uring unavailable: %s", strerror(errno));
+		return;
+	}
+	bat = xmalloc(BATCH_FRAMES * sizeof(*bat));
+	bat_frame = xmalloc(BATCH_FRAMES * sizeof(*bat_frame));
+	bat_next = xmalloc(BATCH_FRAMES * sizeof(*bat_next));
+	bat_hdr = xmalloc(BATCH_FRAMES * sizeof(*bat_hdr));
+	bat_iov = xmalloc(2 * BATCH_FRAMES * sizeof(*bat_iov));
+	uring_on = true;
+	DEBUG("io_uring: entries=%u sqpoll=%d", uring.entries, uring.sqpoll);
+}
+
+static void
+fd_batch_fork(void)
+{
+	/* The ring is shared with the parent, so a child sets up its own once
+	 * it starts tracing. */
+	if (!uring_on) { return; }
+	xclose(uring.fd);
+	uring.fd = -1;
+	bat_count = bat_frames = 0;
+}
+
+static void
+fd_batch_restart(void)
+{
+	if (!uring_on) { return; }
+	bool sqpoll = uring.sqpoll;
+	uring_free(&uring);
+	if (!uring_init(&uring, BATCH_FRAMES, sqpoll) &&
+			(!sqpoll || !uring_init(&uring, BATCH_FRAMES, false))) {
+		DEBUG("io_uring unavailable: %s", strerror(errno));
+		uring_on = false;
+	}
+}
+
+static bool
+fd_batch_skip(struct batch *b, struct chan *c, size_t sent)
+{
+	/* Keep the tail of the frame the socket stopped in, and whatever
+	 * follows it as far as the burst limit goes. Data frames past that are
+	 * skipped, as is any later data of a connection that already has a
+	 * gap, so its gap is reported ahead of the rest. */
+	struct iovec *iov = b->msg.msg_iov;
+	size_t pos = 0;
+	for (unsigned i = b->head; i != UINT_MAX; i = bat_next[i], iov += 2) {
+		struct frame *f = bat_frame[i];
+		struct entry *e = table_get(&entries, f->clientfd);
+		size_t len = iov[0].iov_len + iov[1].iov_len;
+		size_t skip = sent > pos ? sent - pos : 0;
+		pos += len;
+		if (skip >= len) { continue; }
+		if (skip == 0 && f->type == MUX_DATA &&
+				(c->burst.bytes + len > burst_max || fd_gapped(e))) {
+			fd_skip(e, f->id, f->seq, f->flags, f->off, f->len);
+			continue;
+		}
+		if (!burst_push(&c->burst, iov, 2, skip)) {
+			DEBUG("pair failed: %d, %s", b->tracefd, strerror(ENOMEM));
+			return false;
+		}
+	}
+	if (c->burst.bytes > 0) {
+		DEBUG_MORE("pair burst: %d, %zu", b->tracefd, c->burst.bytes);
+		fd_pending(b->tracefd, c);
+	}
+	return true;
+}
 
-/* TODO: this is horribly thread-unsafe at the moment */
+static void
+fd_batch_done(struct batch *b, ssize_t res)
+{
+	DEBUG_MORE("pair copy: %zd/%zu", res, b->len);
+	if (res == (ssize_t)b->len) { return; }
 
-#ifndef MSG_NOSIGNAL
-# define MSG_NOSIGNAL 0
-#endif
+	struct chan *c = table_get(&chans, b->tracefd);
+	if ((trace_mode & TRACE_DROP) && (res >= 0 || res == -EAGAIN || res == -EWOULDBLOCK) &&
+			fd_batch_skip(b, c, res < 0 ? 0 : (size_t)res)) {
+		return;
+	}
+	if (burst_max > 0 && (res >= 0 || res == -EAGAIN || res == -EWOULDBLOCK)) {
+		size_t n = res < 0 ? 0 : (size_t)res;
+		if (c->burst.bytes + (b->len - n) <= burst_max &&
+				burst_push(&c->burst, b->msg.msg_iov, b->msg.msg_iovlen, n)) {
+			DEBUG_MORE("pair burst: %d, %zu", b->tracefd, c->burst.bytes);
+			fd_pending(b->tracefd, c);
+			return;
+		}
+	}
 
-#define MULTIBUF 64
+	if (res < 0)       { DEBUG("pair failed: %d, %s", b->tracefd, strerror(-res)); }
+	else if (res == 0) { DEBUG("pair closed: %d", b->tracefd); }
+	else               { DEBUG("pair too slow: %d", b->tracefd); }
+	for (unsigned i = b->head; i != UINT_MAX; i = bat_next[i]) {
+		struct frame *f = bat_frame[i];
+		fd_unpair(f->clientfd, table_get(&entries, f->clientfd), f->tracefd, true);
+	}
+}
 
-static int trace_mode = 0;
-static int trace_fd = -1;
-static int max_fd = 0;
+static void
+fd_flush(void)
+{
+	if (bat_count == 0) { return; }
+
+	struct iovec *iov = bat_iov;
+	for (unsigned i = 0; i < bat_count; i++) {
+		struct batch *b = &bat[i];
+		b->msg = (struct msghdr){ .msg_iov = iov };
+		for (unsigned j = b->head; j != UINT_MAX; j = bat_next[j]) {
+			struct frame *f = bat_frame[j];
+			if (trace_mode & TRACE_MULTIPLEX) {
+				iov->iov_base = bat_hdr[j];
+				iov->iov_len = fd_header(bat_hdr[j], f->id, f->seq, f->type, f->flags, f->len);
+				b->len += iov->iov_len;
+				iov++;
+			}
+			iov->iov_base = f->data;
+			iov->iov_len = f->len;
+			b->len += f->len;
+			iov++;
+		}
+		b->msg.msg_iovlen = iov - b->msg.msg_iov;
 
-struct entry { int fd; unsigned id; };
-static struct entry *table = NULL;
-static unsigned table_size = 0;
-static unsigned table_scan = 0;
-static unsigned table_id = 0;
+		/* The ring has as many entries as a pass can have batches. */
+		struct io_uring_sqe *sqe = uring_sqe(&uring);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = b->tracefd;
+		sqe->addr = (uintptr_t)&b->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL|MSG_DONTWAIT;
+		sqe->user_data = i;
+	}
 
-#define POLLFD_1 { -1, POLLOUT, 0 }
-#define POLLFD_2 POLLFD_1, POLLFD_1
-#define POLLFD_4 POLLFD_2, POLLFD_2
-#define POLLFD_8 POLLFD_4, POLLFD_4
-#define POLLFD_16 POLLFD_8, POLLFD_8
-#define POLLFD_32 POLLFD_16, POLLFD_16
-#define POLLFD_64 POLLFD_32, POLLFD_32
+	/* Should the ring fail, only the batches the kernel never took are
+	 * sent directly. Those it did take are still in flight, reading from
+	 * the batch, so their completions are awaited all the same. */
+	unsigned taken = bat_count;
+	if (uring_submit(&uring, bat_count) < 0) {
+		DEBUG("io_uring failed: %s", strerror(errno));
+		taken -= uring_withdraw(&uring);
+		for (unsigned i = taken; i < bat_count; i++) {
+			ssize_t n = xsendmsg(bat[i].tracefd, &bat[i].msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+			fd_batch_done(&bat[i], n < 0 ? -errno : n);
+		}
+	}
+	for (unsigned n = 0; n < taken; ) {
+		struct io_uring_cqe *cqe = uring_cqe(&uring);
+		if (cqe == NULL) {
+			uring_submit(&uring, 1);
+			continue;
+		}
+		fd_batch_done(&bat[cqe->user_data], cqe->res);
+		uring_cqe_seen(&uring);
+		n++;
+	}
 
-struct pollfd reuse[] = { POLLFD_64 };
+	for (unsigned i = 0; i < bat_count; i++) {
+		((struct chan *)table_get(&chans, bat[i].tracefd))->batch = 0;
+	}
+	bat_count = bat_frames = 0;
+}
 
-static bool
-fd_trash(int tracefd)
+static void
+fd_batch(struct frame *f, struct chan *c)
 {
-	for (size_t i = 0; i < countof(reuse); i++) {
-		if (reuse[i].fd < 0) {
-			reuse[i].fd = tracefd;
-			return true;
+	unsigned idx = bat_frames++;
+	bat_frame[idx] = f;
+	bat_next[idx] = UINT_MAX;
+
+	struct batch *b;
+	if (c->batch == 0) {
+		b = &bat[bat_count++];
+		b->tracefd = f->tracefd;
+		b->head = idx;
+		b->count = 0;
+		b->len = 0;
+		c->batch = bat_count;
+	}
+	else {
+		b = &bat[c->batch - 1];
+		bat_next[b->tail] = idx;
+	}
+	b->tail = idx;
+	b->count++;
+
+	if (bat_frames == BATCH_FRAMES || b->count == BATCH_CHAN) {
+		fd_flush();
+	}
+}
+
+#endif
+
+static void
+fd_dequeue(struct frame *f)
+{
+	struct chan *c = table_get(&chans, f->tracefd);
+	if (atomic_load_explicit(&c->gen, memory_order_relaxed) != f->gen) {
+		return;
+	}
+	if (atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+		fd_unpair(f->clientfd, table_get(&entries, f->clientfd), f->tracefd, true);
+		return;
+	}
+
+#if HAS_IO_URING
+	/* Channels with a burst backlog go through the direct path so the
+	 * backlog is flushed first, as do connections with a gap to report.
+	 * Coalescing does its own batching. */
+	if (uring_on && coalesce_max == 0 && c->burst.bytes == 0 &&
+			!fd_gapped(table_get(&entries, f->clientfd))) {
+		fd_batch(f, c);
+		return;
+	}
+#endif
+
+	_Alignas(8) char multi[MULTIBUF];
+	struct iovec iov[2] = {
+		{ .iov_base = multi, .iov_len = 0 },
+		{ .iov_base = f->data, .iov_len = f->len }
+	};
+	struct entry *e = table_get(&entries, f->clientfd);
+	if (fd_post(e, f->tracefd, f->id, f->seq, f->off, f->type, f->flags,
+				iov, countof(iov), f->len) == WRITE_FAILED) {
+		fd_unpair(f->clientfd, e, f->tracefd, true);
+	}
+}
+
+static void
+fd_stopped(struct frame *f)
+{
+	struct chan *c = table_get(&chans, f->tracefd);
+	if ((trace_mode & TRACE_MULTIPLEX) && (f->flags & TRACE_STOP_MARK) &&
+			!atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+		_Alignas(8) char multi[MULTIBUF];
+		struct iovec iov[2] = {
+			{ .iov_base = multi, .iov_len = 0 },
+			{ .iov_base = f->data, .iov_len = f->len }
+		};
+		if (fd_post(table_get(&entries, f->clientfd), f->tracefd, f->id, f->seq, 0,
+					MUX_CLOSE, 0, iov, f->len ? 2 : 1, f->len) == WRITE_FAILED) {
+			fd_kill(f->tracefd);
 		}
 	}
-	return false;
+	fd_release(f->tracefd);
 }
 
-static int
-fd_restore(void)
+static size_t
+fd_drain(void)
 {
-	/* Poll with immediate timeout to detect any closed trace sockets. */
-	int n = poll(reuse, countof(reuse), 0);
-	if (n > 0) {
-		for (size_t i = 0; i < countof(reuse); i++) {
-			if (reuse[i].revents & (POLLERR|POLLHUP|POLLNVAL)) {
-				DEBUG("pair closed: %d", reuse[i].fd);
-				xclose(reuse[i].fd);
-				reuse[i].fd = -1;
-			}
-			else if (reuse[i].revents & POLLOUT) {
-				int tracefd = reuse[i].fd;
-				reuse[i].fd = -1;
-				return tracefd;
+	/* Flush burst buffers from the sender thread so an idle pair's tail
+	 * doesn't wait for its next read. The list is taken whole so that no
+	 * channel lock is ever acquired while holding the list lock. */
+	spin_lock(&pending_lock);
+	int *list = pending;
+	size_t len = pending_len;
+	pending = NULL;
+	pending_len = pending_cap = 0;
+	spin_unlock(&pending_lock);
+
+	bool async = trace_mode & TRACE_ASYNC;
+	uint64_t now = coalesce_max > 0 && len > 0 ? fd_now() : 0;
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		int tracefd = list[i];
+		struct chan *c = table_get(&chans, tracefd);
+		struct burst *b = &c->burst;
+		if (!async) { spin_lock(&c->lock); }
+		if (b->bytes + c->packed > 0 && now >= c->due &&
+				!atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+			size_t before = b->bytes + c->packed;
+			if (!fd_spill(tracefd, c)) {
+				fd_kill(tracefd);
 			}
+			n += before != b->bytes;
+		}
+		if (b->bytes > 0 && !atomic_load_explicit(&c->dead, memory_order_relaxed)) {
+			fd_pending_add(tracefd);
+		}
+		else {
+			c->pending = false;
 		}
+		if (!async) { fd_unlock(tracefd, c); }
 	}
-	return -1;
+	free(list);
+	return n;
 }
 
-static int
-fd_get_pair(int clientfd)
+static uint64_t
+fd_hash(const void *p, size_t len)
 {
-	if (clientfd < 0 || (unsigned)clientfd >= table_size) {
-		return -1;
+	/* FNV-1a followed by a final mix to spread short inputs. */
+	const unsigned char *b = p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ b[i]) * 0x100000001b3ULL;
 	}
-	return table[clientfd].fd - 1;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
 }
 
-static unsigned
-fd_get_id(int clientfd)
+static const struct sockaddr *
+fd_peer(int clientfd, const struct sockaddr *addr, const socklen_t *addrlen,
+		struct sockaddr_storage *ss)
 {
-	if (clientfd < 0 || (unsigned)clientfd >= table_size) {
-		return -1;
+	/* The accepted address is used when it's complete, otherwise the peer
+	 * is looked up. Only IP addresses are returned. */
+	socklen_t len = addr && addrlen ? *addrlen : 0;
+	if (len == 0 || len > sizeof(*ss)) {
+		len = sizeof(*ss);
+		if (getpeername(clientfd, (struct sockaddr *)ss, &len) < 0) {
+			return NULL;
+		}
+		addr = (struct sockaddr *)ss;
 	}
-	return table[clientfd].id;
+	if ((addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in)) ||
+			(addr->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6))) {
+		return addr;
+	}
+	return NULL;
 }
 
 static void
-fd_pair(int clientfd, int tracefd)
+fd_addr(struct mux_addr *m, const struct sockaddr *addr)
 {
-	if ((unsigned)clientfd >= table_size) {
-		unsigned sz = (unsigned)clientfd;
-		if (sz > 0) {
-			sz |= sz >> 1;
-			sz |= sz >> 2;
-			sz |= sz >> 4;
-			sz |= sz >> 8;
-			sz |= sz >> 16;
-			sz++;
-		}
-		else {
-			sz = 1024;
-		}
-		table = xrealloc(table, sz * sizeof(*table));
-		memset(table + table_size, 0, sizeof(*table) * (sz - table_size));
-		table_size = sz;
+	memset(m, 0, sizeof(*m));
+	if (addr && addr->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		m->family = mux_le16(MUX_AF_INET);
+		m->port = mux_le16(ntohs(in->sin_port));
+		memcpy(m->addr, &in->sin_addr, sizeof(in->sin_addr));
+	}
+	else if (addr && addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		m->family = mux_le16(MUX_AF_INET6);
+		m->port = mux_le16(ntohs(in6->sin6_port));
+		memcpy(m->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
 	}
+}
 
-	table[clientfd].fd = tracefd + 1;
-	table[clientfd].id = ++table_id;
+static void
+fd_born(struct entry *e)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+#ifdef SYS_gettid
+	e->tid = (uint32_t)xsyscall(SYS_gettid, 0, 0, 0, 0, 0, 0);
+#else
+	e->tid = 0;
+#endif
+	atomic_store_explicit(&e->born, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+			memory_order_release);
 }
 
-static int
-fd_multi(void)
+static void
+fd_opened(int clientfd, struct entry *e, int tracefd)
 {
-	int fd = -1;
-	unsigned scan = table_scan, last = table_size-1, end = scan+last+1;
-	for (; scan < end && fd < 0; scan++) {
-		fd = fd_get_pair(scan & last);
+	/* The open event is sent ahead of the connection's first frame rather
+	 * than at accept, so in async mode it is queued on the same thread's
+	 * ring as the data that follows it. */
+	if (atomic_load_explicit(&e->born, memory_order_relaxed) == 0) { return; }
+	uint64_t born = atomic_exchange_explicit(&e->born, 0, memory_order_acquire);
+	if (born == 0) { return; }
+
+	struct mux_open op;
+	op.time = mux_le64(born);
+	op.pid = mux_le32((uint32_t)getpid());
+	op.tid = mux_le32(e->tid);
+
+	struct sockaddr_storage ss;
+	fd_addr(&op.peer, fd_peer(clientfd, NULL, NULL, &ss));
+	socklen_t len = sizeof(ss);
+	if (getsockname(clientfd, (struct sockaddr *)&ss, &len) < 0) {
+		ss.ss_family = AF_UNSPEC;
 	}
-	table_scan = scan;
-	return fd;
+	fd_addr(&op.local, (struct sockaddr *)&ss);
+
+	_Alignas(8) char multi[MULTIBUF];
+	struct iovec iov[2] = {
+		{ .iov_base = multi, .iov_len = 0 },
+		{ .iov_base = &op, .iov_len = sizeof(op) }
+	};
+	fd_trace(clientfd, e, tracefd, MUX_OPEN, 0, iov, 2, sizeof(op));
 }
 
-static void
-fd_unpair(int clientfd, int tracefd, bool eof)
+static bool
+fd_host(const struct sockaddr *peer, uint64_t *h)
 {
-	table[clientfd].fd = 0;
-	if (!eof) {
-		eof = !fd_trash(tracefd);
+	/* Hash only the host so a choice sticks to a client across all of its
+	 * connections. */
+	if (peer && peer->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+		*h = fd_hash(&in->sin_addr, sizeof(in->sin_addr));
+		return true;
 	}
-	if (eof) {
-		xclose(tracefd);
+	if (peer && peer->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)peer;
+		*h = fd_hash(&in6->sin6_addr, sizeof(in6->sin6_addr));
+		return true;
 	}
+	return false;
+}
+
+static bool
+fd_sample(const struct sockaddr *peer)
+{
+	/* Peers without an IP address fall back to sampling by count. */
+	uint64_t h;
+	if (sample_peer && fd_host(peer, &h)) {
+		return h % TRACE_SAMPLE_ALL < sample_rate;
+	}
+
+	/* Take exactly sample_rate of every million connections, spread evenly
+	 * rather than at random. */
+	uint64_t n = atomic_fetch_add_explicit(&sample_count, 1, memory_order_relaxed);
+	return (n + 1) * sample_rate / TRACE_SAMPLE_ALL != n * sample_rate / TRACE_SAMPLE_ALL;
 }
 
+/* Connection ids carry the pid, so those of a forking server's workers
+ * never collide. */
 static void
-fd_trace(int clientfd, int tracefd, struct iovec *iov, size_t iovcnt, ssize_t len)
+fd_ids(void)
 {
-	assert(iovcnt > 0);
-	assert(iov[0].iov_len == 0);
+	atomic_store(&table_id, (uint64_t)(uint32_t)getpid() << 32);
+}
 
-	if (trace_mode & TRACE_MULTIPLEX) {
-		/* The first iovec is an empty buffer for adding the multiplexing data. */
-		unsigned id = fd_get_id(clientfd);
-		int n = snprintf(iov->iov_base, MULTIBUF, "@%u#%zd\r\n", id, len);
-		if (n > 0 && n <= MULTIBUF) {
-			iov->iov_len = n;
-			len += n;
+/* Offers the recorder's end of its socket pair as a consumer. */
+static void
+fd_recording(int fd)
+{
+	if (fd >= 0 && !spare_adopt(fd)) {
+		DEBUG("record failed: %d", fd);
+	}
+}
+
+/* Runs in the child after a fork, and so only resets state. Every consumer
+ * socket is shared with the parent, which goes on using them, so the child
+ * closes its copies without shutting them down, before it can reuse their
+ * numbers. Inherited connections are left to pair again from the child's own
+ * pool the next time they are traced; until then they still count as live.
+ * Locks held by threads that didn't survive the fork are reset with what
+ * they guard. Everything that allocates or starts a thread waits for
+ * fd_restart, so a child that never traces never pays for it. */
+static void
+fd_fork(void)
+{
+	fd_ids();
+	atomic_flag_clear(&pending_lock);
+	pending_len = 0;
+	burst_fork();
+
+	for (unsigned fd = 0; fd < entries.limit; fd++) {
+		struct entry *e = table_get(&entries, (int)fd);
+		if (e == NULL) {
+			fd |= TABLE_PAGE_MASK;
+			continue;
+		}
+		atomic_flag_clear(&e->gap.lock);
+		atomic_store_explicit(&e->gap.frames, 0, memory_order_relaxed);
+		if (atomic_exchange_explicit(&e->fd, 0, memory_order_relaxed) > 0) {
+			atomic_store_explicit(&e->adopt, true, memory_order_relaxed);
 		}
 	}
 
-	struct msghdr msg = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = (struct iovec *)iov,
-		.msg_iovlen = iovcnt,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0
-	};
+	for (unsigned fd = 0; fd < chans.limit; fd++) {
+		struct chan *c = table_get(&chans, (int)fd);
+		if (c == NULL) {
+			fd |= TABLE_PAGE_MASK;
+			continue;
+		}
+		atomic_flag_clear(&c->lock);
+		c->pending = false;
+		c->batch = 0;
+		c->frames = 0;
+		if (atomic_load_explicit(&c->refs, memory_order_relaxed) == 0) { continue; }
+#if HAS_SHMRING
+		shmring_close(c->shm);
+#endif
+		c->slot = -1;
+		atomic_store(&c->refs, 0);
+		atomic_store(&c->dead, false);
+		atomic_fetch_add(&c->gen, 1);
+		xclose((int)fd);
+	}
 
-	ssize_t n = sendmsg(tracefd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+#if HAS_SHMRING
+	shmring_fork();
+#endif
+#if HAS_IO_URING
+	fd_batch_fork();
+#endif
+	sender_fork();
+	stats_fork();
+	spare_fork(true);
+	if (trace_record) {
+		record_fork();
+	}
+	atomic_flag_clear(&fork_lock);
+	atomic_store_explicit(&trace_forked, true, memory_order_release);
+}
 
-	DEBUG_MORE("pair copy: %zd/%zd", n, len);
-	if (n < len) {
-		if (n < 0)       { DEBUG("pair failed: %d, %s", tracefd, strerror(errno)); }
-		else if (n == 0) { DEBUG("pair closed: %d", tracefd); }
-		else             { DEBUG("pair too slow: %d", tracefd); }
-		fd_unpair(clientfd, tracefd, true);
+/* Finishes what fd_fork left for the child's first traced connection, new
+ * or inherited: frees what the parent's channels held and starts the
+ * child's own threads and segments. */
+static void
+fd_respawn(void)
+{
+	spin_lock(&fork_lock);
+	if (atomic_load_explicit(&trace_forked, memory_order_acquire)) {
+		for (unsigned fd = 0; fd < chans.limit; fd++) {
+			struct chan *c = table_get(&chans, (int)fd);
+			if (c == NULL) {
+				fd |= TABLE_PAGE_MASK;
+				continue;
+			}
+			burst_clear(&c->burst);
+			c->packed = 0;
+			fd_undefer((int)fd, c, false);
+#if HAS_SHMRING
+			shmring_drop(c->shm);
+			c->shm = NULL;
+#endif
+		}
+#if HAS_SHMRING
+		shmring_restart();
+#endif
+#if HAS_IO_URING
+		fd_batch_restart();
+#endif
+		sender_restart();
+		stats_restart();
+		spare_restart();
+		if (trace_record) {
+			fd_recording(record_restart());
+		}
+		DEBUG("fork: %d", (int)getpid());
+		atomic_store_explicit(&trace_forked, false, memory_order_release);
+	}
+	spin_unlock(&fork_lock);
+}
+
+static inline void
+fd_restart(void)
+{
+	if (unlikely(atomic_load_explicit(&trace_forked, memory_order_acquire))) {
+		fd_respawn();
 	}
 }
 
+/* The parent keeps its pool, but now shares the listener with the child. */
+static void
+fd_forked(void)
+{
+	spare_fork(false);
+}
+
 void
-trace_init(int max, int fd, int mode)
+trace_init(int max, int fd, const struct trace_opt *opt)
 {
 	max_fd = max;
 	if (fd >= 0 && fd <= max) {
 		trace_fd = fd;
 	}
-	trace_mode = mode;
+	trace_mode = opt->mode;
+	/* Sent data can only be told apart from received data by the
+	 * multiplexing header. */
+	if (!(trace_mode & TRACE_MULTIPLEX)) {
+		trace_mode &= ~TRACE_TX;
+	}
+	/* Events need the binary header to carry their type. */
+	if (!(trace_mode & TRACE_MULTIPLEX) || (trace_mode & TRACE_TEXT)) {
+		trace_mode &= ~TRACE_EVENTS;
+	}
+	/* As do gap markers, and a skipped frame is only recognisable by the
+	 * sequence number it leaves out. */
+	if (!(trace_mode & TRACE_MULTIPLEX) || (trace_mode & TRACE_TEXT)) {
+		trace_mode &= ~TRACE_DROP;
+	}
+	/* A recording is indexed by the binary header, which compressed
+	 * blocks would hide, and only sees frames sent over its socket. It
+	 * holds to the drop policy so a slow disk never holds up the
+	 * application. */
+	if (opt->record) {
+		if ((trace_mode & (TRACE_MULTIPLEX|TRACE_TEXT|TRACE_SHM|TRACE_COMPRESS)) ==
+				TRACE_MULTIPLEX) {
+			trace_record = true;
+			trace_mode |= TRACE_DROP;
+		}
+		else {
+			DEBUG("record failed: needs the plain binary header");
+		}
+	}
+	/* Data sent with sendfile is only ever reported as a gap, so sent data
+	 * brings gaps along even without the drop policy. */
+	trace_gaps = (trace_mode & TRACE_DROP) ||
+		((trace_mode & (TRACE_TX|TRACE_TEXT)) == TRACE_TX);
+	burst_max = opt->burst;
+	burst_age = opt->burst_age;
+	coalesce_max = opt->coalesce;
+	coalesce_frames = opt->coalesce_frames;
+	coalesce_delay = opt->coalesce_delay;
+	sample_rate = opt->sample < TRACE_SAMPLE_ALL ? opt->sample : TRACE_SAMPLE_ALL;
+	sample_peer = opt->sample_peer;
+	shm_size = opt->shm;
+	shm_huge = opt->shm_huge;
+
+	table_init(&entries, sizeof(struct entry), max);
+	table_init(&chans, sizeof(struct chan), max);
+	fd_ids();
+
+	/* The sender thread also drains burst buffers when writing directly,
+	 * which under the drop policy hold the tails of partly written frames.
+	 * While coalescing it must wake often enough to honour the delay.
+	 * Without the drop policy, a direct write to a buffered channel could
+	 * only wait out another thread's send, so those go through the sender
+	 * thread instead. */
+	if ((burst_max > 0 || coalesce_max > 0) && !(trace_mode & TRACE_DROP)) {
+		trace_mode |= TRACE_ASYNC;
+	}
+	if (trace_mode & (TRACE_ASYNC|TRACE_DROP) || burst_max > 0 || coalesce_max > 0) {
+		struct sender_opt so = {
+			.ringsize = opt->ringsize,
+			.cpu = opt->cpu,
+			.send = fd_dequeue,
+			.stop = fd_stopped,
+			.drain = fd_drain,
+			.idle = coalesce_max > 0 ? (long)coalesce_delay * 1000 / 2 : 0
+		};
+#if HAS_IO_URING
+		if (trace_mode & TRACE_URING) {
+			fd_batch_init(trace_mode & TRACE_SQPOLL);
+			if (uring_on) {
+				so.flush = fd_flush;
+			}
+		}
+#endif
+		if (!sender_init(&so)) {
+			trace_mode &= ~TRACE_ASYNC;
+		}
+	}
+
+	/* Blocks are compressed from coalesced batches, only ever on the
+	 * sender thread, and need the binary header to be told apart. */
+	if ((trace_mode & TRACE_COMPRESS) && (trace_mode & TRACE_ASYNC) &&
+			(trace_mode & TRACE_MULTIPLEX) && !(trace_mode & (TRACE_TEXT|TRACE_SHM)) &&
+			coalesce_max > 0) {
+		pack_size = coalesce_max < PACK_MAX ? coalesce_max : PACK_MAX;
+		pack_out = malloc(sizeof(struct mux_hdr) + lz4_bound(pack_size));
+		if (pack_out == NULL) { pack_size = 0; }
+	}
+	if (pack_size == 0) {
+		trace_mode &= ~TRACE_COMPRESS;
+	}
+
+	/* Consumers are accepted off the application's threads. Should the
+	 * helper fail to start they are accepted as clients are instead, while
+	 * pushing to collectors only ever happens on the helper. The recorder
+	 * is a consumer of its own, alongside any others. */
+	if (trace_fd >= 0 || opt->push || trace_record) {
+		trace_on = true;
+		bool stats = stats_init(trace_mode, trace_mode & TRACE_LATENCY);
+		struct spare_opt sp = {
+			.fd = trace_fd,
+			.max = max,
+			.shared = trace_mode & TRACE_MULTIPLEX,
+			.push = trace_fd < 0 ? opt->push : NULL,
+			.conns = opt->push_conns,
+			.cork = opt->push_cork,
+			.ready = fd_ready,
+			.hangup = fd_hangup,
+			.alive = fd_alive,
+			.backlog = fd_backlog,
+			.drop = fd_release,
+			.tick = stats ? fd_tick : NULL
+		};
+		spare_init(&sp);
+		if (trace_record) {
+			struct record_opt ro = {
+				.dir = opt->record,
+				.size = opt->record_size,
+				.age = opt->record_age
+			};
+			fd_recording(record_init(&ro));
+		}
+		pthread_atfork(NULL, fd_forked, fd_fork);
+	}
+}
+
+/* A forked child is readied as it first waits on a traced listener, so its
+ * helper can gather consumers before the first connection arrives. */
+void
+trace_accepting(int serverfd)
+{
+	if (trace_on && unlikely(atomic_load_explicit(&trace_forked, memory_order_relaxed)) &&
+			filter_listener(serverfd)) {
+		fd_respawn();
+	}
 }
 
 void
-trace_start(int clientfd, int serverfd)
+trace_start(int clientfd, int serverfd,
+		const struct sockaddr *addr, const socklen_t *addrlen)
 {
-	if (clientfd < 0 || clientfd > max_fd) { return; }
+	if (!trace_on || clientfd < 0 || clientfd > max_fd) { return; }
 
-	(void)serverfd;
+	/* An fd closed behind our back may have left a connection waiting for
+	 * adoption from before a fork. */
+	struct entry *old = table_get(&entries, clientfd);
+	if (old && unlikely(atomic_exchange_explicit(&old->adopt, false, memory_order_relaxed))) {
+		atomic_fetch_sub_explicit(&trace_live, 1, memory_order_relaxed);
+	}
 
-	int tracefd = fd_restore();
-	if (tracefd < 0) {
-		tracefd = xaccept(trace_fd, true);
-		if (tracefd < 0 && trace_mode & TRACE_MULTIPLEX) {
-			tracefd = fd_multi();
+	/* A filtered or unsampled connection is never paired, so its reads
+	 * stop at the entry lookup. */
+	if (!filter_listener(serverfd)) {
+		DEBUG("no listener: %d", clientfd);
+		return;
+	}
+
+	struct sockaddr_storage ss;
+	const struct sockaddr *peer = NULL;
+	if (filter_peers() || (sample_peer && sample_rate < TRACE_SAMPLE_ALL)) {
+		peer = fd_peer(clientfd, addr, addrlen, &ss);
+	}
+	if (!filter_peer(peer)) {
+		DEBUG("no peer: %d", clientfd);
+		return;
+	}
+	if (sample_rate < TRACE_SAMPLE_ALL && !fd_sample(peer)) {
+		DEBUG("no sample: %d", clientfd);
+		return;
+	}
+	fd_restart();
+
+	/* A client sticks to one shared consumer, which only matters once there
+	 * is more than one to choose from. Clients without an IP address are
+	 * spread by their fd instead. */
+	uint64_t key = 0;
+	if ((trace_mode & TRACE_MULTIPLEX) && spare_count() > 1) {
+		if (peer == NULL && !filter_peers()) {
+			peer = fd_peer(clientfd, addr, addrlen, &ss);
+		}
+		if (!fd_host(peer, &key)) {
+			key = fd_hash(&clientfd, sizeof(clientfd));
 		}
 	}
-	if (tracefd >= 0) {
+
+	int tracefd = fd_spare(key);
+	if (tracefd >= 0 && fd_pair(clientfd, tracefd)) {
 		DEBUG("pair: %d->%d", clientfd, tracefd);
-		fd_pair(clientfd, tracefd);
+		if (trace_mode & TRACE_EVENTS) {
+			fd_born(table_get(&entries, clientfd));
+		}
 	}
 	else {
+		if (tracefd >= 0) {
+			fd_release(tracefd);
+		}
+		stats_add(STATS_NO_PAIR, 1);
 		DEBUG("no pair: %d", clientfd);
 	}
 }
@@ -212,55 +1900,209 @@ trace_start(int clientfd, int serverfd)
 void
 trace_stop(int clientfd)
 {
-	int tracefd = fd_get_pair(clientfd);
-	if (tracefd >= 0) {
-		if (trace_mode & TRACE_MULTIPLEX) {
-			char multi[MULTIBUF];
-			struct iovec iov = { .iov_base = multi, .iov_len = 0 };
-			fd_trace(clientfd, tracefd, &iov, 1, 0);
+	filter_forget(clientfd);
+
+	struct entry *e = table_get(&entries, clientfd);
+	int tracefd = fd_get_pair(e);
+	if (tracefd < 0) {
+		if (e && atomic_exchange_explicit(&e->adopt, false, memory_order_relaxed)) {
+			atomic_fetch_sub_explicit(&trace_live, 1, memory_order_relaxed);
+		}
+		return;
+	}
+
+	struct mux_close cl;
+	size_t len = 0;
+	if (trace_mode & TRACE_EVENTS) {
+		fd_opened(clientfd, e, tracefd);
+		len = fd_close_event(e, MUX_CLOSE_APP, &cl);
+	}
+
+	if (trace_mode & TRACE_SHM) {
+		struct iovec iov = { .iov_base = &cl, .iov_len = len };
+		fd_record(e, tracefd, SHMRING_CLOSE, 0, 0, &iov, 1, len);
+		fd_unpair(clientfd, e, tracefd, false);
+		return;
+	}
+
+	if (trace_mode & TRACE_ASYNC) {
+		int expect = tracefd + 1;
+		uint64_t seq = fd_seq(e);
+		if (atomic_compare_exchange_strong(&e->fd, &expect, 0)) {
+			atomic_fetch_sub_explicit(&trace_live, 1, memory_order_relaxed);
+			fd_paired(table_get(&chans, tracefd), -1);
+			sender_stop(clientfd, tracefd, fd_get_id(e), seq, TRACE_STOP_MARK, &cl, len);
 		}
-		fd_unpair(clientfd, tracefd, false);
+		return;
+	}
+
+	if (trace_mode & TRACE_MULTIPLEX) {
+		_Alignas(8) char multi[MULTIBUF];
+		struct iovec iov[2] = {
+			{ .iov_base = multi, .iov_len = 0 },
+			{ .iov_base = &cl, .iov_len = len }
+		};
+		fd_trace(clientfd, e, tracefd, MUX_CLOSE, 0, iov, len ? 2 : 1, len);
 	}
+	fd_unpair(clientfd, e, tracefd, false);
 }
 
-void
-trace(int clientfd, const char *buf, ssize_t len)
+/* Pairs a connection inherited across a fork with a consumer of this
+ * process. It stays waiting to be adopted while the pool is empty. */
+static int
+fd_adopt(int clientfd, struct entry *e)
+{
+	if (!atomic_exchange_explicit(&e->adopt, false, memory_order_acquire)) {
+		return fd_get_pair(e);
+	}
+	fd_restart();
+
+	uint64_t key = 0;
+	if ((trace_mode & TRACE_MULTIPLEX) && spare_count() > 1) {
+		struct sockaddr_storage ss;
+		if (!fd_host(fd_peer(clientfd, NULL, NULL, &ss), &key)) {
+			key = fd_hash(&clientfd, sizeof(clientfd));
+		}
+	}
+
+	int tracefd = fd_spare(key);
+	if (tracefd >= 0 && fd_pair(clientfd, tracefd)) {
+		/* The pairing counts itself as live. */
+		atomic_fetch_sub_explicit(&trace_live, 1, memory_order_relaxed);
+		DEBUG("adopt: %d->%d", clientfd, tracefd);
+		if (trace_mode & TRACE_EVENTS) {
+			fd_born(e);
+		}
+		return tracefd;
+	}
+	if (tracefd >= 0) {
+		fd_release(tracefd);
+	}
+	atomic_store_explicit(&e->adopt, true, memory_order_release);
+	return -1;
+}
+
+static inline int
+fd_lookup(int clientfd, struct entry **ep)
 {
-	if (len == 0) { return; }
+	struct entry *e = *ep = table_get(&entries, clientfd);
+	int tracefd = fd_get_pair(e);
+	if (unlikely(tracefd < 0) && e &&
+			unlikely(atomic_load_explicit(&e->adopt, memory_order_relaxed))) {
+		tracefd = fd_adopt(clientfd, e);
+	}
+	return tracefd;
+}
 
-	int tracefd = fd_get_pair(clientfd);
+static void
+fd_send(int clientfd, uint8_t flags, const char *buf, size_t len)
+{
+	struct entry *e;
+	int tracefd = fd_lookup(clientfd, &e);
 	if (tracefd > -1) {
 		/* Set up an extra buffer for possible multiplexing. */
-		char multi[MULTIBUF];
+		_Alignas(8) char multi[MULTIBUF];
 		struct iovec iov[2] = {
 			{ .iov_base = multi, .iov_len = 0 },
 			{ .iov_base = (char *)buf, .iov_len = len }
 		};
-		fd_trace(clientfd, tracefd, iov, countof(iov), len);
+		fd_trace(clientfd, e, tracefd, MUX_DATA, flags, iov, countof(iov), len);
 	}
 }
 
-void
-tracev(int clientfd, const struct iovec *iov, size_t iovcnt)
+static void
+fd_sendv(int clientfd, uint8_t flags, const struct iovec *iov, size_t iovcnt, size_t max)
 {
-	int tracefd = fd_get_pair(clientfd);
-	if (tracefd > -1) {
-		/* Set up an extra buffer for possible multiplexing. */
-		char multi[MULTIBUF];
-		struct iovec copy[iovcnt+1];
-		copy[0].iov_base = multi;
-		copy[0].iov_len = 0;
+	struct entry *e;
+	int tracefd = fd_lookup(clientfd, &e);
+	if (tracefd < 0) { return; }
 
-		ssize_t len = 0;
+	/* Set up an extra buffer for possible multiplexing, and trim the
+	 * vector to the bytes actually transferred. Each frame is written
+	 * with a single writev, so longer vectors are split into frames of
+	 * at most FRAME_IOV entries including the header. */
+	_Alignas(8) char multi[MULTIBUF];
+	struct iovec copy[(iovcnt < FRAME_IOV ? iovcnt : FRAME_IOV - 1) + 1];
+	copy[0].iov_base = multi;
 
-		for (size_t i = 0; i < iovcnt; i++) {
-			len += iov[i].iov_len;
-			copy[i+1] = iov[i];
+	size_t total = 0, i = 0;
+	while (i < iovcnt && total < max) {
+		size_t len = 0, n = 1;
+		for (; i < iovcnt && total < max && n < countof(copy); i++) {
+			size_t part = iov[i].iov_len;
+			if (part > max - total) { part = max - total; }
+			if (part == 0) { continue; }
+			copy[n].iov_base = iov[i].iov_base;
+			copy[n].iov_len = part;
+			len += part;
+			total += part;
+			n++;
 		}
 
 		if (len > 0) {
-			fd_trace(clientfd, tracefd, copy, iovcnt+1, len);
+			copy[0].iov_len = 0;
+			fd_trace(clientfd, e, tracefd, MUX_DATA, flags, copy, n, len);
+			/* The pair is dropped if the channel failed. */
+			if (fd_get_pair(e) != tracefd) { return; }
 		}
 	}
 }
 
+bool
+trace_active(int clientfd)
+{
+	return fd_get_pair(table_get(&entries, clientfd)) >= 0;
+}
+
+void
+trace(int clientfd, const char *buf, ssize_t len)
+{
+	if (len > 0) {
+		fd_send(clientfd, 0, buf, len);
+	}
+}
+
+void
+tracev(int clientfd, const struct iovec *iov, size_t iovcnt, size_t len)
+{
+	if (len > 0) {
+		fd_sendv(clientfd, 0, iov, iovcnt, len);
+	}
+}
+
+void
+trace_tx(int clientfd, const char *buf, ssize_t len)
+{
+	if ((trace_mode & TRACE_TX) && len > 0) {
+		fd_send(clientfd, MUX_FLAG_TX, buf, len);
+	}
+}
+
+void
+tracev_tx(int clientfd, const struct iovec *iov, size_t iovcnt, size_t len)
+{
+	if ((trace_mode & TRACE_TX) && len > 0) {
+		fd_sendv(clientfd, MUX_FLAG_TX, iov, iovcnt, len);
+	}
+}
+
+void
+trace_file_tx(int clientfd, int filefd, const off_t *offset, size_t len)
+{
+	if (!(trace_mode & TRACE_TX) || len == 0 ||
+			fd_get_pair(table_get(&entries, clientfd)) < 0) {
+		return;
+	}
+
+	/* The kernel copied the file data directly, and reading it back would
+	 * cost the application a second read of every byte, where the file can
+	 * be read again at all. The range is reported as a gap instead, taking
+	 * up a frame number and its place in the sent stream like a frame
+	 * skipped under the drop policy. */
+	(void)filefd;
+	(void)offset;
+	struct entry *e = table_get(&entries, clientfd);
+	uint64_t off = atomic_fetch_add_explicit(&e->tx, len, memory_order_relaxed);
+	DEBUG_MORE("sendfile skip: %d, %zu", clientfd, len);
+	fd_skip(e, fd_get_id(e), fd_seq(e), MUX_FLAG_TX, off, len);
+}
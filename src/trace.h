@@ -10,21 +10,81 @@
 #define TRACE_DEBUG      (1<<0)
 #define TRACE_DEBUG_MORE (1<<1)
 #define TRACE_MULTIPLEX  (1<<2)
+#define TRACE_ASYNC      (1<<3)
+#define TRACE_URING      (1<<4)
+#define TRACE_SQPOLL     (1<<5)
+#define TRACE_SHM        (1<<6)
+#define TRACE_TEXT       (1<<7)
+#define TRACE_TX         (1<<8)
+#define TRACE_EVENTS     (1<<9)
+#define TRACE_DROP       (1<<10)
+#define TRACE_LATENCY    (1<<11)
+#define TRACE_COMPRESS   (1<<12)
+
+#define TRACE_SAMPLE_ALL 1000000
+
+/* Counts the traced connections, including those a forked child has yet to
+ * pair again. The data hooks go straight to libc while it is zero, unless
+ * every call is being logged. */
+extern atomic_uint trace_live;
+
+static inline bool
+trace_idle(void)
+{
+	return atomic_load_explicit(&trace_live, memory_order_relaxed) == 0;
+}
+
+struct trace_opt {
+	int mode;         /* TRACE_* flags. */
+	size_t ringsize;  /* Per-thread ring size for TRACE_ASYNC. */
+	int cpu;          /* CPU for the TRACE_ASYNC sender thread, or -1. */
+	size_t burst;     /* Bytes a slow channel may buffer, or 0 to disconnect. */
+	unsigned burst_age; /* Milliseconds buffered bytes may wait. */
+	size_t coalesce;  /* Bytes to gather per channel before sending, or 0. */
+	unsigned coalesce_frames; /* Frames to gather per channel before sending. */
+	unsigned coalesce_delay;  /* Microseconds a gathered frame may wait. */
+	unsigned sample;  /* Connections to trace per million, sampled at accept. */
+	bool sample_peer; /* Sample by a hash of the peer address instead. */
+	size_t shm;       /* Shared-memory ring size for TRACE_SHM. */
+	bool shm_huge;    /* Back the ring with huge pages when available. */
+	const char *push; /* Collectors to connect out to when there is no listener. */
+	unsigned push_conns; /* Connections to keep open to each collector. */
+	bool push_cork;   /* Cork pushed TCP connections instead of disabling Nagle. */
+	const char *record; /* Directory to record segments to, or NULL. */
+	size_t record_size; /* Bytes per recorded segment. */
+	unsigned record_age; /* Seconds before a segment is rotated, or 0. */
+};
 
 void
-trace_init(int max_fd, int fd, int mode);
+trace_init(int max_fd, int fd, const struct trace_opt *opt);
 
 void
-trace_start(int clientfd, int serverfd);
+trace_accepting(int serverfd);
+
+void
+trace_start(int clientfd, int serverfd,
+		const struct sockaddr *addr, const socklen_t *addrlen);
 
 void
 trace_stop(int clientfd);
 
+bool
+trace_active(int clientfd);
+
 void
 trace(int clientfd, const char *buf, ssize_t len);
 
 void
-tracev(int clientfd, const struct iovec *iov, size_t iovcnt);
+tracev(int clientfd, const struct iovec *iov, size_t iovcnt, size_t len);
+
+void
+trace_tx(int clientfd, const char *buf, ssize_t len);
+
+void
+tracev_tx(int clientfd, const struct iovec *iov, size_t iovcnt, size_t len);
+
+void
+trace_file_tx(int clientfd, int filefd, const off_t *offset, size_t len);
 
 #endif
 
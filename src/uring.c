@@ -0,0 +1,182 @@
+#include "uring.h"
+
+#if HAS_IO_URING
+
+#include "bypass.h"
+#include "util.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static inline unsigned
+load_acquire(const unsigned *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+store_release(unsigned *p, unsigned v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+bool
+uring_init(struct uring *u, unsigned entries, bool sqpoll)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	if (sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+
+	int fd = (int)xsyscall(SYS_io_uring_setup, entries, (long)&p, 0, 0, 0, 0);
+	if (fd < 0) { return false; }
+
+	u->fd = fd;
+	u->sqpoll = sqpoll;
+	u->entries = p.sq_entries;
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	u->sq_map = mmap(NULL, u->sq_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED) { goto error; }
+	u->cq_map = mmap(NULL, u->cq_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (u->cq_map == MAP_FAILED) { goto error; }
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) { goto error; }
+
+	char *sq = u->sq_map, *cq = u->cq_map;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* The SQ array is an identity mapping onto the SQE slots. */
+	for (unsigned i = 0; i < p.sq_entries; i++) {
+		u->sq_array[i] = i;
+	}
+	return true;
+
+error:
+	if (u->sq_map && u->sq_map != MAP_FAILED) { munmap(u->sq_map, u->sq_len); }
+	if (u->cq_map && u->cq_map != MAP_FAILED) { munmap(u->cq_map, u->cq_len); }
+	close(fd);
+	memset(u, 0, sizeof(*u));
+	return false;
+}
+
+void
+uring_free(struct uring *u)
+{
+	/* The SQE array has its own mapping; its length was never kept. */
+	munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+	munmap(u->cq_map, u->cq_len);
+	munmap(u->sq_map, u->sq_len);
+	if (u->fd >= 0) { xclose(u->fd); }
+	memset(u, 0, sizeof(*u));
+}
+
+struct io_uring_sqe *
+uring_sqe(struct uring *u)
+{
+	unsigned tail = *u->sq_tail + u->queued;
+	if (tail - load_acquire(u->sq_head) >= u->entries) {
+		return NULL;
+	}
+	struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->queued++;
+	return sqe;
+}
+
+static int
+uring_enter(struct uring *u, unsigned n, unsigned wait, unsigned flags)
+{
+	return retry((int)xsyscall(SYS_io_uring_enter, u->fd, n, wait, flags, 0, 0));
+}
+
+int
+uring_submit(struct uring *u, unsigned wait)
+{
+	store_release(u->sq_tail, *u->sq_tail + u->queued);
+	u->queued = 0;
+
+	if (u->sqpoll) {
+		/* The kernel thread picks up new entries on its own, and is only
+		 * woken with a system call once it has gone idle. Completions are
+		 * then awaited by spinning on the CQ ring, waking it again should
+		 * it go idle with entries left. */
+		for (;;) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if ((load_acquire(u->sq_flags) & IORING_SQ_NEED_WAKEUP) &&
+					*u->sq_tail != load_acquire(u->sq_head) &&
+					uring_enter(u, 0, 0, IORING_ENTER_SQ_WAKEUP) < 0) {
+				return -1;
+			}
+			if (load_acquire(u->cq_tail) - *u->cq_head >= wait) {
+				return 0;
+			}
+			cpu_relax();
+		}
+	}
+
+	/* The kernel takes entries from the SQ head, and may take fewer than
+	 * asked, so the count is always what is left between head and tail,
+	 * including any a failed call left behind. It only waits once every
+	 * entry has been taken. */
+	unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int taken = 0;
+	for (;;) {
+		unsigned n = *u->sq_tail - load_acquire(u->sq_head);
+		if (n == 0 && wait == 0) { return taken; }
+		int rc = uring_enter(u, n, wait, flags);
+		if (rc < 0) { return -1; }
+		taken += rc;
+		if ((unsigned)rc == n) { return taken; }
+		if (rc == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+}
+
+unsigned
+uring_withdraw(struct uring *u)
+{
+	/* Only this thread enters the ring, so without a kernel thread polling
+	 * it, entries past the head are still ours to take back. */
+	if (u->sqpoll) { return 0; }
+	unsigned head = load_acquire(u->sq_head), n = *u->sq_tail - head;
+	store_release(u->sq_tail, head);
+	return n;
+}
+
+struct io_uring_cqe *
+uring_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+	if (head == load_acquire(u->cq_tail)) {
+		return NULL;
+	}
+	return &u->cqes[head & *u->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *u)
+{
+	store_release(u->cq_head, *u->cq_head + 1);
+}
+
+#endif
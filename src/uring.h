@@ -0,0 +1,54 @@
+#ifndef TEEXEC_URING_H
+#define TEEXEC_URING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#if HAS_IO_URING
+
+#include <linux/io_uring.h>
+
+/* A minimal io_uring instance driven through the raw system calls, so there
+ * is no dependency on liburing. It is used by a single thread. */
+struct uring {
+	int fd;
+	bool sqpoll;
+	unsigned entries;
+	unsigned queued;       /* SQEs filled in but not yet published. */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len;
+};
+
+bool
+uring_init(struct uring *u, unsigned entries, bool sqpoll);
+
+void
+uring_free(struct uring *u);
+
+struct io_uring_sqe *
+uring_sqe(struct uring *u);
+
+/* Submits the queued SQEs, along with any an earlier call left in the ring,
+ * and waits for `wait` completions once all are taken. On failure, the SQEs
+ * the kernel did not take are left in the ring. */
+int
+uring_submit(struct uring *u, unsigned wait);
+
+/* Takes back the SQEs left in the ring by a failed submit, which are always
+ * the last ones queued, and returns how many there were. */
+unsigned
+uring_withdraw(struct uring *u);
+
+struct io_uring_cqe *
+uring_cqe(struct uring *u);
+
+void
+uring_cqe_seen(struct uring *u);
+
+#endif
+
+#endif
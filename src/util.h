@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #define export __attribute__((visibility("default")))
 #define constructor(name) __attribute__((constructor)) static void name(void)
@@ -42,5 +44,35 @@
 	val; \
 })
 
+#if defined(__x86_64__) || defined(__i386__)
+# define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+# define cpu_relax() __asm__ __volatile__("yield")
+#else
+# define cpu_relax() ((void)0)
+#endif
+
+static inline void
+spin_lock(atomic_flag *f)
+{
+	for (unsigned n = 0;
+			atomic_flag_test_and_set_explicit(f, memory_order_acquire); n++) {
+		if (n > 64) { sched_yield(); }
+		else        { cpu_relax(); }
+	}
+}
+
+static inline bool
+spin_trylock(atomic_flag *f)
+{
+	return !atomic_flag_test_and_set_explicit(f, memory_order_acquire);
+}
+
+static inline void
+spin_unlock(atomic_flag *f)
+{
+	atomic_flag_clear_explicit(f, memory_order_release);
+}
+
 #endif
 
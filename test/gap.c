@@ -0,0 +1,90 @@
+/* Checks that a frame carrying a gap marker still fits in a single write.
+ * trace.c is included whole, as in the microbenchmarks, so a channel can be
+ * paired by hand. A socket pair is filled until a frame is dropped, then
+ * drained, and a vector as wide as IOV_MAX is traced: it must arrive behind
+ * the gap with the channel still paired. */
+
+#include "trace.c"
+#include "sock.h"
+
+#include <stdio.h>
+#include <err.h>
+
+#define CLIENT_FD 1000
+
+static char *stream;
+static size_t stream_len, stream_cap;
+
+static void
+drain(int fd)
+{
+	for (;;) {
+		if (stream_cap - stream_len < 65536) {
+			stream_cap = stream_cap ? stream_cap * 2 : 1 << 20;
+			stream = realloc(stream, stream_cap);
+			if (stream == NULL) { err(1, "realloc"); }
+		}
+		ssize_t n = read(fd, stream + stream_len, stream_cap - stream_len);
+		if (n <= 0) { break; }
+		stream_len += (size_t)n;
+	}
+}
+
+int
+main(void)
+{
+	struct trace_opt opt = { .mode = TRACE_MULTIPLEX|TRACE_DROP, .sample = TRACE_SAMPLE_ALL };
+	trace_init(CLIENT_FD + 1, -1, &opt);
+
+	int sv[2], size = 4096;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { err(1, "socketpair"); }
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	sock_nonblock(sv[1], true);
+
+	struct chan *c = table_make(&chans, sv[0]);
+	if (c == NULL) { errx(1, "sink fd out of range: %d", sv[0]); }
+	atomic_store(&c->refs, 2);
+	c->slot = -1;
+	if (!fd_pair(CLIENT_FD, sv[0])) { errx(1, "pair failed"); }
+	struct entry *e = table_get(&entries, CLIENT_FD);
+
+	static char buf[4096];
+	memset(buf, 'x', sizeof(buf));
+	for (int i = 0; i < 1024 && atomic_load(&e->gap.frames) == 0; i++) {
+		trace(CLIENT_FD, buf, sizeof(buf));
+	}
+	if (atomic_load(&e->gap.frames) == 0) { errx(1, "no frame was dropped"); }
+	drain(sv[1]);
+
+	static struct iovec iov[IOV_MAX];
+	for (int i = 0; i < IOV_MAX; i++) {
+		iov[i] = (struct iovec) { .iov_base = buf + i, .iov_len = 1 };
+	}
+	tracev(CLIENT_FD, iov, IOV_MAX, IOV_MAX);
+	if (fd_get_pair(e) != sv[0]) {
+		printf("FAIL: channel dropped tracing %d iovecs behind a gap\n", IOV_MAX);
+		return 1;
+	}
+	drain(sv[1]);
+
+	/* The stream must parse to its end, with the whole vector after the
+	 * gap marker. */
+	size_t off = 0, after = 0;
+	bool gap = false;
+	while (off + sizeof(struct mux_hdr) <= stream_len) {
+		struct mux_hdr h;
+		memcpy(&h, stream + off, sizeof(h));
+		if (h.magic != MUX_MAGIC) { break; }
+		if (h.type == MUX_GAP) { gap = true; }
+		else if (gap && h.type == MUX_DATA) { after += mux_le32(h.len); }
+		off += sizeof(h) + mux_le32(h.len);
+	}
+	if (off != stream_len || !gap || after != IOV_MAX) {
+		printf("FAIL: stream %zu/%zu, gap %d, %zu bytes after it\n",
+				off, stream_len, gap, after);
+		return 1;
+	}
+	printf("ok: %d iovecs behind a gap\n", IOV_MAX);
+	return 0;
+}